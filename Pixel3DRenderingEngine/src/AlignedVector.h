@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+//An allocator that returns memory aligned to nAlignment bytes
+//std::vector only guarantees the alignment of its element type. SIMD loads of whole cache lines want more than that
+template <typename T, std::size_t nAlignment>
+struct AlignedAllocator {
+	typedef T value_type;
+
+	template <typename U>
+	struct rebind { typedef AlignedAllocator<U, nAlignment> other; };
+
+	AlignedAllocator() = default;
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U, nAlignment>&) {}
+
+	T* allocate(std::size_t n) {
+		return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(nAlignment)));
+	}
+
+	void deallocate(T* p, std::size_t) {
+		::operator delete(p, std::align_val_t(nAlignment));
+	}
+
+	template <typename U>
+	bool operator == (const AlignedAllocator<U, nAlignment>&) const { return true; }
+	template <typename U>
+	bool operator != (const AlignedAllocator<U, nAlignment>&) const { return false; }
+};
+
+//Width of the widest SIMD register we use (AVX2) in bytes. Streams are aligned to this
+static const std::size_t nSimdAlignment = 32;
+
+//A std::vector whose data starts on a SIMD register boundary
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T, nSimdAlignment>>;
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//The index buffer of a mesh. Three indices per triangle
+//The indices are 16 bit when every vertex of the mesh fits (65536 vertices at most) and 32 bit otherwise. Most meshes fit,
+//and for them the indices take half the memory and half the bandwidth. The loops that go through the triangles every frame are templates
+//on the index type and get the array with Data<Index>(). operator [] is for everything else, it checks the width on every call
+class IndexBuffer {
+public:
+	static const std::size_t nMax16BitVertices = 65536;
+
+	//Replace the indices. They are stored with 16 bits if nVertexCount allows it
+	void Assign(const std::vector<uint32_t>& vecIndices, std::size_t nVertexCount) {
+		if (nVertexCount <= nMax16BitVertices) {
+			std::vector<uint16_t> vecIndices16(vecIndices.size());
+			for (std::size_t i = 0; i < vecIndices.size(); i++) vecIndices16[i] = (uint16_t)vecIndices[i];
+			Assign16(std::move(vecIndices16));
+		}
+		else Assign32(std::vector<uint32_t>(vecIndices));
+	}
+
+	void Assign16(std::vector<uint16_t>&& vecIndices) {
+		indices16 = std::move(vecIndices);
+		indices32.clear();
+		b32Bit = false;
+	}
+
+	void Assign32(std::vector<uint32_t>&& vecIndices) {
+		indices32 = std::move(vecIndices);
+		indices16.clear();
+		b32Bit = true;
+	}
+
+	void clear() {
+		indices16.clear();
+		indices32.clear();
+		b32Bit = false;
+	}
+
+	bool Is32Bit() const { return b32Bit; }
+	std::size_t size() const { return b32Bit ? indices32.size() : indices16.size(); }
+	bool empty() const { return size() == 0; }
+	uint32_t operator [] (std::size_t i) const { return b32Bit ? indices32[i] : (uint32_t)indices16[i]; }
+
+	//The array of the indices. Index must be the type they are stored with (See Is32Bit())
+	template<typename Index>
+	const Index* Data() const;
+
+	//The arrays themselves. Only the one of the width in use holds the indices, the other one is empty
+	const std::vector<uint16_t>& Indices16() const { return indices16; }
+	const std::vector<uint32_t>& Indices32() const { return indices32; }
+
+	//All the indices as 32 bit numbers
+	std::vector<uint32_t> ToVector() const {
+		if (b32Bit) return indices32;
+		return std::vector<uint32_t>(indices16.begin(), indices16.end());
+	}
+
+private:
+	std::vector<uint16_t> indices16;
+	std::vector<uint32_t> indices32;
+	bool b32Bit = false;
+};
+
+template<>
+inline const uint16_t* IndexBuffer::Data<uint16_t>() const { return indices16.data(); }
+
+template<>
+inline const uint32_t* IndexBuffer::Data<uint32_t>() const { return indices32.data(); }
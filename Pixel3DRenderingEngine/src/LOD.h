@@ -0,0 +1,340 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "Math/Math.h"
+
+//A level of detail of a mesh. The levels are stored one after the other in the arrays of the mesh, so a level is a range of its triangles, its vertices and its meshlets
+//Level 0 is the full mesh. Every level after it is a simplified copy of the full mesh with about half the triangles of the level before (See QuadricSimplifier)
+struct MeshLOD {
+	uint32_t nFirstTriangle = 0;
+	uint32_t nTriangleCount = 0;
+	uint32_t nFirstVertex = 0; // the indices of the level count from this vertex, so they fit the index width of level 0. The meshlet vertex ranges don't, they are absolute
+	uint32_t nVertexCount = 0;
+	uint32_t nFirstMeshlet = 0;
+	uint32_t nMeshletCount = 0;
+	uint32_t nBVHRoot = 0; // the root of the hierarchy over the meshlets of the level in the node array of the mesh
+	float fError = 0.0f; // estimate of how far the simplified surface is off the full one on average, in object space (See QuadricSimplifier::Simplify()). 0 for level 0
+};
+
+//Number of levels a mesh gets at most, level 0 included
+static const uint32_t nMaxLODs = 8;
+
+//Every level aims for this fraction of the triangles of the level before
+static const float fLODReduction = 0.5f;
+
+//No level has fewer triangles than this. The chain also ends when a level can't get rid of at least a quarter of the triangles of the level before
+static const uint32_t nMinLODTriangles = 64;
+
+//Largest error of a level, as a fraction of the radius of the bounding sphere of the mesh. Simplifying further than that only makes levels nobody can use
+static const float fMaxLODError = 0.1f;
+
+//The sum of the squared distances of a point to a set of planes (Garland and Heckbert, "Surface Simplification Using Quadric Error Metrics")
+//Every plane is weighted by the area of its triangle. The sum divided by the sum of the weights is the mean squared distance, which is in the units of the mesh
+struct Quadric {
+	double a00 = 0.0, a01 = 0.0, a02 = 0.0, a11 = 0.0, a12 = 0.0, a22 = 0.0;
+	double b0 = 0.0, b1 = 0.0, b2 = 0.0;
+	double c = 0.0;
+	double dWeight = 0.0;
+
+	//The plane of the points p with n.p + d = 0. n must be of length 1
+	static Quadric FromPlane(double nx, double ny, double nz, double d, double dWeight) {
+		Quadric q;
+		q.a00 = dWeight * nx * nx; q.a01 = dWeight * nx * ny; q.a02 = dWeight * nx * nz;
+		q.a11 = dWeight * ny * ny; q.a12 = dWeight * ny * nz; q.a22 = dWeight * nz * nz;
+		q.b0 = dWeight * nx * d; q.b1 = dWeight * ny * d; q.b2 = dWeight * nz * d;
+		q.c = dWeight * d * d;
+		q.dWeight = dWeight;
+		return q;
+	}
+
+	Quadric& operator += (const Quadric& q) {
+		a00 += q.a00; a01 += q.a01; a02 += q.a02; a11 += q.a11; a12 += q.a12; a22 += q.a22;
+		b0 += q.b0; b1 += q.b1; b2 += q.b2;
+		c += q.c;
+		dWeight += q.dWeight;
+		return *this;
+	}
+
+	//Root of the mean squared distance of p to the planes. Single planes can be further away than that, it's an average and not a bound
+	double Error(const Math::Vector3& p) const {
+		if (dWeight <= 0.0) return 0.0;
+		const double x = p.x, y = p.y, z = p.z;
+		const double dSum = a00 * x * x + a11 * y * y + a22 * z * z + 2.0 * (a01 * x * y + a02 * x * z + a12 * y * z) + 2.0 * (b0 * x + b1 * y + b2 * z) + c;
+		return std::sqrt(std::max(dSum, 0.0) / dWeight);
+	}
+};
+
+//Simplifies a mesh by collapsing its edges, the cheapest ones first. An edge collapse moves one vertex onto the other one and the 2 triangles of the edge disappear
+//The cost of a collapse is the error of the quadric of both vertices at the position of the one that stays (a half edge collapse). The vertices never move anywhere else,
+//so the simplified mesh only uses vertices of the full mesh, with their normals and texture coordinates
+//Some vertices are kept where they are: the ones on more than one border, the ones of edges with more than 2 triangles, and the ones that share their position
+//with another vertex. Those are the seams of the normals and the texture coordinates, moving one side of a seam would tear it open. The border vertices only move along their border
+//The seams don't collapse together, the whole seam stays as it is in every level. A mesh that is split up a lot by its normals (flat shading, hard edges) or its texture
+//coordinates has a lot of locked vertices, so its levels can fall short of the target and its chain can end early. A mesh with every vertex on a seam doesn't simplify at all
+class QuadricSimplifier {
+public:
+	//nTriangleCount triangles of pIndices, of the vertices at (pX[i], pY[i], pZ[i]). Everything is copied
+	QuadricSimplifier(const uint32_t* pIndices, std::size_t nTriangleCount, const float* pX, const float* pY, const float* pZ, std::size_t nVertexCount) {
+		indices.assign(pIndices, pIndices + nTriangleCount * 3);
+		positions.resize(nVertexCount);
+		for (std::size_t i = 0; i < nVertexCount; i++) positions[i] = Math::Vector3(pX[i], pY[i], pZ[i]);
+		vecDead.assign(nTriangleCount, false);
+		nLiveTriangles = nTriangleCount;
+
+		//Triangles with a corner twice have no area and no edges to collapse
+		vecVertexTriangles.resize(nVertexCount);
+		for (uint32_t t = 0; t < (uint32_t)nTriangleCount; t++) {
+			const uint32_t a = indices[t * 3], b = indices[t * 3 + 1], c = indices[t * 3 + 2];
+			if (a == b || b == c || c == a) {
+				vecDead[t] = true;
+				nLiveTriangles--;
+				continue;
+			}
+			for (std::size_t k = 0; k < 3; k++) vecVertexTriangles[indices[t * 3 + k]].push_back(t);
+		}
+
+		//Vertices at the same position as another vertex
+		vecKind.assign(nVertexCount, Interior);
+		std::unordered_map<uint64_t, uint32_t> mapPositions;
+		mapPositions.reserve(nVertexCount);
+		for (uint32_t v = 0; v < (uint32_t)nVertexCount; v++) {
+			if (vecVertexTriangles[v].empty()) continue;
+			const uint64_t nKey = HashPosition(positions[v]);
+			std::unordered_map<uint64_t, uint32_t>::iterator other = mapPositions.find(nKey);
+			if (other == mapPositions.end()) mapPositions.insert({ nKey, v });
+			else if (positions[other->second].x == positions[v].x && positions[other->second].y == positions[v].y && positions[other->second].z == positions[v].z) {
+				vecKind[v] = Locked;
+				vecKind[other->second] = Locked;
+			}
+		}
+
+		//Every edge as it is used by the triangles, from one corner to the next. An edge with no triangle going the other way is on a border
+		std::unordered_map<uint64_t, uint32_t> mapEdges;
+		mapEdges.reserve(nLiveTriangles * 3);
+		for (uint32_t t = 0; t < (uint32_t)nTriangleCount; t++) {
+			if (vecDead[t]) continue;
+			for (std::size_t k = 0; k < 3; k++) mapEdges[EdgeKey(indices[t * 3 + k], indices[t * 3 + (k + 1) % 3])]++;
+		}
+
+		quadrics.assign(nVertexCount, Quadric());
+		std::vector<uint32_t> vecBorderEdges(nVertexCount, 0);
+		for (uint32_t t = 0; t < (uint32_t)nTriangleCount; t++) {
+			if (vecDead[t]) continue;
+			const Math::Vector3& p0 = positions[indices[t * 3]];
+			Math::Vector3 normal = Math::Vec3CrossProduct(positions[indices[t * 3 + 1]] - p0, positions[indices[t * 3 + 2]] - p0);
+			const float fLength = normal.Magnitude();
+
+			//The plane of the triangle, weighted by its area. A triangle without area has no plane, but its edges still count for the borders
+			if (fLength > 0.0f) {
+				normal = normal / fLength;
+				const Quadric plane = Quadric::FromPlane(normal.x, normal.y, normal.z, -Math::Vec3DotProduct(normal, p0), 0.5 * fLength);
+				for (std::size_t k = 0; k < 3; k++) quadrics[indices[t * 3 + k]] += plane;
+			}
+
+			for (std::size_t k = 0; k < 3; k++) {
+				const uint32_t a = indices[t * 3 + k], b = indices[t * 3 + (k + 1) % 3];
+				const uint32_t nUses = mapEdges[EdgeKey(a, b)];
+				std::unordered_map<uint64_t, uint32_t>::const_iterator opposite = mapEdges.find(EdgeKey(b, a));
+				if (nUses > 1 || (opposite != mapEdges.end() && opposite->second > 1)) {
+					vecKind[a] = Locked;
+					vecKind[b] = Locked;
+				}
+				if (opposite != mapEdges.end()) continue;
+
+				//A border edge. The plane through it at a right angle to the triangle keeps the border from moving in or out
+				//It's weighted heavier than the triangles, a border that moves shows more than a surface that bends
+				const Math::Vector3 edge = positions[b] - positions[a];
+				Math::Vector3 side = Math::Vec3CrossProduct(edge, normal);
+				const float fSideLength = side.Magnitude();
+				if (fLength > 0.0f && fSideLength > 0.0f) {
+					side = side / fSideLength;
+					const Quadric border = Quadric::FromPlane(side.x, side.y, side.z, -Math::Vec3DotProduct(side, positions[a]), fBorderWeight * Math::Vec3DotProduct(edge, edge));
+					quadrics[a] += border;
+					quadrics[b] += border;
+				}
+				vecBorderEdges[a]++;
+				vecBorderEdges[b]++;
+			}
+		}
+		for (std::size_t v = 0; v < nVertexCount; v++) {
+			if (vecKind[v] == Interior && vecBorderEdges[v] > 0) vecKind[v] = vecBorderEdges[v] == 2 ? Border : Locked;
+		}
+	}
+
+	//Collapse edges until nTargetTriangles triangles are left, or until no edge is left that can be collapsed with an error below fMaxError
+	//Call it again with a smaller target to go on from where it stopped. Returns the largest error of all the collapses so far. Every one of them is the
+	//area weighted RMS distance of Quadric::Error(), so the result estimates the mean error of the worst collapse. Single vertices can be further off than that
+	//Every pass ranks all the edges and then collapses them cheapest first. An edge whose vertices another collapse of the pass already touched waits for the next pass
+	//A pass only goes up to 1.5 times the error of the collapse that would reach the target if every collapse before it worked out. The expensive ones wait too,
+	//the collapses of the pass make cheaper ones next to them
+	float Simplify(std::size_t nTargetTriangles, float fMaxError) {
+		struct Collapse {
+			float fError;
+			uint32_t nFrom, nTo;
+		};
+		std::vector<Collapse> vecCollapses;
+		std::vector<bool> vecTouched;
+		while (nLiveTriangles > nTargetTriangles) {
+			vecCollapses.clear();
+			for (uint32_t t = 0; t < (uint32_t)vecDead.size(); t++) {
+				if (vecDead[t]) continue;
+				for (std::size_t k = 0; k < 3; k++) {
+					const uint32_t a = indices[t * 3 + k], b = indices[t * 3 + (k + 1) % 3];
+					for (const std::pair<uint32_t, uint32_t>& edge : { std::make_pair(a, b), std::make_pair(b, a) }) {
+						if (vecKind[edge.first] == Locked || (vecKind[edge.first] == Border && vecKind[edge.second] == Interior)) continue;
+						Quadric quadric = quadrics[edge.first];
+						quadric += quadrics[edge.second];
+						const float fError = (float)quadric.Error(positions[edge.second]);
+						if (fError <= fMaxError) vecCollapses.push_back({ fError, edge.first, edge.second });
+					}
+				}
+			}
+			if (vecCollapses.empty()) break;
+			std::sort(vecCollapses.begin(), vecCollapses.end(), [](const Collapse& a, const Collapse& b) {
+				return a.fError != b.fError ? a.fError < b.fError : a.nFrom != b.nFrom ? a.nFrom < b.nFrom : a.nTo < b.nTo;
+			});
+			//Both triangles of an edge listed it
+			vecCollapses.erase(std::unique(vecCollapses.begin(), vecCollapses.end(), [](const Collapse& a, const Collapse& b) {
+				return a.nFrom == b.nFrom && a.nTo == b.nTo;
+			}), vecCollapses.end());
+			//Most collapses remove 2 triangles
+			const std::size_t nGoal = std::max((nLiveTriangles - nTargetTriangles) / 2, (std::size_t)1);
+			const float fPassError = vecCollapses[std::min(nGoal, vecCollapses.size()) - 1].fError * 1.5f;
+
+			vecTouched.assign(positions.size(), false);
+			std::size_t nCollapsed = 0;
+			for (const Collapse& collapse : vecCollapses) {
+				if (nLiveTriangles <= nTargetTriangles || collapse.fError > fPassError) break;
+				if (vecTouched[collapse.nFrom] || vecTouched[collapse.nTo] || !CanCollapse(collapse.nFrom, collapse.nTo)) continue;
+				DoCollapse(collapse.nFrom, collapse.nTo);
+				vecTouched[collapse.nFrom] = true;
+				vecTouched[collapse.nTo] = true;
+				fError = std::max(fError, collapse.fError);
+				nCollapsed++;
+			}
+			if (nCollapsed == 0) break;
+		}
+		return fError;
+	}
+
+	std::size_t TriangleCount() const { return nLiveTriangles; }
+
+	//The triangles that are left, 3 vertex numbers each, and for each of them the number of the triangle it was in the mesh that was simplified
+	void GetTriangles(std::vector<uint32_t>& vecIndices, std::vector<uint32_t>& vecSourceTriangles) const {
+		vecIndices.clear();
+		vecSourceTriangles.clear();
+		for (uint32_t t = 0; t < (uint32_t)vecDead.size(); t++) {
+			if (vecDead[t]) continue;
+			vecIndices.insert(vecIndices.end(), indices.begin() + t * 3, indices.begin() + t * 3 + 3);
+			vecSourceTriangles.push_back(t);
+		}
+	}
+
+private:
+	enum VertexKind : uint8_t {
+		Interior,
+		Border,	// on exactly one border. Only moves along it
+		Locked	// never moves. Other vertices can still move onto it
+	};
+
+	//Weight of the border planes, per squared length of the edge
+	static constexpr double fBorderWeight = 10.0;
+
+	static uint64_t EdgeKey(uint32_t a, uint32_t b) { return ((uint64_t)a << 32) | b; }
+
+	static uint64_t HashPosition(const Math::Vector3& p) {
+		const float fPosition[3] = { p.x + 0.0f, p.y + 0.0f, p.z + 0.0f };
+		uint32_t nBits[3];
+		std::memcpy(nBits, fPosition, sizeof(nBits));
+		return ((uint64_t)nBits[0] * 0x9e3779b97f4a7c15ull) ^ ((uint64_t)nBits[1] * 0xc2b2ae3d27d4eb4full) ^ ((uint64_t)nBits[2] * 0x165667b19e3779f9ull);
+	}
+
+	bool HasCorner(uint32_t t, uint32_t v) const {
+		return indices[t * 3] == v || indices[t * 3 + 1] == v || indices[t * 3 + 2] == v;
+	}
+
+	//True if moving nFrom onto nTo keeps the surface in one piece and doesn't turn any triangle over
+	bool CanCollapse(uint32_t nFrom, uint32_t nTo) const {
+		//The edge must still be there. A border vertex only moves along a border edge, an edge of a single triangle
+		uint32_t nShared = 0;
+		for (uint32_t t : vecVertexTriangles[nFrom]) {
+			if (!vecDead[t] && HasCorner(t, nTo)) nShared++;
+		}
+		if (nShared == 0 || nShared > 2 || (vecKind[nFrom] == Border && nShared != 1)) return false;
+
+		//The vertices next to both of them must be the third corners of the triangles of the edge, and nothing else
+		//Otherwise the collapse would glue two sheets of the surface together where they only touch at those vertices
+		std::vector<uint32_t>& vecFromNeighbours = vecScratch[0];
+		std::vector<uint32_t>& vecToNeighbours = vecScratch[1];
+		vecFromNeighbours.clear();
+		vecToNeighbours.clear();
+		for (int nSide = 0; nSide < 2; nSide++) {
+			const uint32_t v = nSide == 0 ? nFrom : nTo;
+			std::vector<uint32_t>& vecNeighbours = nSide == 0 ? vecFromNeighbours : vecToNeighbours;
+			for (uint32_t t : vecVertexTriangles[v]) {
+				if (vecDead[t]) continue;
+				for (std::size_t k = 0; k < 3; k++) {
+					if (indices[t * 3 + k] != nFrom && indices[t * 3 + k] != nTo) vecNeighbours.push_back(indices[t * 3 + k]);
+				}
+			}
+			std::sort(vecNeighbours.begin(), vecNeighbours.end());
+			vecNeighbours.erase(std::unique(vecNeighbours.begin(), vecNeighbours.end()), vecNeighbours.end());
+		}
+		uint32_t nCommon = 0;
+		for (uint32_t v : vecFromNeighbours) {
+			if (std::binary_search(vecToNeighbours.begin(), vecToNeighbours.end(), v)) nCommon++;
+		}
+		if (nCommon != nShared) return false;
+
+		//The triangles that stay must keep facing the way they did. A triangle that turns more than about 90 degrees folds the surface over
+		for (uint32_t t : vecVertexTriangles[nFrom]) {
+			if (vecDead[t] || HasCorner(t, nTo)) continue;
+			Math::Vector3 corners[3];
+			for (std::size_t k = 0; k < 3; k++) corners[k] = positions[indices[t * 3 + k]];
+			Math::Vector3 before = Math::Vec3CrossProduct(corners[1] - corners[0], corners[2] - corners[0]);
+			for (std::size_t k = 0; k < 3; k++) {
+				if (indices[t * 3 + k] == nFrom) corners[k] = positions[nTo];
+			}
+			Math::Vector3 after = Math::Vec3CrossProduct(corners[1] - corners[0], corners[2] - corners[0]);
+			if (Math::Vec3DotProduct(before, after) <= 0.01f * before.Magnitude() * after.Magnitude()) return false;
+		}
+		return true;
+	}
+
+	//Move nFrom onto nTo. The triangles of the edge disappear, the other triangles of nFrom go to nTo
+	void DoCollapse(uint32_t nFrom, uint32_t nTo) {
+		for (uint32_t t : vecVertexTriangles[nFrom]) {
+			if (vecDead[t]) continue;
+			if (HasCorner(t, nTo)) {
+				vecDead[t] = true;
+				nLiveTriangles--;
+				continue;
+			}
+			for (std::size_t k = 0; k < 3; k++) {
+				if (indices[t * 3 + k] == nFrom) indices[t * 3 + k] = nTo;
+			}
+			vecVertexTriangles[nTo].push_back(t);
+		}
+		std::vector<uint32_t>().swap(vecVertexTriangles[nFrom]);
+		std::vector<uint32_t>& vecToTriangles = vecVertexTriangles[nTo];
+		vecToTriangles.erase(std::remove_if(vecToTriangles.begin(), vecToTriangles.end(), [this](uint32_t t) { return (bool)vecDead[t]; }), vecToTriangles.end());
+		quadrics[nTo] += quadrics[nFrom];
+	}
+
+	std::vector<uint32_t> indices;
+	std::vector<Math::Vector3> positions;
+	std::vector<Quadric> quadrics;
+	std::vector<VertexKind> vecKind;
+	std::vector<std::vector<uint32_t>> vecVertexTriangles; // the triangles of every vertex. Dead ones are dropped from the list of a vertex when it changes
+	std::vector<bool> vecDead;
+	std::size_t nLiveTriangles = 0;
+	float fError = 0.0f;
+	mutable std::vector<uint32_t> vecScratch[2];
+};
@@ -0,0 +1,227 @@
+#pragma once
+#include <cstddef>
+#include "Mat4x4.h"
+#include "Vector3.h"
+#include "Vector4.h"
+#include "Clipping.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#define MATH_SIMD_X86
+	#include <immintrin.h>
+	#if defined(_MSC_VER)
+		#include <intrin.h>
+		//MSVC lets us use any instruction set in any function
+		#define MATH_TARGET_AVX2
+	#else
+		//GCC and Clang only allow AVX2 intrinsics in functions that are compiled for AVX2
+		#define MATH_TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+#endif
+
+namespace Math {
+
+	//Instruction sets the batched kernels can run on
+	enum class SimdLevel {
+		Scalar,	// plain C++, one vertex at a time
+		SSE,	// 4 vertices at a time
+		AVX2	// 8 vertices at a time
+	};
+
+	//Find the best instruction set the CPU (and the OS) supports
+	static SimdLevel DetectSimdLevel() {
+#if defined(MATH_SIMD_X86)
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		const int nMaxLeaf = info[0];
+		__cpuid(info, 1);
+		const bool bOSXSave = (info[2] & (1 << 27)) != 0;
+		const bool bAVX = (info[2] & (1 << 28)) != 0;
+		//The OS must save the AVX registers on a context switch too
+		if (nMaxLeaf >= 7 && bOSXSave && bAVX && (_xgetbv(0) & 6) == 6) {
+			__cpuidex(info, 7, 0);
+			if (info[1] & (1 << 5)) return SimdLevel::AVX2;
+		}
+#else
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+#endif
+		//SSE2 is always there on x86-64 and on every x86 CPU that is still around
+		return SimdLevel::SSE;
+#else
+		return SimdLevel::Scalar;
+#endif
+	}
+
+	//The instruction set the batched kernels use when nobody asks for a specific one. Detected once
+	static SimdLevel GetSimdLevel() {
+		static const SimdLevel level = DetectSimdLevel();
+		return level;
+	}
+
+	static const char* SimdLevelName(SimdLevel level) {
+		switch (level) {
+		case SimdLevel::AVX2: return "avx2";
+		case SimdLevel::SSE: return "sse";
+		default: return "scalar";
+		}
+	}
+
+	//Transform one position by the (model-view-projection) matrix to clip space
+	//The batched kernels do the exact same operations in the exact same order. So a position transformed here matches the one they produce bit for bit
+	static inline Vector4 Vec3TransformToClip(const Vector3& position, const Mat4x4& m) {
+		return Vector4(
+			position.x * m.element[0][0] + position.y * m.element[1][0] + position.z * m.element[2][0] + m.element[3][0],
+			position.x * m.element[0][1] + position.y * m.element[1][1] + position.z * m.element[2][1] + m.element[3][1],
+			position.x * m.element[0][2] + position.y * m.element[1][2] + position.z * m.element[2][2] + m.element[3][2],
+			position.x * m.element[0][3] + position.y * m.element[1][3] + position.z * m.element[2][3] + m.element[3][3]
+		);
+	}
+
+	//Do the perspective divide and map a clip space position to the screen
+	//The result is (screen x, screen y, z / w, 1 / w). 1 / w is what the depth buffer stores, it's linear across the triangle in screen space
+	//The position must be inside the near and the far plane and the guard band (See IsInsideGuardBand())
+	static inline Vector4 ClipToScreen(const Vector4& v, const float& fScreenWidth, const float& fScreenHeight) {
+		return Vector4(
+			(v.x / v.w * 0.5f + 0.5f) * fScreenWidth,
+			(1.0f - (v.y / v.w * 0.5f + 0.5f)) * fScreenHeight,
+			v.z / v.w,
+			1.0f / v.w
+		);
+	}
+
+	//Transform one position by the matrix, then do the perspective divide and map it to the screen
+	//Vertices outside the near or the far plane or the guard band keep their clip space x, y and z and get w = 0. The renderer clips the triangles that use them
+	static inline Vector4 Vec3TransformToScreen(const Vector3& position, const Mat4x4& m, const float& fScreenWidth, const float& fScreenHeight) {
+		const Vector4 v = Vec3TransformToClip(position, m);
+		if (IsInsideGuardBand(v)) return ClipToScreen(v, fScreenWidth, fScreenHeight);
+		return Vector4(v.x, v.y, v.z, 0.0f);
+	}
+
+#if defined(MATH_SIMD_X86)
+	//Interleave x, y, z and w registers into 4 Vector4s
+	static inline void StoreVec4x4(Vector4* pOutput, __m128 x, __m128 y, __m128 z, __m128 w) {
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+		float* p = &pOutput->x;
+		_mm_storeu_ps(p, x);
+		_mm_storeu_ps(p + 4, y);
+		_mm_storeu_ps(p + 8, z);
+		_mm_storeu_ps(p + 12, w);
+	}
+
+	//SSE version of Vec3TransformToScreen() for x, y and z of 4 vertices
+	//The operations are done in the same order as the scalar version (and without FMA). So every level gives the exact same result
+	static inline void TransformToScreenSSE(__m128 x, __m128 y, __m128 z, const Mat4x4& m, const float& fScreenWidth, const float& fScreenHeight,
+		__m128& outX, __m128& outY, __m128& outZ, __m128& outW) {
+		__m128 r[4];
+		for (int c = 0; c < 4; c++) {
+			r[c] = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(x, _mm_set1_ps(m.element[0][c])),
+				_mm_mul_ps(y, _mm_set1_ps(m.element[1][c]))),
+				_mm_mul_ps(z, _mm_set1_ps(m.element[2][c]))),
+				_mm_set1_ps(m.element[3][c]));
+		}
+
+		const __m128 half = _mm_set1_ps(0.5f);
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 screenX = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_div_ps(r[0], r[3]), half), half), _mm_set1_ps(fScreenWidth));
+		const __m128 screenY = _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(_mm_mul_ps(_mm_div_ps(r[1], r[3]), half), half)), _mm_set1_ps(fScreenHeight));
+		const __m128 screenZ = _mm_div_ps(r[2], r[3]);
+		const __m128 screenW = _mm_div_ps(one, r[3]);
+
+		//Only the lanes between the near and the far plane and inside the guard band take the divided values. The others get w = 0
+		const __m128 guardBandW = _mm_mul_ps(_mm_set1_ps(fGuardBand), r[3]);
+		const __m128 negGuardBandW = _mm_sub_ps(_mm_setzero_ps(), guardBandW);
+		const __m128 mask = _mm_and_ps(
+			_mm_and_ps(_mm_cmpge_ps(r[2], _mm_setzero_ps()), _mm_cmple_ps(r[2], r[3])),
+			_mm_and_ps(
+				_mm_and_ps(_mm_cmple_ps(r[0], guardBandW), _mm_cmpge_ps(r[0], negGuardBandW)),
+				_mm_and_ps(_mm_cmple_ps(r[1], guardBandW), _mm_cmpge_ps(r[1], negGuardBandW))));
+		outX = _mm_or_ps(_mm_and_ps(mask, screenX), _mm_andnot_ps(mask, r[0]));
+		outY = _mm_or_ps(_mm_and_ps(mask, screenY), _mm_andnot_ps(mask, r[1]));
+		outZ = _mm_or_ps(_mm_and_ps(mask, screenZ), _mm_andnot_ps(mask, r[2]));
+		outW = _mm_and_ps(mask, screenW);
+	}
+
+	static void Vec3TransformToScreenBatchSSE(const float* pX, const float* pY, const float* pZ, std::size_t nCount, const Mat4x4& m, float fScreenWidth, float fScreenHeight, Vector4* pOutput) {
+		std::size_t i = 0;
+		for (; i + 4 <= nCount; i += 4) {
+			__m128 x, y, z, w;
+			TransformToScreenSSE(_mm_loadu_ps(pX + i), _mm_loadu_ps(pY + i), _mm_loadu_ps(pZ + i), m, fScreenWidth, fScreenHeight, x, y, z, w);
+			StoreVec4x4(pOutput + i, x, y, z, w);
+		}
+		for (; i < nCount; i++) pOutput[i] = Vec3TransformToScreen(Vector3(pX[i], pY[i], pZ[i]), m, fScreenWidth, fScreenHeight);
+	}
+
+	MATH_TARGET_AVX2
+	static void Vec3TransformToScreenBatchAVX2(const float* pX, const float* pY, const float* pZ, std::size_t nCount, const Mat4x4& m, float fScreenWidth, float fScreenHeight, Vector4* pOutput) {
+		__m256 column[4][4];
+		for (int row = 0; row < 4; row++)
+			for (int c = 0; c < 4; c++)
+				column[row][c] = _mm256_set1_ps(m.element[row][c]);
+
+		const __m256 half = _mm256_set1_ps(0.5f);
+		const __m256 one = _mm256_set1_ps(1.0f);
+		const __m256 width = _mm256_set1_ps(fScreenWidth);
+		const __m256 height = _mm256_set1_ps(fScreenHeight);
+		const __m256 guardBand = _mm256_set1_ps(fGuardBand);
+
+		std::size_t i = 0;
+		for (; i + 8 <= nCount; i += 8) {
+			const __m256 x = _mm256_loadu_ps(pX + i);
+			const __m256 y = _mm256_loadu_ps(pY + i);
+			const __m256 z = _mm256_loadu_ps(pZ + i);
+
+			__m256 r[4];
+			for (int c = 0; c < 4; c++) {
+				r[c] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+					_mm256_mul_ps(x, column[0][c]),
+					_mm256_mul_ps(y, column[1][c])),
+					_mm256_mul_ps(z, column[2][c])),
+					column[3][c]);
+			}
+
+			const __m256 screenX = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(r[0], r[3]), half), half), width);
+			const __m256 screenY = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(r[1], r[3]), half), half)), height);
+			const __m256 screenZ = _mm256_div_ps(r[2], r[3]);
+			const __m256 screenW = _mm256_div_ps(one, r[3]);
+
+			const __m256 guardBandW = _mm256_mul_ps(guardBand, r[3]);
+			const __m256 negGuardBandW = _mm256_sub_ps(_mm256_setzero_ps(), guardBandW);
+			const __m256 mask = _mm256_and_ps(
+				_mm256_and_ps(_mm256_cmp_ps(r[2], _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(r[2], r[3], _CMP_LE_OQ)),
+				_mm256_and_ps(
+					_mm256_and_ps(_mm256_cmp_ps(r[0], guardBandW, _CMP_LE_OQ), _mm256_cmp_ps(r[0], negGuardBandW, _CMP_GE_OQ)),
+					_mm256_and_ps(_mm256_cmp_ps(r[1], guardBandW, _CMP_LE_OQ), _mm256_cmp_ps(r[1], negGuardBandW, _CMP_GE_OQ))));
+			const __m256 outX = _mm256_blendv_ps(r[0], screenX, mask);
+			const __m256 outY = _mm256_blendv_ps(r[1], screenY, mask);
+			const __m256 outZ = _mm256_blendv_ps(r[2], screenZ, mask);
+			const __m256 outW = _mm256_and_ps(mask, screenW);
+
+			StoreVec4x4(pOutput + i, _mm256_castps256_ps128(outX), _mm256_castps256_ps128(outY), _mm256_castps256_ps128(outZ), _mm256_castps256_ps128(outW));
+			StoreVec4x4(pOutput + i + 4, _mm256_extractf128_ps(outX, 1), _mm256_extractf128_ps(outY, 1), _mm256_extractf128_ps(outZ, 1), _mm256_extractf128_ps(outW, 1));
+		}
+		for (; i < nCount; i++) pOutput[i] = Vec3TransformToScreen(Vector3(pX[i], pY[i], pZ[i]), m, fScreenWidth, fScreenHeight);
+	}
+#endif
+
+	//Transform nCount positions by the matrix, do the perspective divide and map them to a fScreenWidth x fScreenHeight screen
+	//The positions come as a structure of arrays (pX[i], pY[i], pZ[i]). So 4 (SSE) or 8 (AVX2) of them are loaded with one instruction per component
+	//Same as calling Vec3TransformToScreen() for every position. If nCount is a multiple of 8 there is no scalar tail at all
+	//If the CPU doesn't support the requested level the best one it supports is used instead
+	static void Vec3TransformToScreenBatch(const float* pX, const float* pY, const float* pZ, std::size_t nCount, const Mat4x4& m, float fScreenWidth, float fScreenHeight, Vector4* pOutput,
+		SimdLevel level = GetSimdLevel()) {
+		if (level > GetSimdLevel()) level = GetSimdLevel();
+#if defined(MATH_SIMD_X86)
+		if (level == SimdLevel::AVX2) {
+			Vec3TransformToScreenBatchAVX2(pX, pY, pZ, nCount, m, fScreenWidth, fScreenHeight, pOutput);
+			return;
+		}
+		if (level == SimdLevel::SSE) {
+			Vec3TransformToScreenBatchSSE(pX, pY, pZ, nCount, m, fScreenWidth, fScreenHeight, pOutput);
+			return;
+		}
+#endif
+		for (std::size_t i = 0; i < nCount; i++) pOutput[i] = Vec3TransformToScreen(Vector3(pX[i], pY[i], pZ[i]), m, fScreenWidth, fScreenHeight);
+	}
+}
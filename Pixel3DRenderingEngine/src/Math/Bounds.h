@@ -0,0 +1,83 @@
+#pragma once
+#include <cmath>
+#include "Mat4x4.h"
+#include "Vector3.h"
+#include "Vector4.h"
+
+namespace Math {
+
+	//Axis aligned bounding box
+	struct AABB {
+		Vector3 min;
+		Vector3 max;
+
+		Vector3 Center() const { return Vector3((min.x + max.x) * 0.5f, (min.y + max.y) * 0.5f, (min.z + max.z) * 0.5f); }
+		Vector3 Extents() const { return Vector3((max.x - min.x) * 0.5f, (max.y - min.y) * 0.5f, (max.z - min.z) * 0.5f); } // half the size along each axis
+	};
+
+	struct BoundingSphere {
+		Vector3 center;
+		float fRadius = 0.0f;
+	};
+
+	//The 6 planes of a view frustum. A plane is (a, b, c, d) and a point p is on the inside if a * p.x + b * p.y + c * p.z + d >= 0
+	//(a, b, c) has unit length, so that value is the distance of the point to the plane
+	struct Frustum {
+		Vector4 planes[6]; // left, right, bottom, top, near, far
+	};
+
+	//Extract the frustum planes from a (view-)projection matrix (Gribb and Hartmann)
+	//We multiply row vectors with matrices (v * m). So clip.x is the dot product of the position with the first column of the matrix and so on
+	//A point is inside when -w <= x <= w, -w <= y <= w and 0 <= z <= w. Each of those comparisons is one plane
+	//The planes are in the space the matrix transforms from. Pass the view-projection matrix to get them in world space
+	static Frustum FrustumFromMatrix(const Mat4x4& m) {
+		Vector4 column[4];
+		for (int c = 0; c < 4; c++) column[c] = Vector4(m.element[0][c], m.element[1][c], m.element[2][c], m.element[3][c]);
+
+		Frustum frustum;
+		frustum.planes[0] = column[3] + column[0]; // left   x >= -w
+		frustum.planes[1] = column[3] - column[0]; // right  x <= w
+		frustum.planes[2] = column[3] + column[1]; // bottom y >= -w
+		frustum.planes[3] = column[3] - column[1]; // top    y <= w
+		frustum.planes[4] = column[2];             // near   z >= 0
+		frustum.planes[5] = column[3] - column[2]; // far    z <= w
+
+		for (Vector4& plane : frustum.planes) {
+			const float fLength = std::sqrt(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+			plane = plane / fLength;
+		}
+		return frustum;
+	}
+
+	//False if the sphere is completely outside one of the planes. It can still be outside the frustum near a corner, so this is conservative
+	static bool FrustumIntersectsSphere(const Frustum& frustum, const BoundingSphere& sphere) {
+		for (const Vector4& plane : frustum.planes) {
+			if (plane.x * sphere.center.x + plane.y * sphere.center.y + plane.z * sphere.center.z + plane.w < -sphere.fRadius) return false;
+		}
+		return true;
+	}
+
+	//False if the box is completely outside one of the planes. Only the corner that is the furthest along the plane normal is tested
+	static bool FrustumIntersectsAABB(const Frustum& frustum, const AABB& box) {
+		for (const Vector4& plane : frustum.planes) {
+			const float x = plane.x >= 0.0f ? box.max.x : box.min.x;
+			const float y = plane.y >= 0.0f ? box.max.y : box.min.y;
+			const float z = plane.z >= 0.0f ? box.max.z : box.min.z;
+			if (plane.x * x + plane.y * y + plane.z * z + plane.w < 0.0f) return false;
+		}
+		return true;
+	}
+
+	//Bounding box of a box that was rotated and translated by the matrix
+	//Each new half size is the sum of the old half sizes weighted by how much the rotation turns them onto that axis
+	static AABB AABBTransform(const AABB& box, const Mat4x4& m) {
+		const Vector3 center = box.Center();
+		const Vector3 extents = box.Extents();
+		Vector3 newCenter, newExtents;
+		for (int c = 0; c < 3; c++) {
+			newCenter.element[c] = center.x * m.element[0][c] + center.y * m.element[1][c] + center.z * m.element[2][c] + m.element[3][c];
+			newExtents.element[c] = extents.x * std::fabs(m.element[0][c]) + extents.y * std::fabs(m.element[1][c]) + extents.z * std::fabs(m.element[2][c]);
+		}
+		return { newCenter - newExtents, newCenter + newExtents };
+	}
+}
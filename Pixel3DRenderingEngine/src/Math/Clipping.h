@@ -0,0 +1,104 @@
+#pragma once
+#include <utility>
+#include "Vector3.h"
+#include "Vector4.h"
+
+namespace Math {
+
+	//Half size of the guard band in normalized device coordinates. The viewport itself is [-1, 1]
+	//Triangles that stay inside the guard band are not clipped at the sides. The rasterizers just clamp their bounding box to the screen
+	//Only triangles that reach further out than this are clipped. That keeps the screen coordinates small enough for the fixed point math of the rasterizer
+	static const float fGuardBand = 8.0f;
+
+	//A triangle clipped by the near, the far and the 4 guard band planes has at most 9 corners (every plane can add one)
+	static const int nMaxClippedPolygonVertices = 9;
+
+	//Bit mask of the clip planes a clip space position is outside of
+	static inline unsigned int ClipOutcode(const Vector4& v) {
+		const float fGuardBandW = fGuardBand * v.w;
+		return (v.z < 0.0f ? 1u : 0u) | (v.z > v.w ? 2u : 0u) |
+			(v.x < -fGuardBandW ? 4u : 0u) | (v.x > fGuardBandW ? 8u : 0u) |
+			(v.y < -fGuardBandW ? 16u : 0u) | (v.y > fGuardBandW ? 32u : 0u);
+	}
+
+	//Is a clip space position between the near plane (z = 0) and the far plane (z = w) and inside the guard band
+	//Triangles with all three corners inside can be projected and rasterized as they are
+	static inline bool IsInsideGuardBand(const Vector4& v) {
+		return ClipOutcode(v) == 0;
+	}
+
+	//A corner of a polygon that is being clipped
+	//weights are its barycentric weights in the triangle it came from. Clip space is linear, so the vertex attributes of the corner are the same mix of the ones of the triangle
+	struct ClipVertex {
+		Vector4 position;
+		Vector3 weights;
+	};
+
+	//Clip a convex polygon against a single clip space plane (Sutherland-Hodgman)
+	//fDistance(v) returns the signed distance of v to the plane, positive on the side we keep
+	template <typename DistanceFunction>
+	static int ClipPolygonAgainstPlane(const ClipVertex* pInput, int nInputCount, ClipVertex* pOutput, DistanceFunction fDistance) {
+		int nOutputCount = 0;
+		for (int i = 0; i < nInputCount; i++) {
+			const ClipVertex& current = pInput[i];
+			const ClipVertex& next = pInput[(i + 1) % nInputCount];
+			const float fCurrentDistance = fDistance(current.position);
+			const float fNextDistance = fDistance(next.position);
+
+			if (fCurrentDistance >= 0.0f) pOutput[nOutputCount++] = current;
+
+			//The edge crosses the plane. Add the point where it crosses
+			if ((fCurrentDistance >= 0.0f) != (fNextDistance >= 0.0f)) {
+				const float t = fCurrentDistance / (fCurrentDistance - fNextDistance);
+				pOutput[nOutputCount].position = Vector4(
+					current.position.x + (next.position.x - current.position.x) * t,
+					current.position.y + (next.position.y - current.position.y) * t,
+					current.position.z + (next.position.z - current.position.z) * t,
+					current.position.w + (next.position.w - current.position.w) * t
+				);
+				pOutput[nOutputCount++].weights = current.weights + (next.weights - current.weights) * t;
+			}
+		}
+		return nOutputCount;
+	}
+
+	//Clip a clip space triangle against the near plane (z = 0), the far plane (z = w) and the guard band
+	//Writes the corners of the clipped polygon to pOutput (nMaxClippedPolygonVertices of them at most) and returns how many there are
+	//Returns 0 if nothing of the triangle is left. The corners that were inside all the planes come out unchanged
+	//If pWeights is not null it receives the barycentric weights of every corner in the triangle (See ClipVertex)
+	static int ClipTriangle(const Vector4& p0, const Vector4& p1, const Vector4& p2, Vector4* pOutput, Vector3* pWeights = nullptr) {
+		const unsigned int nOutcode0 = ClipOutcode(p0), nOutcode1 = ClipOutcode(p1), nOutcode2 = ClipOutcode(p2);
+		//All three corners are outside the same plane. Nothing to clip, the whole triangle goes
+		if (nOutcode0 & nOutcode1 & nOutcode2) return 0;
+
+		//Clip against only the planes some corner is outside of. The polygon goes back and forth between the two arrays
+		const unsigned int nPlanes = nOutcode0 | nOutcode1 | nOutcode2;
+		ClipVertex polygon[2][nMaxClippedPolygonVertices];
+		ClipVertex* pFrom = polygon[0];
+		ClipVertex* pTo = polygon[1];
+		pFrom[0] = { p0, Vector3(1.0f, 0.0f, 0.0f) };
+		pFrom[1] = { p1, Vector3(0.0f, 1.0f, 0.0f) };
+		pFrom[2] = { p2, Vector3(0.0f, 0.0f, 1.0f) };
+		int nCount = 3;
+
+		for (unsigned int nPlane = 0; nPlane < 6; nPlane++) {
+			if (!(nPlanes & (1u << nPlane))) continue;
+			switch (nPlane) {
+			case 0: nCount = ClipPolygonAgainstPlane(pFrom, nCount, pTo, [](const Vector4& v) { return v.z; }); break;
+			case 1: nCount = ClipPolygonAgainstPlane(pFrom, nCount, pTo, [](const Vector4& v) { return v.w - v.z; }); break;
+			case 2: nCount = ClipPolygonAgainstPlane(pFrom, nCount, pTo, [](const Vector4& v) { return v.x + fGuardBand * v.w; }); break;
+			case 3: nCount = ClipPolygonAgainstPlane(pFrom, nCount, pTo, [](const Vector4& v) { return fGuardBand * v.w - v.x; }); break;
+			case 4: nCount = ClipPolygonAgainstPlane(pFrom, nCount, pTo, [](const Vector4& v) { return v.y + fGuardBand * v.w; }); break;
+			case 5: nCount = ClipPolygonAgainstPlane(pFrom, nCount, pTo, [](const Vector4& v) { return fGuardBand * v.w - v.y; }); break;
+			}
+			if (nCount < 3) return 0;
+			std::swap(pFrom, pTo);
+		}
+
+		for (int i = 0; i < nCount; i++) {
+			pOutput[i] = pFrom[i].position;
+			if (pWeights) pWeights[i] = pFrom[i].weights;
+		}
+		return nCount;
+	}
+}
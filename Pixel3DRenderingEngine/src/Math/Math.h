@@ -6,6 +6,9 @@
 #include "Vector2.h"
 #include "Vector3.h"
 #include "Vector4.h"
+#include "BatchTransform.h"
+#include "Clipping.h"
+#include "Bounds.h"
 
 	namespace Math {
 
@@ -16,7 +16,8 @@ namespace Math {
 		inline Vector2_generic(T x, T y) : x(x), y(y) {}
 		inline Vector2_generic(const Vector2_generic& v) : x(v.x), y(v.y) {}
 		inline T Magnitude() const { return (T)std::sqrt(x * x + y * y); }
-		inline Vector2_generic& Normalize()  { this->x /= this->Magnitude(); this->y /= this->Magnitude(); return *this; }
+		//The magnitude is taken once. Dividing x first and then taking the magnitude again for y would give a wrong direction
+		inline Vector2_generic& Normalize()  { const T magnitude = this->Magnitude(); this->x /= magnitude; this->y /= magnitude; return *this; }
 		inline Vector2_generic operator + (const Vector2_generic& rhs)const { return Vector2_generic(this->x + rhs.x, this->y + rhs.y); }
 		inline Vector2_generic operator - (const Vector2_generic& rhs)const { return Vector2_generic(this->x - rhs.x, this->y - rhs.y); }
 		inline Vector2_generic operator * (const T& rhs)const { return Vector2_generic(this->x * rhs, this->y * rhs); }
@@ -16,7 +16,8 @@ namespace Math {
 		inline Vector3_generic(const Vector2_generic<T>& v) : x(v.x), y(v.y), z(0) {}
 		inline Vector3_generic(const Vector3_generic& v) : x(v.x), y(v.y), z(v.z) {}
 		inline T Magnitude() { return (T)std::sqrt(x * x + y * y + z * z); }
-		inline Vector3_generic& Normalize() { this->x /= this->Magnitude(); this->y /= this->Magnitude(); this->z /= this->Magnitude(); return *this; }
+		//The magnitude is taken once. Dividing x first and then taking the magnitude again for y and z would give a wrong direction
+		inline Vector3_generic& Normalize() { const T magnitude = this->Magnitude(); this->x /= magnitude; this->y /= magnitude; this->z /= magnitude; return *this; }
 		inline Vector3_generic operator + (const Vector3_generic& rhs)const { return Vector3_generic(this->x + rhs.x, this->y + rhs.y, this->z + rhs.z); }
 		inline Vector3_generic operator - (const Vector3_generic& rhs)const { return Vector3_generic(this->x - rhs.x, this->y - rhs.y, this->z - rhs.z); }
 		inline Vector3_generic operator * (const T& rhs) const { return Vector3_generic(this->x * rhs, this->y * rhs, this->z * rhs); }
@@ -21,7 +21,8 @@ namespace Math {
 		inline Vector4_generic(const Vector3_generic<T>& v) : x(v.x), y(v.y), z(v.z), w(1.0) {}
 		inline Vector4_generic(const Vector4_generic& v) : x(v.x), y(v.y), z(v.z), w(v.w) {}
 		inline T Magnitude() { return (T)std::sqrt(x * x + y * y + z * z + w * w); }
-		inline Vector4_generic& Normalize() { this->x /= this->Magnitude(); this->y /= this->Magnitude(); this->z /= this->Magnitude(); this->w /= this->Magnitude(); return *this; }
+		//The magnitude is taken once. Dividing x first and then taking the magnitude again for the others would give a wrong direction
+		inline Vector4_generic& Normalize() { const T magnitude = this->Magnitude(); this->x /= magnitude; this->y /= magnitude; this->z /= magnitude; this->w /= magnitude; return *this; }
 		inline Vector4_generic operator + (const Vector4_generic& rhs)const { return Vector4_generic(this->x + rhs.x, this->y + rhs.y, this->z + rhs.z, this->w + rhs.w); }
 		inline Vector4_generic operator - (const Vector4_generic& rhs)const { return Vector4_generic(this->x - rhs.x, this->y - rhs.y, this->z - rhs.z, this->w - rhs.w); }
 		inline Vector4_generic operator * (const T& rhs)const { return Vector4_generic(this->x * rhs, this->y * rhs, this->z * rhs, this->w * rhs); }
@@ -35,7 +36,7 @@ namespace Math {
 		inline T& operator [] (std::size_t index) { return element[index]; }
 
 		inline Vector4_generic operator * (const Mat4x4_generic<T>& rhs) const {
-			Vector4_generic result;
+			Vector4_generic result(0, 0, 0, 0); // The default constructor sets w to 1. That would add an extra 1 to w of every product
 			for (int colomn = 0; colomn < 4; colomn++)
 				for (int row = 0; row < 4; row++)
 					result.element[colomn] += this->element[row] * rhs.element[row][colomn];
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#if defined(_WIN32)
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+//A whole file mapped into memory, read only. The operating system pages it in when it's touched, nothing is read up front
+class MappedFile {
+public:
+	MappedFile() {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator = (const MappedFile&) = delete;
+	~MappedFile() { Close(); }
+
+	bool Open(const std::string& filename) {
+		Close();
+#if defined(_WIN32)
+		hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (hFile == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(hFile, &size) || size.QuadPart == 0) { Close(); return false; }
+		hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!hMapping) { Close(); return false; }
+		pData = (const uint8_t*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+		if (!pData) { Close(); return false; }
+		nSize = (std::size_t)size.QuadPart;
+#else
+		const int nFile = open(filename.c_str(), O_RDONLY);
+		if (nFile < 0) return false;
+		struct stat info;
+		if (fstat(nFile, &info) != 0 || info.st_size <= 0) { close(nFile); return false; }
+		void* pMapping = mmap(nullptr, (std::size_t)info.st_size, PROT_READ, MAP_PRIVATE, nFile, 0);
+		close(nFile); // the mapping keeps the file alive
+		if (pMapping == MAP_FAILED) return false;
+		pData = (const uint8_t*)pMapping;
+		nSize = (std::size_t)info.st_size;
+#endif
+		return true;
+	}
+
+	void Close() {
+#if defined(_WIN32)
+		if (pData) UnmapViewOfFile(pData);
+		if (hMapping) CloseHandle(hMapping);
+		if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+		hMapping = nullptr;
+		hFile = INVALID_HANDLE_VALUE;
+#else
+		if (pData) munmap((void*)pData, nSize);
+#endif
+		pData = nullptr;
+		nSize = 0;
+	}
+
+	const uint8_t* Data() const { return pData; }
+	std::size_t Size() const { return nSize; }
+
+private:
+	const uint8_t* pData = nullptr;
+	std::size_t nSize = 0;
+#if defined(_WIN32)
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	HANDLE hMapping = nullptr;
+#endif
+};
+
+//64 bit FNV-1a hash of some bytes
+static inline uint64_t HashBytes(const void* pData, std::size_t nSize, uint64_t nHash = 0xcbf29ce484222325ull) {
+	const uint8_t* pBytes = (const uint8_t*)pData;
+	for (std::size_t i = 0; i < nSize; i++) {
+		nHash ^= pBytes[i];
+		nHash *= 0x100000001b3ull;
+	}
+	return nHash;
+}
+
+//A file a cache was built from. The cache is out of date when one of them changed
+//The size and the time of the last write are checked first. Only if the time changed but not the size, the file is read again and its hash decides
+//(Copying or checking out a file changes its time without changing it)
+struct MeshCacheSource {
+	uint64_t nSize = 0; // nMissing if the file didn't exist
+	int64_t nWriteTime = 0;
+	uint64_t nHash = 0;
+	uint32_t nNameOffset = 0; // the file name, relative to the directory of the cache. In the string section of the cache
+	uint32_t nNameLength = 0;
+
+	static const uint64_t nMissing = ~0ull;
+
+	//Fill in the size and the time of the file. False if it doesn't exist
+	bool Stat(const std::string& filename) {
+		std::error_code error;
+		const std::uintmax_t nFileSize = std::filesystem::file_size(filename, error);
+		if (error) {
+			nSize = nMissing;
+			nWriteTime = 0;
+			return false;
+		}
+		const std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(filename, error);
+		nSize = (uint64_t)nFileSize;
+		nWriteTime = error ? 0 : (int64_t)writeTime.time_since_epoch().count();
+		return true;
+	}
+
+	//Stat() and hash the file
+	void Read(const std::string& filename) {
+		nHash = 0;
+		if (!Stat(filename)) return;
+		std::ifstream file(filename, std::ios::binary);
+		std::vector<char> buffer(1 << 16);
+		uint64_t nFileHash = HashBytes(nullptr, 0);
+		while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) nFileHash = HashBytes(buffer.data(), (std::size_t)file.gcount(), nFileHash);
+		nHash = nFileHash;
+	}
+
+	//True if the file is still the one the cache was built from
+	bool IsUnchanged(const std::string& filename) const {
+		MeshCacheSource current;
+		current.Stat(filename);
+		if (current.nSize != nSize) return false;
+		if (nSize == nMissing || current.nWriteTime == nWriteTime) return true;
+		current.Read(filename);
+		return current.nHash == nHash;
+	}
+};
+
+//The binary mesh cache file. A header, a table of sections and then the sections. Every section starts on a multiple of nMeshCacheAlignment bytes
+//A section is an array of nCount elements of nElementSize bytes, stored as they are in memory. So the cache only works on the machine (the compiler really) that wrote it,
+//which is fine for a cache. A reader checks the element size of every section it knows, a cache written with other structs is rebuilt instead of misread
+static const char szMeshCacheMagic[8] = { 'P', '3', 'D', 'M', 'E', 'S', 'H', 0 };
+static const uint32_t nMeshCacheAlignment = 64;
+
+struct MeshCacheHeader {
+	char szMagic[8];
+	uint32_t nVersion; // the version of the layout of the sections. Bump it whenever a section changes
+	uint32_t nSectionCount;
+	uint64_t nFileSize; // a file that was cut short doesn't match this
+};
+
+struct MeshCacheSection {
+	uint32_t nType;
+	uint32_t nElementSize;
+	uint64_t nCount;
+	uint64_t nOffset; // from the start of the file
+};
+
+//Collects the sections of a cache file and writes them. The data must stay alive until Write()
+class MeshCacheWriter {
+public:
+	void AddSection(uint32_t nType, const void* pData, std::size_t nElementSize, std::size_t nCount) {
+		sections.push_back({ { nType, (uint32_t)nElementSize, (uint64_t)nCount, 0 }, pData });
+	}
+
+	template<typename T, typename Allocator>
+	void AddSection(uint32_t nType, const std::vector<T, Allocator>& data) {
+		AddSection(nType, data.data(), sizeof(T), data.size());
+	}
+
+	//Write the file under a temporary name and rename it, so no reader ever maps half a file
+	bool Write(const std::string& filename, uint32_t nVersion) const {
+		MeshCacheHeader header;
+		std::memcpy(header.szMagic, szMeshCacheMagic, sizeof(header.szMagic));
+		header.nVersion = nVersion;
+		header.nSectionCount = (uint32_t)sections.size();
+
+		std::vector<MeshCacheSection> table;
+		uint64_t nOffset = AlignUp(sizeof(MeshCacheHeader) + sections.size() * sizeof(MeshCacheSection));
+		for (const PendingSection& section : sections) {
+			table.push_back(section.info);
+			table.back().nOffset = nOffset;
+			nOffset = AlignUp(nOffset + section.info.nCount * section.info.nElementSize);
+		}
+		header.nFileSize = nOffset;
+
+		const std::string sTemporary = filename + ".tmp";
+		{
+			std::ofstream file(sTemporary, std::ios::binary | std::ios::trunc);
+			if (!file.is_open()) return false;
+			file.write((const char*)&header, sizeof(header));
+			file.write((const char*)table.data(), table.size() * sizeof(MeshCacheSection));
+			uint64_t nWritten = sizeof(header) + table.size() * sizeof(MeshCacheSection);
+			const char padding[nMeshCacheAlignment] = {};
+			for (std::size_t i = 0; i < sections.size(); i++) {
+				file.write(padding, (std::streamsize)(table[i].nOffset - nWritten));
+				file.write((const char*)sections[i].pData, (std::streamsize)(table[i].nCount * table[i].nElementSize));
+				nWritten = table[i].nOffset + table[i].nCount * table[i].nElementSize;
+			}
+			file.write(padding, (std::streamsize)(header.nFileSize - nWritten));
+			if (!file) {
+				file.close();
+				std::error_code error;
+				std::filesystem::remove(sTemporary, error);
+				return false;
+			}
+		}
+		std::error_code error;
+		std::filesystem::rename(sTemporary, filename, error);
+		if (error) std::filesystem::remove(sTemporary, error);
+		return !error;
+	}
+
+private:
+	static uint64_t AlignUp(uint64_t n) { return (n + nMeshCacheAlignment - 1) / nMeshCacheAlignment * nMeshCacheAlignment; }
+
+	struct PendingSection {
+		MeshCacheSection info;
+		const void* pData;
+	};
+	std::vector<PendingSection> sections;
+};
+
+//Maps a cache file and finds its sections. The sections point into the mapping, so they are only valid while the reader is open
+class MeshCacheReader {
+public:
+	//False if the file doesn't exist, isn't a cache of this version or is broken
+	bool Open(const std::string& filename, uint32_t nVersion) {
+		if (!file.Open(filename)) return false;
+		const uint8_t* pData = file.Data();
+		const std::size_t nSize = file.Size();
+		if (nSize < sizeof(MeshCacheHeader)) return Fail();
+		const MeshCacheHeader* pHeader = (const MeshCacheHeader*)pData;
+		if (std::memcmp(pHeader->szMagic, szMeshCacheMagic, sizeof(szMeshCacheMagic)) != 0 || pHeader->nVersion != nVersion || pHeader->nFileSize != nSize) return Fail();
+		if (sizeof(MeshCacheHeader) + (uint64_t)pHeader->nSectionCount * sizeof(MeshCacheSection) > nSize) return Fail();
+		pSections = (const MeshCacheSection*)(pData + sizeof(MeshCacheHeader));
+		nSectionCount = pHeader->nSectionCount;
+		for (uint32_t i = 0; i < nSectionCount; i++) {
+			const MeshCacheSection& section = pSections[i];
+			if (section.nOffset % nMeshCacheAlignment != 0 || section.nOffset > nSize || section.nElementSize == 0 ||
+				section.nCount > (nSize - section.nOffset) / section.nElementSize) return Fail();
+		}
+		return true;
+	}
+
+	//The elements of the first section of type nType. False if there is none or its elements aren't nElementSize bytes
+	bool Find(uint32_t nType, std::size_t nElementSize, const void*& pData, std::size_t& nCount) const {
+		for (uint32_t i = 0; i < nSectionCount; i++) {
+			if (pSections[i].nType != nType) continue;
+			if (pSections[i].nElementSize != nElementSize) return false;
+			pData = file.Data() + pSections[i].nOffset;
+			nCount = (std::size_t)pSections[i].nCount;
+			return true;
+		}
+		return false;
+	}
+
+	//Copy a section into a vector
+	template<typename T, typename Allocator>
+	bool Read(uint32_t nType, std::vector<T, Allocator>& data) const {
+		const void* pData = nullptr;
+		std::size_t nCount = 0;
+		if (!Find(nType, sizeof(T), pData, nCount)) return false;
+		data.resize(nCount);
+		if (nCount > 0) std::memcpy((void*)data.data(), pData, nCount * sizeof(T));
+		return true;
+	}
+
+	//A section with exactly one element
+	template<typename T>
+	bool ReadOne(uint32_t nType, T& value) const {
+		const void* pData = nullptr;
+		std::size_t nCount = 0;
+		if (!Find(nType, sizeof(T), pData, nCount) || nCount != 1) return false;
+		std::memcpy((void*)&value, pData, sizeof(T));
+		return true;
+	}
+
+	void Close() {
+		file.Close();
+		pSections = nullptr;
+		nSectionCount = 0;
+	}
+
+private:
+	bool Fail() {
+		Close();
+		return false;
+	}
+
+	MappedFile file;
+	const MeshCacheSection* pSections = nullptr;
+	uint32_t nSectionCount = 0;
+};
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Math/Math.h"
+
+//A cluster of triangles that lie next to each other on the surface of a mesh
+//The triangles of a meshlet are stored one after the other in the index buffer. So a meshlet is just a range of triangles
+//The renderer tests the bounding volumes and the normal cone of a meshlet once, instead of testing each of its triangles
+struct Meshlet {
+	uint32_t nFirstTriangle = 0;
+	uint32_t nTriangleCount = 0;
+
+	//Every vertex the triangles use is in [nFirstVertex, nLastVertex]. Only these vertices have to be transformed if the meshlet is visible
+	uint32_t nFirstVertex = 0;
+	uint32_t nLastVertex = 0;
+
+	//Bounding volumes of the triangles in object space
+	Math::AABB boundingBox;
+	Math::BoundingSphere boundingSphere;
+
+	//Normal cone. The normal of every triangle is at most the cone angle away from coneAxis
+	//fConeCos is the cosine of that angle. It's below 0 when the normals point too far apart for the cone to ever cull anything
+	Math::Vector3 coneAxis;
+	float fConeCos = -1.0f;
+	float fConeSin = 0.0f;
+};
+
+//A node of the bounding volume hierarchy over the meshlets of a mesh
+//The children of a node are next to each other in the node array. The meshlets of a leaf are next to each other in the meshlet array
+struct MeshletBVHNode {
+	Math::AABB boundingBox;
+	uint32_t nFirst = 0; // a leaf: its first meshlet. Otherwise: the index of its first child, the second one is at nFirst + 1
+	uint32_t nCount = 0; // a leaf: the number of meshlets it holds. 0 for the other nodes
+};
+
+//Number of triangles in a meshlet at most
+static const uint32_t nMeshletTriangles = 64;
+
+//A leaf of the hierarchy holds this many meshlets at most
+static const uint32_t nMaxMeshletsPerLeaf = 4;
+
+//Spread the lowest 10 bits of a number out so there are two zero bits between every two of them
+static inline uint32_t MortonSpreadBits(uint32_t n) {
+	n &= 0x3ff;
+	n = (n | (n << 16)) & 0x030000ff;
+	n = (n | (n << 8)) & 0x0300f00f;
+	n = (n | (n << 4)) & 0x030c30c3;
+	n = (n | (n << 2)) & 0x09249249;
+	return n;
+}
+
+//Position of a point along the z-order curve through the box. Points that are close to each other in space are mostly close to each other on the curve too
+//Sorting the triangles by this code is what puts neighbouring triangles into the same meshlet
+static inline uint32_t MortonCode(const Math::Vector3& point, const Math::AABB& box) {
+	const Math::Vector3 size = box.max - box.min;
+	const float fScaleX = size.x > 0.0f ? 1023.0f / size.x : 0.0f;
+	const float fScaleY = size.y > 0.0f ? 1023.0f / size.y : 0.0f;
+	const float fScaleZ = size.z > 0.0f ? 1023.0f / size.z : 0.0f;
+	const uint32_t x = (uint32_t)std::min(std::max((point.x - box.min.x) * fScaleX, 0.0f), 1023.0f);
+	const uint32_t y = (uint32_t)std::min(std::max((point.y - box.min.y) * fScaleY, 0.0f), 1023.0f);
+	const uint32_t z = (uint32_t)std::min(std::max((point.z - box.min.z) * fScaleZ, 0.0f), 1023.0f);
+	return MortonSpreadBits(x) | (MortonSpreadBits(y) << 1) | (MortonSpreadBits(z) << 2);
+}
+
+//Which of the 6 directions (+x, -x, +y, -y, +z, -z) a normal points the most along
+//The triangles are sorted by this before they are sorted in space. A meshlet never mixes two directions, so its normals stay within a narrow cone
+static inline uint32_t NormalDirection(const Math::Vector3& normal) {
+	const float fX = std::fabs(normal.x), fY = std::fabs(normal.y), fZ = std::fabs(normal.z);
+	if (fX >= fY && fX >= fZ) return normal.x >= 0.0f ? 0 : 1;
+	if (fY >= fZ) return normal.y >= 0.0f ? 2 : 3;
+	return normal.z >= 0.0f ? 4 : 5;
+}
+
+//Normal cone culling. True if every triangle of the meshlet faces away from the camera (fFacing = 1) or towards it (fFacing = -1)
+//A triangle faces away if the camera is behind its plane. The worst triangle of the cone is the one whose normal is turned the most towards the camera,
+//and the worst point on it is the one of the bounding sphere that is the closest to the camera along that normal
+static inline bool IsMeshletFacing(const Meshlet& meshlet, const Math::Vector3& camera, float fFacing) {
+	if (meshlet.fConeCos <= 0.0f) return false;
+	const Math::Vector3 toMeshlet = meshlet.boundingSphere.center - camera;
+	const float fAlongAxis = Math::Vec3DotProduct(toMeshlet, meshlet.coneAxis) * fFacing;
+	const float fAcrossAxis = std::sqrt(std::max(Math::Vec3DotProduct(toMeshlet, toMeshlet) - fAlongAxis * fAlongAxis, 0.0f));
+	//|toMeshlet| * cos(angle between the axis and toMeshlet + cone angle)
+	return fAlongAxis * meshlet.fConeCos - fAcrossAxis * meshlet.fConeSin >= meshlet.boundingSphere.fRadius;
+}
+
+//Build a hierarchy over the nCount meshlets from nFirst on, which are already sorted along the z-order curve, and append its nodes to nodes
+//Every node splits its range of meshlets in the middle. Neighbours on the curve are neighbours in space, so the halves come out compact
+//The meshlets are not moved, so nothing else has to be reordered. Returns the root, CullMeshlets() starts there. nCount must not be 0
+static uint32_t AppendMeshletBVH(const std::vector<Meshlet>& meshlets, uint32_t nFirst, uint32_t nCount, std::vector<MeshletBVHNode>& nodes) {
+	struct Range {
+		uint32_t nNode;
+		uint32_t nFirst;
+		uint32_t nCount;
+	};
+	const uint32_t nRoot = (uint32_t)nodes.size();
+	std::vector<Range> stack = { { nRoot, nFirst, nCount } };
+	nodes.emplace_back();
+	while (!stack.empty()) {
+		const Range range = stack.back();
+		stack.pop_back();
+
+		Math::AABB box = meshlets[range.nFirst].boundingBox;
+		for (uint32_t i = range.nFirst + 1; i < range.nFirst + range.nCount; i++) {
+			const Math::AABB& other = meshlets[i].boundingBox;
+			box.min = Math::Vector3(std::min(box.min.x, other.min.x), std::min(box.min.y, other.min.y), std::min(box.min.z, other.min.z));
+			box.max = Math::Vector3(std::max(box.max.x, other.max.x), std::max(box.max.y, other.max.y), std::max(box.max.z, other.max.z));
+		}
+		nodes[range.nNode].boundingBox = box;
+
+		if (range.nCount <= nMaxMeshletsPerLeaf) {
+			nodes[range.nNode].nFirst = range.nFirst;
+			nodes[range.nNode].nCount = range.nCount;
+			continue;
+		}
+
+		const uint32_t nChild = (uint32_t)nodes.size();
+		nodes.emplace_back();
+		nodes.emplace_back();
+		nodes[range.nNode].nFirst = nChild;
+		nodes[range.nNode].nCount = 0;
+
+		const uint32_t nHalf = range.nCount / 2;
+		stack.push_back({ nChild, range.nFirst, nHalf });
+		stack.push_back({ nChild + 1, range.nFirst + nHalf, range.nCount - nHalf });
+	}
+	return nRoot;
+}
+
+//Build the hierarchy over all the meshlets. Its root is node 0
+static void BuildMeshletBVH(const std::vector<Meshlet>& meshlets, std::vector<MeshletBVHNode>& nodes) {
+	nodes.clear();
+	if (!meshlets.empty()) AppendMeshletBVH(meshlets, 0, (uint32_t)meshlets.size(), nodes);
+}
+
+//Walk the hierarchy and append the meshlets that can be visible to vecVisible
+//The frustum and the camera have to be in the object space of the mesh. fFacing picks the faces the cone test culls (See IsMeshletFacing()), 0 turns it off
+//A node that is completely inside some of the planes doesn't test its children against them again. Returns the number of meshlets that were culled
+//nRoot is the node the walk starts at, the root of one of the hierarchies in nodes (See AppendMeshletBVH())
+static uint32_t CullMeshlets(const std::vector<MeshletBVHNode>& nodes, const std::vector<Meshlet>& meshlets, const Math::Frustum& frustum,
+	const Math::Vector3& camera, float fFacing, std::vector<uint32_t>& vecVisible, uint32_t nRoot = 0) {
+	if (nodes.empty()) return 0;
+
+	//Tests the box against the planes in nPlaneMask. Clears the bits of the planes it is completely inside of. False if it's outside one of them
+	auto TestBox = [&frustum](const Math::AABB& box, unsigned int& nPlaneMask) {
+		for (int nPlane = 0; nPlane < 6; nPlane++) {
+			if (!(nPlaneMask & (1u << nPlane))) continue;
+			const Math::Vector4& plane = frustum.planes[nPlane];
+			//The corner the furthest along the normal and the one the furthest against it
+			const float fFar = plane.x * (plane.x >= 0.0f ? box.max.x : box.min.x) + plane.y * (plane.y >= 0.0f ? box.max.y : box.min.y) +
+				plane.z * (plane.z >= 0.0f ? box.max.z : box.min.z) + plane.w;
+			if (fFar < 0.0f) return false;
+			const float fNear = plane.x * (plane.x >= 0.0f ? box.min.x : box.max.x) + plane.y * (plane.y >= 0.0f ? box.min.y : box.max.y) +
+				plane.z * (plane.z >= 0.0f ? box.min.z : box.max.z) + plane.w;
+			if (fNear >= 0.0f) nPlaneMask &= ~(1u << nPlane);
+		}
+		return true;
+	};
+
+	uint32_t nCulled = 0;
+	struct Entry {
+		uint32_t nNode;
+		unsigned int nPlaneMask;
+	};
+	Entry stack[64];
+	int nStackSize = 0;
+	stack[nStackSize++] = { nRoot, 0x3f };
+	while (nStackSize > 0) {
+		Entry entry = stack[--nStackSize];
+		const MeshletBVHNode& node = nodes[entry.nNode];
+		if (!TestBox(node.boundingBox, entry.nPlaneMask)) {
+			//Count the meshlets below this node
+			if (node.nCount > 0) nCulled += node.nCount;
+			else {
+				uint32_t nFirst = entry.nNode, nLast = entry.nNode;
+				while (nodes[nFirst].nCount == 0) nFirst = nodes[nFirst].nFirst;
+				while (nodes[nLast].nCount == 0) nLast = nodes[nLast].nFirst + 1;
+				nCulled += nodes[nLast].nFirst + nodes[nLast].nCount - nodes[nFirst].nFirst;
+			}
+			continue;
+		}
+
+		if (node.nCount == 0) {
+			stack[nStackSize++] = { node.nFirst + 1, entry.nPlaneMask };
+			stack[nStackSize++] = { node.nFirst, entry.nPlaneMask };
+			continue;
+		}
+
+		for (uint32_t i = node.nFirst; i < node.nFirst + node.nCount; i++) {
+			const Meshlet& meshlet = meshlets[i];
+			unsigned int nPlaneMask = entry.nPlaneMask;
+			if (!TestBox(meshlet.boundingBox, nPlaneMask) || (fFacing != 0.0f && IsMeshletFacing(meshlet, camera, fFacing))) {
+				nCulled++;
+				continue;
+			}
+			vecVisible.push_back(i);
+		}
+	}
+	return nCulled;
+}
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Math/Math.h"
+#include "ThreadPool.h"
+
+//A corner of a face of an .obj file: the indices of its position, texture coordinate and normal, starting at 0. -1 if the corner has none
+struct ObjCorner {
+	int nPosition = -1;
+	int nTexCoord = -1;
+	int nNormal = -1;
+};
+
+//What the renderer uses of an .obj file, as the file has it. Mesh::LoadFromOBJFile() turns this into vertices and indices
+struct ObjData {
+	std::vector<Math::Vector3> positions;
+	std::vector<Math::Vector3> normals;
+	std::vector<Math::Vector2> texCoords; // v = 0 is the top of the image here. The file has it at the bottom
+	std::vector<ObjCorner> corners; // three for every triangle. Faces with more corners are already cut into triangles
+	std::vector<uint16_t> triangleMaterials; // index into materialNames of every triangle
+	std::vector<std::string> materialNames; // the names of the usemtl lines. Name 0 is "" and stands for the triangles before the first usemtl line
+	std::vector<std::string> materialLibraries; // the files of the mtllib lines, relative to the .obj file
+
+	//Only needed to put the pieces of a file back together (See ParseObjParallel()). A piece doesn't know the usemtl lines of the pieces before it
+	std::size_t nTrianglesBeforeUsemtl = 0; // triangles before the first usemtl line. They have material 0 here, but really the one that was in use when the piece started
+	int nLastMaterial = -1; // index into materialNames of the last usemtl line, -1 if there was none
+};
+
+//Number of v, vt and vn lines. The indices of a face count these lines from the start of the file
+struct ObjCounts {
+	std::size_t nPositions = 0;
+	std::size_t nTexCoords = 0;
+	std::size_t nNormals = 0;
+};
+
+//Read a whole file into sContents. One read and one allocation, the parser below then works on the memory without copying anything out of it
+static bool ReadWholeFile(const std::string& filename, std::string& sContents) {
+	std::ifstream file(filename, std::ios::binary | std::ios::ate);
+	if (!file.is_open()) return false;
+	const std::streamoff nSize = file.tellg();
+	if (nSize < 0) return false;
+	sContents.resize((std::size_t)nSize);
+	file.seekg(0);
+	return nSize == 0 || (bool)file.read(&sContents[0], nSize);
+}
+
+//The tokenizer of the .obj and .mtl parsers. A line is split into words at spaces and tabs. Nothing is copied, the words point into the file
+struct ObjLineReader {
+	const char* pCurrent;
+	const char* pEnd;
+
+	ObjLineReader(const char* pBegin, const char* pEnd) : pCurrent(pBegin), pEnd(pEnd) {}
+
+	//The next line without its line break (\n or \r\n). False at the end of the file
+	bool NextLine(std::string_view& line) {
+		if (pCurrent >= pEnd) return false;
+		const char* pLineEnd = (const char*)std::memchr(pCurrent, '\n', pEnd - pCurrent);
+		if (!pLineEnd) pLineEnd = pEnd;
+		line = std::string_view(pCurrent, pLineEnd - pCurrent);
+		pCurrent = pLineEnd + 1;
+		return true;
+	}
+
+	//Spaces, tabs, the \r of \r\n line breaks and every other control character
+	static bool IsSpace(char c) { return (unsigned char)c <= ' '; }
+
+	//Cut the next word off the front of line. An empty word means the line has no more
+	static std::string_view NextWord(std::string_view& line) {
+		std::size_t nStart = 0;
+		while (nStart < line.size() && IsSpace(line[nStart])) nStart++;
+		std::size_t nStop = nStart;
+		while (nStop < line.size() && !IsSpace(line[nStop])) nStop++;
+		const std::string_view word = line.substr(nStart, nStop - nStart);
+		line.remove_prefix(nStop);
+		return word;
+	}
+
+	//The rest of the line without the spaces around it. For file names, which can have spaces in them
+	static std::string_view Rest(std::string_view line) {
+		while (!line.empty() && IsSpace(line.front())) line.remove_prefix(1);
+		while (!line.empty() && IsSpace(line.back())) line.remove_suffix(1);
+		return line;
+	}
+
+	//The number at the start of word. fDefault if there is none
+	static float ParseFloat(std::string_view word, float fDefault = 0.0f) {
+		if (!word.empty() && word[0] == '+') word.remove_prefix(1);
+		if (word.empty()) return fDefault;
+		float f = fDefault;
+#if defined(__cpp_lib_to_chars)
+		//Compilers that have std::from_chars() for floats
+		if (std::from_chars(word.data(), word.data() + word.size(), f).ec != std::errc()) return fDefault;
+#else
+		//Older standard libraries (MSVC before 2019) only have std::from_chars() for integers. strtof() also stops at the first character that isn't part of the number,
+		//which is a space or a line break here since the file is a std::string and ends with a 0
+		char* pStop = nullptr;
+		f = std::strtof(word.data(), &pStop);
+		if (pStop == word.data()) return fDefault;
+#endif
+		return f;
+	}
+
+	//The integer at the start of word. Moves word past it. False if there is none
+	static bool ParseInt(std::string_view& word, int& n) {
+		if (!word.empty() && word[0] == '+') word.remove_prefix(1);
+		const std::from_chars_result result = std::from_chars(word.data(), word.data() + word.size(), n);
+		if (result.ec != std::errc()) return false;
+		word.remove_prefix(result.ptr - word.data());
+		return true;
+	}
+};
+
+//Turn an index of a face into one that starts at 0. Positive indices start at 1, negative ones count back from the last element read so far
+//-1 if the index is 0 or outside the nCount elements
+static inline int ResolveObjIndex(int nIndex, std::size_t nCount) {
+	if (nIndex > 0) return (std::size_t)nIndex <= nCount ? nIndex - 1 : -1;
+	if (nIndex < 0) return (std::size_t)(-(int64_t)nIndex) <= nCount ? (int)((int64_t)nCount + nIndex) : -1;
+	return -1;
+}
+
+//Parse the .obj file in [pBegin, pEnd) into data. Reads v, vt, vn, f, usemtl and mtllib lines. Everything else, comments and blank lines are skipped
+//A corner of a face is v, v/vt, v//vn or v/vt/vn. A face with more than 3 corners is cut into a fan of triangles around its first corner
+//A triangle with a corner whose position doesn't exist is dropped. A texture coordinate or normal that doesn't exist is left out of its corner
+//[pBegin, pEnd) can be a piece of a file that starts on a line. before has the number of v, vt and vn lines in the file before the piece,
+//then the indices of the corners are the ones of the whole file
+static void ParseObj(const char* pBegin, const char* pEnd, ObjData& data, const ObjCounts& before = ObjCounts()) {
+	data.materialNames.assign(1, "");
+	data.nTrianglesBeforeUsemtl = 0;
+	data.nLastMaterial = -1;
+	uint16_t nCurrentMaterial = 0;
+
+	ObjLineReader reader(pBegin, pEnd);
+	std::string_view line;
+	while (reader.NextLine(line)) {
+		const std::string_view keyword = ObjLineReader::NextWord(line);
+		if (keyword.empty() || keyword[0] == '#') continue;
+
+		if (keyword == "v") {
+			const float x = ObjLineReader::ParseFloat(ObjLineReader::NextWord(line));
+			const float y = ObjLineReader::ParseFloat(ObjLineReader::NextWord(line));
+			const float z = ObjLineReader::ParseFloat(ObjLineReader::NextWord(line));
+			data.positions.push_back(Math::Vector3(x, y, z));
+		}
+		else if (keyword == "vn") {
+			const float x = ObjLineReader::ParseFloat(ObjLineReader::NextWord(line));
+			const float y = ObjLineReader::ParseFloat(ObjLineReader::NextWord(line));
+			const float z = ObjLineReader::ParseFloat(ObjLineReader::NextWord(line));
+			data.normals.push_back(Math::Vector3(x, y, z));
+		}
+		else if (keyword == "vt") {
+			//v = 0 is the bottom of the image in a .obj file. The textures start with their top row
+			const float u = ObjLineReader::ParseFloat(ObjLineReader::NextWord(line));
+			const float v = ObjLineReader::ParseFloat(ObjLineReader::NextWord(line));
+			data.texCoords.push_back(Math::Vector2(u, 1.0f - v));
+		}
+		else if (keyword == "f") {
+			//Only the first corner and the one before the current one are needed for the fan
+			ObjCorner first, previous;
+			int nCorners = 0;
+			for (std::string_view word = ObjLineReader::NextWord(line); !word.empty(); word = ObjLineReader::NextWord(line)) {
+				ObjCorner corner;
+				int nIndex = 0;
+				if (ObjLineReader::ParseInt(word, nIndex)) corner.nPosition = ResolveObjIndex(nIndex, before.nPositions + data.positions.size());
+				if (!word.empty() && word[0] == '/') {
+					word.remove_prefix(1);
+					if (ObjLineReader::ParseInt(word, nIndex)) corner.nTexCoord = ResolveObjIndex(nIndex, before.nTexCoords + data.texCoords.size());
+					if (!word.empty() && word[0] == '/') {
+						word.remove_prefix(1);
+						if (ObjLineReader::ParseInt(word, nIndex)) corner.nNormal = ResolveObjIndex(nIndex, before.nNormals + data.normals.size());
+					}
+				}
+
+				if (nCorners >= 2 && first.nPosition != -1 && previous.nPosition != -1 && corner.nPosition != -1) {
+					data.corners.push_back(first);
+					data.corners.push_back(previous);
+					data.corners.push_back(corner);
+					data.triangleMaterials.push_back(nCurrentMaterial);
+				}
+				if (nCorners == 0) first = corner;
+				previous = corner;
+				nCorners++;
+			}
+		}
+		else if (keyword == "usemtl") {
+			if (data.nLastMaterial == -1) data.nTrianglesBeforeUsemtl = data.triangleMaterials.size();
+			const std::string_view name = ObjLineReader::Rest(line);
+			nCurrentMaterial = 0;
+			for (std::size_t m = 1; m < data.materialNames.size(); m++) {
+				if (data.materialNames[m] == name) nCurrentMaterial = (uint16_t)m;
+			}
+			if (nCurrentMaterial == 0 && !name.empty()) {
+				nCurrentMaterial = (uint16_t)data.materialNames.size();
+				data.materialNames.push_back(std::string(name));
+			}
+			data.nLastMaterial = nCurrentMaterial;
+		}
+		else if (keyword == "mtllib") {
+			//A mtllib line can name more than one file
+			for (std::string_view word = ObjLineReader::NextWord(line); !word.empty(); word = ObjLineReader::NextWord(line)) {
+				data.materialLibraries.push_back(std::string(word));
+			}
+		}
+	}
+	if (data.nLastMaterial == -1) data.nTrianglesBeforeUsemtl = data.triangleMaterials.size();
+}
+
+//Count the v, vt and vn lines in [pBegin, pEnd)
+static ObjCounts CountObjElements(const char* pBegin, const char* pEnd) {
+	ObjCounts counts;
+	ObjLineReader reader(pBegin, pEnd);
+	std::string_view line;
+	while (reader.NextLine(line)) {
+		const std::string_view keyword = ObjLineReader::NextWord(line);
+		if (keyword.size() < 1 || keyword.size() > 2 || keyword[0] != 'v') continue;
+		if (keyword.size() == 1) counts.nPositions++;
+		else if (keyword[1] == 't') counts.nTexCoords++;
+		else if (keyword[1] == 'n') counts.nNormals++;
+	}
+	return counts;
+}
+
+//ParseObj() on many threads. The file is cut into pieces at line breaks, the pieces are parsed at the same time and then put together
+//The result is the same as the one of ParseObj() on the whole file. A face can use the vertices of any piece before its own (or count back into them),
+//so the v, vt and vn lines of every piece are counted first. Then every piece knows where its vertices start in the whole file
+//A piece is at least nMinChunkSize bytes. Smaller files aren't worth waking the threads up for
+static void ParseObjParallel(const char* pBegin, const char* pEnd, ObjData& data, ThreadPool& threadPool, std::size_t nMinChunkSize = 1 << 20) {
+	const std::size_t nSize = (std::size_t)(pEnd - pBegin);
+	const std::size_t nChunks = std::max<std::size_t>(std::min<std::size_t>(nSize / std::max<std::size_t>(nMinChunkSize, 1), (std::size_t)threadPool.GetThreadCount() * 4), 1);
+	if (nChunks == 1) {
+		ParseObj(pBegin, pEnd, data);
+		return;
+	}
+
+	//Every piece starts on the first line that starts at or after its share of the bytes
+	std::vector<const char*> vecChunkStarts(nChunks + 1, pEnd);
+	vecChunkStarts[0] = pBegin;
+	for (std::size_t c = 1; c < nChunks; c++) {
+		const char* pStart = std::max(pBegin + nSize * c / nChunks, vecChunkStarts[c - 1]);
+		if (pStart > pBegin && pStart[-1] != '\n') {
+			const char* pLineBreak = (const char*)std::memchr(pStart, '\n', pEnd - pStart);
+			pStart = pLineBreak ? pLineBreak + 1 : pEnd;
+		}
+		vecChunkStarts[c] = pStart;
+	}
+
+	//Where the v, vt and vn lines of every piece start in the whole file
+	std::vector<ObjCounts> vecCountsBefore(nChunks + 1);
+	threadPool.ParallelFor((int)nChunks, [&](int nChunk, unsigned int) {
+		vecCountsBefore[nChunk + 1] = CountObjElements(vecChunkStarts[nChunk], vecChunkStarts[nChunk + 1]);
+	});
+	for (std::size_t c = 1; c <= nChunks; c++) {
+		vecCountsBefore[c].nPositions += vecCountsBefore[c - 1].nPositions;
+		vecCountsBefore[c].nTexCoords += vecCountsBefore[c - 1].nTexCoords;
+		vecCountsBefore[c].nNormals += vecCountsBefore[c - 1].nNormals;
+	}
+
+	std::vector<ObjData> vecChunks(nChunks);
+	threadPool.ParallelFor((int)nChunks, [&](int nChunk, unsigned int) {
+		ParseObj(vecChunkStarts[nChunk], vecChunkStarts[nChunk + 1], vecChunks[nChunk], vecCountsBefore[nChunk]);
+	});
+
+	//The material names of the pieces in the order the whole file has them first. vecMaterialAtStart has the material in use when a piece starts
+	//Besides that, the pieces are just copied one after the other. Their corners already have the indices of the whole file
+	data = ObjData();
+	data.materialNames.assign(1, "");
+	std::vector<std::vector<uint16_t>> vecMaterialMaps(nChunks);
+	std::vector<uint16_t> vecMaterialAtStart(nChunks, 0);
+	std::vector<std::size_t> vecCornersBefore(nChunks + 1, 0);
+	uint16_t nCurrentMaterial = 0;
+	data.nLastMaterial = -1;
+	for (std::size_t c = 0; c < nChunks; c++) {
+		const ObjData& chunk = vecChunks[c];
+		vecMaterialMaps[c].assign(chunk.materialNames.size(), 0);
+		for (std::size_t n = 1; n < chunk.materialNames.size(); n++) {
+			std::size_t m = 1;
+			while (m < data.materialNames.size() && data.materialNames[m] != chunk.materialNames[n]) m++;
+			if (m == data.materialNames.size()) data.materialNames.push_back(chunk.materialNames[n]);
+			vecMaterialMaps[c][n] = (uint16_t)m;
+		}
+		vecMaterialAtStart[c] = nCurrentMaterial;
+		if (data.nLastMaterial == -1) data.nTrianglesBeforeUsemtl = vecCornersBefore[c] / 3 + chunk.nTrianglesBeforeUsemtl;
+		if (chunk.nLastMaterial != -1) {
+			nCurrentMaterial = vecMaterialMaps[c][chunk.nLastMaterial];
+			data.nLastMaterial = nCurrentMaterial;
+		}
+		vecCornersBefore[c + 1] = vecCornersBefore[c] + chunk.corners.size();
+		data.materialLibraries.insert(data.materialLibraries.end(), chunk.materialLibraries.begin(), chunk.materialLibraries.end());
+	}
+
+	data.positions.resize(vecCountsBefore[nChunks].nPositions);
+	data.texCoords.resize(vecCountsBefore[nChunks].nTexCoords);
+	data.normals.resize(vecCountsBefore[nChunks].nNormals);
+	data.corners.resize(vecCornersBefore[nChunks]);
+	data.triangleMaterials.resize(vecCornersBefore[nChunks] / 3);
+	threadPool.ParallelFor((int)nChunks, [&](int nChunk, unsigned int) {
+		const ObjData& chunk = vecChunks[nChunk];
+		std::copy(chunk.positions.begin(), chunk.positions.end(), data.positions.begin() + vecCountsBefore[nChunk].nPositions);
+		std::copy(chunk.texCoords.begin(), chunk.texCoords.end(), data.texCoords.begin() + vecCountsBefore[nChunk].nTexCoords);
+		std::copy(chunk.normals.begin(), chunk.normals.end(), data.normals.begin() + vecCountsBefore[nChunk].nNormals);
+		std::copy(chunk.corners.begin(), chunk.corners.end(), data.corners.begin() + vecCornersBefore[nChunk]);
+		const std::size_t nFirstTriangle = vecCornersBefore[nChunk] / 3;
+		for (std::size_t i = 0; i < chunk.triangleMaterials.size(); i++) {
+			data.triangleMaterials[nFirstTriangle + i] = i < chunk.nTrianglesBeforeUsemtl ? vecMaterialAtStart[nChunk] : vecMaterialMaps[nChunk][chunk.triangleMaterials[i]];
+		}
+		//The piece isn't needed anymore
+		vecChunks[nChunk] = ObjData();
+	});
+}
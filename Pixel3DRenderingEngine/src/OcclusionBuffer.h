@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "Math/Math.h"
+
+//A small depth buffer the occluders are drawn into before the frame is rendered. Objects are tested against it to find out if they can be skipped
+//One pixel of it covers nScale x nScale pixels of the screen. The depth values are 1 / w like the ones of the real depth buffer (bigger is nearer, 0 is empty)
+//Everything here is conservative: a pixel only gets the depth of a triangle if the triangle covers all of the pixel,
+//and then it gets the farthest depth of the triangle inside the pixel. So nothing is reported hidden unless the occluders really hide it
+class OcclusionBuffer {
+public:
+	static const int nScale = 4;
+
+	//Size the buffer for a screen of nScreenWidth x nScreenHeight pixels
+	void Resize(int nScreenWidth, int nScreenHeight) {
+		nWidth = (nScreenWidth + nScale - 1) / nScale;
+		nHeight = (nScreenHeight + nScale - 1) / nScale;
+		vecDepth.assign(nWidth * nHeight, 0.0f);
+	}
+
+	void Clear() {
+		std::fill(vecDepth.begin(), vecDepth.end(), 0.0f);
+	}
+
+	//Draw a triangle whose x and y are in screen pixels and whose z is 1 / w
+	//Both windings are drawn. The caller throws away the faces that are culled
+	void RasterizeTriangle(const Math::Vector3& p0, const Math::Vector3& p1, const Math::Vector3& p2) {
+		//Corners of the buffer pixels are on the integer grid in these coordinates
+		const float fInvScale = 1.0f / (float)nScale;
+		float x0 = p0.x * fInvScale, y0 = p0.y * fInvScale;
+		float x1 = p1.x * fInvScale, y1 = p1.y * fInvScale;
+		float x2 = p2.x * fInvScale, y2 = p2.y * fInvScale;
+		float z1 = p1.z, z2 = p2.z;
+		const float z0 = p0.z;
+
+		//Make the inside of every edge function positive
+		float fArea = (x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0);
+		if (fArea == 0.0f) return;
+		if (fArea < 0.0f) {
+			std::swap(x1, x2); std::swap(y1, y2); std::swap(z1, z2);
+			fArea = -fArea;
+		}
+
+		//Pixels whose 4 corners can all be inside the triangle
+		const int nMinX = std::max((int)std::ceil(std::min({ x0, x1, x2 })), 0);
+		const int nMinY = std::max((int)std::ceil(std::min({ y0, y1, y2 })), 0);
+		const int nMaxX = std::min((int)std::floor(std::max({ x0, x1, x2 })), nWidth);
+		const int nMaxY = std::min((int)std::floor(std::max({ y0, y1, y2 })), nHeight);
+		if (nMinX >= nMaxX || nMinY >= nMaxY) return;
+
+		//Edge functions e(x, y) = a * x + b * y + c, positive inside. Edge a goes from p0 to p1, edge b from p1 to p2 and edge c from p2 to p0
+		const float aa = y0 - y1, ba = x1 - x0, ca = x0 * y1 - x1 * y0;
+		const float ab = y1 - y2, bb = x2 - x1, cb = x1 * y2 - x2 * y1;
+		const float ac = y2 - y0, bc = x0 - x2, cc = x2 * y0 - x0 * y2;
+
+		//Depth plane. The smallest value over a pixel is at one of its corners
+		const float dzdx = ((z1 - z0) * (y2 - y0) - (z2 - z0) * (y1 - y0)) / fArea;
+		const float dzdy = ((z2 - z0) * (x1 - x0) - (z1 - z0) * (x2 - x0)) / fArea;
+
+		//How much each function changes towards the worst corner of a pixel from its top left corner
+		const float fWorstA = std::min(aa, 0.0f) + std::min(ba, 0.0f);
+		const float fWorstB = std::min(ab, 0.0f) + std::min(bb, 0.0f);
+		const float fWorstC = std::min(ac, 0.0f) + std::min(bc, 0.0f);
+		const float fWorstZ = std::min(dzdx, 0.0f) + std::min(dzdy, 0.0f);
+
+		for (int y = nMinY; y < nMaxY; y++) {
+			float* pDepth = &vecDepth[y * nWidth];
+			for (int x = nMinX; x < nMaxX; x++) {
+				const float fx = (float)x, fy = (float)y;
+				if (aa * fx + ba * fy + ca + fWorstA < 0.0f) continue;
+				if (ab * fx + bb * fy + cb + fWorstB < 0.0f) continue;
+				if (ac * fx + bc * fy + cc + fWorstC < 0.0f) continue;
+				const float z = z0 + (fx - x0) * dzdx + (fy - y0) * dzdy + fWorstZ;
+				if (z > pDepth[x]) pDepth[x] = z;
+			}
+		}
+	}
+
+	//True if something nearer than fNearestDepth was drawn over every pixel of the screen rectangle [fMinX, fMaxX] x [fMinY, fMaxY]
+	bool IsRectOccluded(float fMinX, float fMinY, float fMaxX, float fMaxY, float fNearestDepth) const {
+		const int nMinX = std::max((int)std::floor(fMinX) / nScale, 0);
+		const int nMinY = std::max((int)std::floor(fMinY) / nScale, 0);
+		const int nMaxX = std::min((int)std::floor(fMaxX) / nScale, nWidth - 1);
+		const int nMaxY = std::min((int)std::floor(fMaxY) / nScale, nHeight - 1);
+		if (nMinX > nMaxX || nMinY > nMaxY) return false;
+
+		for (int y = nMinY; y <= nMaxY; y++) {
+			const float* pDepth = &vecDepth[y * nWidth];
+			for (int x = nMinX; x <= nMaxX; x++) {
+				if (fNearestDepth >= pDepth[x]) return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	int nWidth = 0;
+	int nHeight = 0;
+	std::vector<float> vecDepth;
+};
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "AlignedVector.h"
+
+//A texture and its mip chain, stored for the rasterizer instead of for the image file
+//The texels are 32 bit colors in the layout of olc::Pixel (r in the lowest byte)
+//Every level is cut into tiles of nTileSize x nTileSize texels and a tile is stored as one piece of 64 bytes, which is one cache line
+//A row-major image (like olc::Sprite) puts the texels just above and below a texel a whole row away. A triangle is walked along the rows of the screen,
+//but it runs over the texture in any direction, so every step down the texture would be a new cache line. Here the 4 rows of a tile share one
+class Texture {
+public:
+	static const int nTileShift = 2;
+	static const int nTileSize = 1 << nTileShift;
+	static const int nTileTexels = nTileSize * nTileSize;
+	static const int nMaxLevels = 16; // enough for 32768 x 32768
+
+	//Build the texture and its mip chain from nWidth x nHeight row-major texels. Every texel is multiplied by nTint (a color in the same layout)
+	//The mip chain needs sizes that are powers of two. Other sizes are stretched to the next power of two (nearest texel)
+	void Create(const uint32_t* pTexels, int nWidth, int nHeight, uint32_t nTint = 0xffffffff) {
+		nLevels = 0;
+		texels.clear();
+		if (nWidth <= 0 || nHeight <= 0) return;
+
+		//Level 0, row-major for now
+		int nLevelWidth = 1, nLevelHeight = 1;
+		while (nLevelWidth < nWidth && nLevelWidth < (1 << (nMaxLevels - 1))) nLevelWidth <<= 1;
+		while (nLevelHeight < nHeight && nLevelHeight < (1 << (nMaxLevels - 1))) nLevelHeight <<= 1;
+		std::vector<uint32_t> level(nLevelWidth * nLevelHeight);
+		for (int y = 0; y < nLevelHeight; y++) {
+			const uint32_t* pRow = pTexels + (std::size_t)(y * nHeight / nLevelHeight) * nWidth;
+			for (int x = 0; x < nLevelWidth; x++) level[y * nLevelWidth + x] = MultiplyColors(pRow[x * nWidth / nLevelWidth], nTint);
+		}
+
+		//Every next level averages 2 x 2 texels of the last one, until both sides are 1 texel
+		std::vector<uint32_t> next;
+		while (true) {
+			Level& info = levels[nLevels++];
+			info.nWidthMask = nLevelWidth - 1;
+			info.nHeightMask = nLevelHeight - 1;
+			info.nTilesXShift = 0;
+			while ((nTileSize << info.nTilesXShift) < nLevelWidth) info.nTilesXShift++;
+			info.nOffset = (uint32_t)texels.size();
+
+			//Swizzle the level into tiles. A level smaller than a tile still gets a whole tile, the rest of it is never read
+			const int nTilesX = (nLevelWidth + nTileSize - 1) >> nTileShift;
+			const int nTilesY = (nLevelHeight + nTileSize - 1) >> nTileShift;
+			texels.resize(texels.size() + (std::size_t)nTilesX * nTilesY * nTileTexels, 0);
+			for (int y = 0; y < nLevelHeight; y++) {
+				for (int x = 0; x < nLevelWidth; x++) texels[info.nOffset + TexelOffset(info, x, y)] = level[y * nLevelWidth + x];
+			}
+
+			if ((nLevelWidth == 1 && nLevelHeight == 1) || nLevels == nMaxLevels) break;
+
+			const int nNextWidth = std::max(nLevelWidth >> 1, 1), nNextHeight = std::max(nLevelHeight >> 1, 1);
+			next.assign(nNextWidth * nNextHeight, 0);
+			for (int y = 0; y < nNextHeight; y++) {
+				for (int x = 0; x < nNextWidth; x++) {
+					//A side that is already 1 texel long averages the same texel twice
+					const int x0 = std::min(x * 2, nLevelWidth - 1), x1 = std::min(x * 2 + 1, nLevelWidth - 1);
+					const int y0 = std::min(y * 2, nLevelHeight - 1), y1 = std::min(y * 2 + 1, nLevelHeight - 1);
+					next[y * nNextWidth + x] = AverageColors(level[y0 * nLevelWidth + x0], level[y0 * nLevelWidth + x1], level[y1 * nLevelWidth + x0], level[y1 * nLevelWidth + x1]);
+				}
+			}
+			level.swap(next);
+			nLevelWidth = nNextWidth;
+			nLevelHeight = nNextHeight;
+		}
+	}
+
+	bool IsEmpty() const { return nLevels == 0; }
+	int LevelCount() const { return nLevels; }
+	int Width() const { return levels[0].nWidthMask + 1; }
+	int Height() const { return levels[0].nHeightMask + 1; }
+
+	//Sample() and SelectLevel() take the texture coordinates in texels of level 0, (u * Width(), v * Height()). The callers scale them once per triangle
+	//That way a level is only a shift away from level 0 and no sample needs a multiplication
+
+	//The texel of the level nLevel that (x, y) falls in. y = 0 is the top row of the image
+	//The texture repeats, but x and y must not be negative. The texture coordinates of a triangle can be moved by whole textures to get there (See MoveToPositive())
+	//Then the conversion to int rounds down without any help
+	inline uint32_t Sample(float x, float y, int nLevel) const {
+		const Level& level = levels[nLevel];
+		const int nX = ((int)x >> nLevel) & level.nWidthMask;
+		const int nY = ((int)y >> nLevel) & level.nHeightMask;
+		return texels[level.nOffset + TexelOffset(level, nX, nY)];
+	}
+
+	//Move three texture coordinates (in [0, 1] units) by the same whole number so the smallest one is in [0, 1). That doesn't change the texels they fall in
+	static inline void MoveToPositive(float& a, float& b, float& c) {
+		const float fShift = std::floor(std::min({ a, b, c }));
+		a -= fShift;
+		b -= fShift;
+		c -= fShift;
+	}
+
+	//The mip level for a pixel whose texture coordinates change by (dxdx, dydx) one pixel to the right and by (dxdy, dydy) one pixel down
+	//That's the level on which the bigger of the two steps is about one texel long. log2 of the step length is read from the exponent of its float
+	inline int SelectLevel(float dxdx, float dydx, float dxdy, float dydy) const {
+		//round(log2(step)) = floor(log2(2 * step * step) / 2)
+		const float fTwiceStepSquared = 2.0f * std::max(dxdx * dxdx + dydx * dydx, dxdy * dxdy + dydy * dydy);
+		if (!(fTwiceStepSquared >= 4.0f)) return 0; // smaller than a texel (or NaN)
+		uint32_t nBits;
+		std::memcpy(&nBits, &fTwiceStepSquared, sizeof(nBits));
+		const int nLevel = ((int)(nBits >> 23) - 127) >> 1;
+		return std::min(nLevel, nLevels - 1);
+	}
+
+	//SelectLevel() for a pixel of a triangle that is interpolated with perspective correction
+	//X = x * z, Y = y * z and z (= 1 / w) are planes over the screen. Their values at the pixel and their steps per pixel give the steps of x and y:
+	//dx/dsx = d(X / z)/dsx = (dX/dsx - x * dz/dsx) / z, where sx is the screen x
+	inline int SelectLevelPerspective(float X, float Y, float z, float dXdx, float dYdx, float dXdy, float dYdy, float dzdx, float dzdy) const {
+		const float fInvZ = 1.0f / z;
+		const float x = X * fInvZ, y = Y * fInvZ;
+		return SelectLevel((dXdx - x * dzdx) * fInvZ, (dYdx - y * dzdx) * fInvZ, (dXdy - x * dzdy) * fInvZ, (dYdy - y * dzdy) * fInvZ);
+	}
+
+	//The average color of the whole texture (its last level)
+	uint32_t AverageColor() const { return nLevels > 0 ? texels[levels[nLevels - 1].nOffset] : 0xffffffff; }
+
+	//Multiply two colors channel by channel. 255 is 1
+	static inline uint32_t MultiplyColors(uint32_t a, uint32_t b) {
+		uint32_t nResult = 0;
+		for (int nShift = 0; nShift < 32; nShift += 8) {
+			const uint32_t nChannel = ((a >> nShift) & 0xff) * ((b >> nShift) & 0xff);
+			nResult |= ((nChannel + 128 + ((nChannel + 128) >> 8)) >> 8) << nShift; // nChannel / 255, rounded
+		}
+		return nResult;
+	}
+
+	//Multiply the color channels (not the alpha) of a texel by a gray level between 0 and 255
+	static inline uint32_t ModulateColor(uint32_t nTexel, float fGray) {
+		const uint32_t nGray = (uint32_t)(fGray * (256.0f / 255.0f)); // 0 to 256, so the shift below divides by it
+		const uint32_t nRedBlue = (((nTexel & 0x00ff00ff) * nGray) >> 8) & 0x00ff00ff;
+		const uint32_t nGreen = (((nTexel & 0x0000ff00) * nGray) >> 8) & 0x0000ff00;
+		return (nTexel & 0xff000000) | nRedBlue | nGreen;
+	}
+
+private:
+	struct Level {
+		int nWidthMask = 0, nHeightMask = 0; // the size minus 1. The sizes are powers of two
+		int nTilesXShift = 0; // log2 of the number of tiles in a row
+		uint32_t nOffset = 0; // first texel of the level in texels
+	};
+
+	//Offset of the texel (x, y) from the start of its level: the tile first, then the texel inside the tile
+	static inline uint32_t TexelOffset(const Level& level, int x, int y) {
+		const uint32_t nTile = ((uint32_t)(y >> nTileShift) << level.nTilesXShift) + (uint32_t)(x >> nTileShift);
+		return (nTile << (2 * nTileShift)) + ((y & (nTileSize - 1)) << nTileShift) + (x & (nTileSize - 1));
+	}
+
+	static inline uint32_t AverageColors(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+		uint32_t nResult = 0;
+		for (int nShift = 0; nShift < 32; nShift += 8) {
+			const uint32_t nSum = ((a >> nShift) & 0xff) + ((b >> nShift) & 0xff) + ((c >> nShift) & 0xff) + ((d >> nShift) & 0xff);
+			nResult |= ((nSum + 2) >> 2) << nShift;
+		}
+		return nResult;
+	}
+
+	Level levels[nMaxLevels];
+	int nLevels = 0;
+
+	//All the levels one after the other. They start on a cache line, so every tile is exactly one cache line
+	std::vector<uint32_t, AlignedAllocator<uint32_t, 64>> texels;
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//A pool of worker threads that stay alive as long as the pool does
+//ParallelFor() hands out task indices to the workers (and to the calling thread) until every task is done
+//Starting threads every frame is far too slow, that's why the workers sleep between the calls instead
+class ThreadPool {
+public:
+	//nThreads is the total number of threads that run the tasks, including the thread that calls ParallelFor()
+	//0 means one thread per hardware thread
+	ThreadPool(unsigned int nThreads = 0) {
+		if (nThreads == 0) nThreads = std::thread::hardware_concurrency();
+		if (nThreads == 0) nThreads = 1;
+
+		for (unsigned int i = 1; i < nThreads; i++) {
+			workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator = (const ThreadPool&) = delete;
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			bStop = true;
+		}
+		cvWork.notify_all();
+		for (std::thread& worker : workers) worker.join();
+	}
+
+	//Number of threads that run the tasks (the workers plus the calling thread)
+	unsigned int GetThreadCount() const {
+		return (unsigned int)workers.size() + 1;
+	}
+
+	//Run task(nTask, nThread) for every nTask in [0, nTasks) and wait until all of them are done
+	//nThread is between 0 and GetThreadCount() - 1 and it's unique among the threads running at the same time. So it can be used to index per thread data
+	void ParallelFor(int nTasks, const std::function<void(int nTask, unsigned int nThread)>& task) {
+		if (nTasks <= 0) return;
+
+		//Not worth waking anybody up
+		if (workers.empty() || nTasks == 1) {
+			for (int i = 0; i < nTasks; i++) task(i, 0);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pTask = &task;
+			nTaskCount = nTasks;
+			nNextTask = 0;
+			nBusyWorkers = (unsigned int)workers.size();
+			nGeneration++;
+		}
+		cvWork.notify_all();
+
+		//The calling thread works too instead of just waiting
+		RunTasks(0);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		cvDone.wait(lock, [this] { return nBusyWorkers == 0; });
+		pTask = nullptr;
+	}
+
+private:
+	void WorkerLoop(unsigned int nThread) {
+		uint64_t nLastGeneration = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cvWork.wait(lock, [&] { return bStop || nGeneration != nLastGeneration; });
+				if (bStop) return;
+				nLastGeneration = nGeneration;
+			}
+
+			RunTasks(nThread);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--nBusyWorkers == 0) cvDone.notify_one();
+			}
+		}
+	}
+
+	void RunTasks(unsigned int nThread) {
+		for (int i = nNextTask.fetch_add(1); i < nTaskCount; i = nNextTask.fetch_add(1)) {
+			(*pTask)(i, nThread);
+		}
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable cvWork; // wakes up the workers when there is a new ParallelFor()
+	std::condition_variable cvDone; // wakes up ParallelFor() when the last worker finished
+
+	const std::function<void(int, unsigned int)>* pTask = nullptr;
+	int nTaskCount = 0;
+	std::atomic<int> nNextTask{ 0 };
+	unsigned int nBusyWorkers = 0;
+	uint64_t nGeneration = 0;
+	bool bStop = false;
+};
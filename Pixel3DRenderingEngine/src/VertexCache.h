@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//Number of vertices of the cache OrderTrianglesForVertexCache() orders the triangles for and AnalyzeVertexCache() measures with
+//A triangle whose vertices are still in the cache reuses them instead of transforming them again. That is how the GPUs the numbers come from work.
+//Here the transformed vertices are looked up in Mesh::vec4TransformedVertices by the triangle setup, so the same order keeps those lookups in the CPU caches
+static const uint32_t nVertexCacheSize = 32;
+
+//The cache the vertices are fetched through for the fetch statistics. nVertexFetchLines lines of nVertexFetchLineSize bytes, direct mapped. 16 KB, half of a usual L1 data cache
+static const uint32_t nVertexFetchLineSize = 64;
+static const uint32_t nVertexFetchLines = 256;
+
+//How well the order of the triangles and the vertices of a mesh uses the caches (See AnalyzeVertexCache())
+//These are sums, so the statistics of many meshes add up with +=
+struct VertexCacheStats {
+	uint64_t nTriangles = 0;
+	uint64_t nVertices = 0; // the vertices the triangles use
+	uint64_t nCacheMisses = 0; // vertices that weren't in the vertex cache, so they would have been transformed again
+	uint64_t nBytesFetched = 0; // bytes of whole cache lines read to fetch the vertices
+	uint64_t nBytes = 0; // bytes of the vertices the triangles use
+
+	//Average cache miss ratio. Vertices transformed per triangle: 3 is the worst, 0.5 the best a big regular mesh can get
+	double ACMR() const { return nTriangles > 0 ? (double)nCacheMisses / (double)nTriangles : 0.0; }
+	//Average transformed vertex ratio. Times every vertex is transformed, 1 is the best
+	double ATVR() const { return nVertices > 0 ? (double)nCacheMisses / (double)nVertices : 0.0; }
+	//Bytes fetched over the bytes of the vertices, 1 is the best. Vertices that are used together but lie far apart in memory fetch lines they only use a part of
+	double Overfetch() const { return nBytes > 0 ? (double)nBytesFetched / (double)nBytes : 0.0; }
+
+	VertexCacheStats& operator += (const VertexCacheStats& other) {
+		nTriangles += other.nTriangles;
+		nVertices += other.nVertices;
+		nCacheMisses += other.nCacheMisses;
+		nBytesFetched += other.nBytesFetched;
+		nBytes += other.nBytes;
+		return *this;
+	}
+};
+
+//Run the indices through a vertex cache of nVertexCacheSize vertices that drops the least recently used one
+//And fetch the vertex of nVertexSize bytes of every index through a cache of nVertexFetchLines lines, the way the triangle setup reads the transformed vertices
+//indices is anything with operator [] (See IndexBuffer), all indices must be below nVertexCount
+template<typename IndexArray>
+static VertexCacheStats AnalyzeVertexCache(const IndexArray& indices, std::size_t nIndexCount, std::size_t nVertexCount, std::size_t nVertexSize) {
+	VertexCacheStats stats;
+	stats.nTriangles = nIndexCount / 3;
+
+	uint32_t cache[nVertexCacheSize];
+	std::size_t nCached = 0;
+	uint64_t lines[nVertexFetchLines];
+	std::fill(lines, lines + nVertexFetchLines, ~0ull);
+	std::vector<bool> vecUsed(nVertexCount, false);
+	for (std::size_t i = 0; i < nIndexCount; i++) {
+		const uint32_t nVertex = (uint32_t)indices[i];
+		if (!vecUsed[nVertex]) {
+			vecUsed[nVertex] = true;
+			stats.nVertices++;
+		}
+
+		//A hit moves the vertex to the front. A miss puts it there and pushes the last one out
+		std::size_t nPosition = std::find(cache, cache + nCached, nVertex) - cache;
+		if (nPosition == nCached) {
+			stats.nCacheMisses++;
+			if (nCached < nVertexCacheSize) nCached++;
+			nPosition = nCached - 1;
+		}
+		std::copy_backward(cache, cache + nPosition, cache + nPosition + 1);
+		cache[0] = nVertex;
+
+		//Every line the vertex lies on
+		const uint64_t nFirstLine = (uint64_t)nVertex * nVertexSize / nVertexFetchLineSize;
+		const uint64_t nLastLine = ((uint64_t)nVertex * nVertexSize + nVertexSize - 1) / nVertexFetchLineSize;
+		for (uint64_t nLine = nFirstLine; nLine <= nLastLine; nLine++) {
+			if (lines[nLine % nVertexFetchLines] == nLine) continue;
+			lines[nLine % nVertexFetchLines] = nLine;
+			stats.nBytesFetched += nVertexFetchLineSize;
+		}
+	}
+	stats.nBytes = stats.nVertices * nVertexSize;
+	return stats;
+}
+
+//Score of a vertex (Tom Forsyth, "Linear-Speed Vertex Cache Optimisation"). The triangle with the highest sum of the scores of its vertices is drawn next
+//Vertices score higher the more recently they went into the cache. The 3 of the last triangle score a bit lower, so the order doesn't turn back and forth on a strip
+//Vertices with only a few triangles left score higher, so lone triangles are drawn before they are left behind and their vertices have to be transformed again later
+static inline float VertexCacheScore(int nCachePosition, uint32_t nRemainingTriangles) {
+	if (nRemainingTriangles == 0) return -1.0f;
+	float fScore = 0.0f;
+	if (nCachePosition >= 3) fScore = std::pow(1.0f - (float)(nCachePosition - 3) / (float)(nVertexCacheSize - 3), 1.5f);
+	else if (nCachePosition >= 0) fScore = 0.75f;
+	return fScore + 2.0f / std::sqrt((float)nRemainingTriangles);
+}
+
+//Order nTriangleCount triangles (3 vertex numbers each in pIndices) for a vertex cache of nVertexCacheSize vertices
+//pOrder gets the numbers of the triangles in the new order. The triangles themselves aren't moved
+//The next triangle is the best one of the vertices in the cache. When none of them has a triangle left, the order goes on with the first triangle that is left,
+//so it follows the old order where it has to jump. Ties go to the triangle that came first, too
+static void OrderTrianglesForVertexCache(const uint32_t* pIndices, std::size_t nTriangleCount, uint32_t* pOrder) {
+	if (nTriangleCount == 0) return;
+
+	//Number the vertices from 0 so the arrays below are as small as the triangles, not the whole mesh
+	std::vector<uint32_t> vecVertices(pIndices, pIndices + nTriangleCount * 3);
+	std::sort(vecVertices.begin(), vecVertices.end());
+	vecVertices.erase(std::unique(vecVertices.begin(), vecVertices.end()), vecVertices.end());
+	const std::size_t nVertices = vecVertices.size();
+	std::vector<uint32_t> vecCorners(nTriangleCount * 3);
+	for (std::size_t i = 0; i < nTriangleCount * 3; i++) vecCorners[i] = (uint32_t)(std::lower_bound(vecVertices.begin(), vecVertices.end(), pIndices[i]) - vecVertices.begin());
+
+	//The triangles of every vertex. The first vecRemaining[v] of them are the ones that haven't been drawn yet
+	std::vector<uint32_t> vecRemaining(nVertices, 0);
+	for (uint32_t nVertex : vecCorners) vecRemaining[nVertex]++;
+	std::vector<uint32_t> vecFirst(nVertices + 1, 0);
+	for (std::size_t v = 0; v < nVertices; v++) vecFirst[v + 1] = vecFirst[v] + vecRemaining[v];
+	std::vector<uint32_t> vecTriangles(nTriangleCount * 3);
+	std::vector<uint32_t> vecFilled(vecFirst.begin(), vecFirst.end() - 1);
+	for (std::size_t i = 0; i < nTriangleCount * 3; i++) vecTriangles[vecFilled[vecCorners[i]]++] = (uint32_t)(i / 3);
+
+	std::vector<int> vecCachePosition(nVertices, -1);
+	std::vector<float> vecScore(nVertices);
+	for (std::size_t v = 0; v < nVertices; v++) vecScore[v] = VertexCacheScore(-1, vecRemaining[v]);
+	auto TriangleScore = [&](uint32_t nTriangle) {
+		return vecScore[vecCorners[nTriangle * 3]] + vecScore[vecCorners[nTriangle * 3 + 1]] + vecScore[vecCorners[nTriangle * 3 + 2]];
+	};
+
+	//The first triangle is the best one of all
+	const uint32_t nNone = 0xffffffffu;
+	uint32_t nBest = 0;
+	float fBestScore = TriangleScore(0);
+	for (uint32_t t = 1; t < (uint32_t)nTriangleCount; t++) {
+		const float fScore = TriangleScore(t);
+		if (fScore > fBestScore) {
+			fBestScore = fScore;
+			nBest = t;
+		}
+	}
+
+	std::vector<bool> vecDrawn(nTriangleCount, false);
+	std::vector<uint32_t> vecCache, vecNewCache;
+	vecCache.reserve(nVertexCacheSize + 3);
+	vecNewCache.reserve(nVertexCacheSize + 3);
+	std::size_t nNextInOrder = 0;
+	for (std::size_t nDrawn = 0; nDrawn < nTriangleCount; nDrawn++) {
+		if (nBest == nNone) {
+			while (vecDrawn[nNextInOrder]) nNextInOrder++;
+			nBest = (uint32_t)nNextInOrder;
+		}
+		pOrder[nDrawn] = nBest;
+		vecDrawn[nBest] = true;
+
+		//Take the triangle off the lists of its vertices and put them at the front of the cache
+		vecNewCache.clear();
+		for (std::size_t k = 0; k < 3; k++) {
+			const uint32_t nVertex = vecCorners[nBest * 3 + k];
+			uint32_t* pTriangles = &vecTriangles[vecFirst[nVertex]];
+			uint32_t* pFound = std::find(pTriangles, pTriangles + vecRemaining[nVertex], nBest);
+			if (pFound != pTriangles + vecRemaining[nVertex]) std::swap(*pFound, pTriangles[--vecRemaining[nVertex]]);
+			if (std::find(vecNewCache.begin(), vecNewCache.end(), nVertex) == vecNewCache.end()) vecNewCache.push_back(nVertex);
+		}
+		for (uint32_t nVertex : vecCache) {
+			if (std::find(vecNewCache.begin(), vecNewCache.end(), nVertex) == vecNewCache.end()) vecNewCache.push_back(nVertex);
+		}
+
+		//New scores for everything in the cache and for the vertices that just fell out of it
+		for (std::size_t i = 0; i < vecNewCache.size(); i++) {
+			const uint32_t nVertex = vecNewCache[i];
+			vecCachePosition[nVertex] = i < nVertexCacheSize ? (int)i : -1;
+			vecScore[nVertex] = VertexCacheScore(vecCachePosition[nVertex], vecRemaining[nVertex]);
+		}
+		if (vecNewCache.size() > nVertexCacheSize) vecNewCache.resize(nVertexCacheSize);
+		vecCache.swap(vecNewCache);
+
+		//The next triangle is the best one that shares a vertex with the cache
+		nBest = nNone;
+		fBestScore = -FLT_MAX;
+		for (uint32_t nVertex : vecCache) {
+			for (uint32_t i = vecFirst[nVertex]; i < vecFirst[nVertex] + vecRemaining[nVertex]; i++) {
+				const uint32_t nTriangle = vecTriangles[i];
+				const float fScore = TriangleScore(nTriangle);
+				if (fScore > fBestScore || (fScore == fBestScore && nTriangle < nBest)) {
+					fBestScore = fScore;
+					nBest = nTriangle;
+				}
+			}
+		}
+	}
+}
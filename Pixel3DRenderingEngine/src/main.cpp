@@ -4,14 +4,32 @@
 //Custom Math Library
 #include "Math/Math.h"
 
+#include "ThreadPool.h"
+#include "AlignedVector.h"
+#include "Meshlets.h"
+#include "OcclusionBuffer.h"
+#include "Texture.h"
+#include "ObjParser.h"
+#include "MeshCache.h"
+#include "IndexBuffer.h"
+#include "VertexCache.h"
+#include "LOD.h"
+
 //Standard Includes
 #include <chrono>
 #include <unordered_map>
+#include <map>
+#include <tuple>
 #include <vector>
 #include <string>
 #include <fstream>
-#include <sstream>
-#include <iterator>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+#include <memory>
 
 // A struct that holds the position and rotation of a object
 struct Transform {
@@ -23,72 +41,1019 @@ struct Transform {
 };
 
 // A struct that holds the information about a vertex of a mesh
+// The mesh doesn't store these. It stores every component in its own array (See Mesh). This is just what GetVertex() hands out
 struct Vertex {
 	Math::Vector3 position;
+	Math::Vector3 normal; // (0, 0, 0) if the file didn't give one. CalculateVertexNormals() fills those in
+	Math::Vector2 texCoord; // (0, 0) if the file didn't give one. v = 0 is the top row of the texture
+};
+
+//A material of a .mtl file. Only the diffuse color and the diffuse texture are used
+struct Material {
+	std::string sName;
+	std::string sDiffuseMap; // the file of map_Kd. Empty if the material has none
+	Math::Vector3 diffuseColor = Math::Vector3(1.0f, 1.0f, 1.0f); // Kd
+	//The diffuse texture (map_Kd) times the diffuse color (Kd). A material without map_Kd whose Kd isn't white gets a 1 x 1 texture of that color
+	//nullptr for a white material without a texture. Its triangles are drawn the same way as the ones of a mesh without materials
+	std::shared_ptr<Texture> diffuseTexture;
+};
+
+//Which faces of a mesh are thrown away before they are shaded and rasterized
+//A front face is a triangle whose vertices go counter clockwise on the screen (Its normal points to the camera)
+enum class CullMode {
+	Back,	// the usual choice for closed meshes
+	Front,
+	Disabled	// for meshes with holes or single sided walls that must be seen from both sides
 };
 
 // A struct that holds the information about a mesh
 struct Mesh {
 
 	Mesh() {};
-	Mesh(std::string filename, Transform transform) : transform(transform) {
-		LoadFromOBJFile(filename);
-		CalculateNormals();
+	//See Load() for pThreadPool, bUseCache and fWeldEpsilon
+	Mesh(std::string filename, Transform transform, ThreadPool* pThreadPool = nullptr, bool bUseCache = false, float fWeldEpsilon = 0.0f) : transform(transform) {
+		Load(filename, pThreadPool, bUseCache, fWeldEpsilon);
 	}
 
-	Mesh(std::string filename, Math::Vector3 position, Math::Vector3 rotation) {
+	Mesh(std::string filename, Math::Vector3 position, Math::Vector3 rotation, ThreadPool* pThreadPool = nullptr, bool bUseCache = false, float fWeldEpsilon = 0.0f) {
 		transform.position = position;
 		transform.rotation = rotation;
-		LoadFromOBJFile(filename);
+		Load(filename, pThreadPool, bUseCache, fWeldEpsilon);
+	}
+
+	//Load the .obj file and build everything the renderer needs from it. pThreadPool parses big files on many threads (See LoadFromOBJFile())
+	//With bUseCache the result is kept in a binary cache next to the .obj file (See WriteCache()). The next time the cache is read instead, if it's still up to date
+	//The same vertices are merged into one, and with fWeldEpsilon > 0 the ones that are that close to each other too (See WeldVertices())
+	//The simplified levels of detail are built last and appended to the arrays (See BuildLODs())
+	void Load(const std::string& filename, ThreadPool* pThreadPool = nullptr, bool bUseCache = false, float fWeldEpsilon = 0.0f) {
+		const std::chrono::high_resolution_clock::time_point tpStart = std::chrono::high_resolution_clock::now();
+		if (bUseCache && LoadFromCache(filename, fWeldEpsilon)) {
+			dLoadTime = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tpStart).count();
+			bLoadedFromCache = true;
+			return;
+		}
+
+		LoadFromOBJFile(filename, pThreadPool);
+		WeldVertices(fWeldEpsilon);
+		CalculateBounds();
+		SortTrianglesSpatially();
 		CalculateNormals();
+		CalculateVertexNormals();
+		vertexCacheStatsBefore = AnalyzeVertexCache(indices, indices.size(), nVertexCount, sizeof(Math::Vector4));
+		OptimizeVertexCache();
+		vertexCacheStatsAfter = AnalyzeVertexCache(indices, indices.size(), nVertexCount, sizeof(Math::Vector4));
+		BuildMeshlets();
+		BuildOccluder();
+		BuildLODs();
+		if (bUseCache) WriteCache(filename);
+		dLoadTime = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tpStart).count();
+		bLoadedFromCache = false;
 	}
 
 	Transform transform; // this holds the position and rotation of the mesh in world space
-	std::vector<Vertex> vertices; // holds the vertices
-	std::vector<unsigned short> indices; // holds the indices of triangles
-	std::vector<Math::Vector3> normals;
+	IndexBuffer indices; // holds the indices of triangles. 16 bit if the mesh has few enough vertices, 32 bit otherwise
+	CullMode cullMode = CullMode::Back; // faces of this mesh that are not drawn
+
+	//The vertex positions are stored as a structure of arrays. One array for x, one for y and one for z.
+	//The batched transform kernels load 8 x's (or y's or z's) with a single instruction that way, without shuffling them out of x y z x y z ...
+	//The arrays are aligned to 32 bytes and padded with zeros to a multiple of nVertexStreamPadding. So the kernels never need a scalar tail
+	//Only the first VertexCount() entries are real vertices
+	AlignedVector<float> vertexX;
+	AlignedVector<float> vertexY;
+	AlignedVector<float> vertexZ;
+
+	//Normal of every triangle, stored the same way (normalX[i] is the normal of the triangle at indices[i * 3])
+	AlignedVector<float> normalX;
+	AlignedVector<float> normalY;
+	AlignedVector<float> normalZ;
+
+	//Normal of every vertex, stored the same way as the positions. The smooth shading modes interpolate these over the triangles
+	AlignedVector<float> vertexNormalX;
+	AlignedVector<float> vertexNormalY;
+	AlignedVector<float> vertexNormalZ;
+
+	//Texture coordinate of every vertex, stored the same way as the positions
+	AlignedVector<float> vertexU;
+	AlignedVector<float> vertexV;
+
+	//The materials of the .mtl files the mesh uses and the index into materials of every triangle. Material 0 is white and has no texture
+	std::vector<Material> materials;
+	std::vector<uint16_t> triangleMaterials;
+
+	//The .mtl files LoadFromOBJFile() read, relative to the directory of the .obj file
+	std::vector<std::string> materialLibraries;
+
+	//Seconds Load() took, including the .mtl files and the textures. bLoadedFromCache is true if it read the cache instead of the .obj file
+	double dLoadTime = 0.0;
+	bool bLoadedFromCache = false;
+
+	//How well the triangles use the vertex cache before and after OptimizeVertexCache() put them in order. Before is the order of SortTrianglesSpatially()
+	//The vertices are the transformed ones the triangle setup looks up (See vec4TransformedVertices)
+	VertexCacheStats vertexCacheStatsBefore;
+	VertexCacheStats vertexCacheStatsAfter;
+
+	//Vertices LoadFromOBJFile() made and the epsilon WeldVertices() merged them with. VertexCount() is what's left of them
+	std::size_t nVerticesBeforeWeld = 0;
+	float fWeldEpsilon = 0.0f;
+
+	//Number of floats of an AVX2 register
+	static const std::size_t nVertexStreamPadding = 8;
+
+	std::size_t VertexCount() const { return nVertexCount; }
+	//Size of the vertex arrays including the padding
+	std::size_t PaddedVertexCount() const { return vertexX.size(); }
+
+	Math::Vector3 GetVertexPosition(std::size_t i) const { return Math::Vector3(vertexX[i], vertexY[i], vertexZ[i]); }
+	Math::Vector3 GetVertexNormal(std::size_t i) const { return Math::Vector3(vertexNormalX[i], vertexNormalY[i], vertexNormalZ[i]); }
+	Math::Vector2 GetVertexTexCoord(std::size_t i) const { return Math::Vector2(vertexU[i], vertexV[i]); }
+	Vertex GetVertex(std::size_t i) const { return { GetVertexPosition(i), GetVertexNormal(i), GetVertexTexCoord(i) }; }
+
+	void SetVertexPosition(std::size_t i, const Math::Vector3& position) {
+		vertexX[i] = position.x;
+		vertexY[i] = position.y;
+		vertexZ[i] = position.z;
+	}
+
+	void SetVertexNormal(std::size_t i, const Math::Vector3& normal) {
+		vertexNormalX[i] = normal.x;
+		vertexNormalY[i] = normal.y;
+		vertexNormalZ[i] = normal.z;
+	}
+
+	void SetVertexTexCoord(std::size_t i, const Math::Vector2& texCoord) {
+		vertexU[i] = texCoord.x;
+		vertexV[i] = texCoord.y;
+	}
+
+	//Make room for nCount more vertices, so AddVertex() doesn't grow the arrays again and again
+	void ReserveVertices(std::size_t nCount) {
+		const std::size_t nCapacity = (nVertexCount + nCount + nVertexStreamPadding - 1) / nVertexStreamPadding * nVertexStreamPadding;
+		for (AlignedVector<float>* pStream : { &vertexX, &vertexY, &vertexZ, &vertexNormalX, &vertexNormalY, &vertexNormalZ, &vertexU, &vertexV }) pStream->reserve(nCapacity);
+	}
+
+	//Append a vertex. It goes into the next padding slot, the arrays only grow when the padding ran out
+	void AddVertex(const Vertex& vertex) {
+		if (nVertexCount == vertexX.size()) {
+			vertexX.resize(nVertexCount + nVertexStreamPadding, 0.0f);
+			vertexY.resize(nVertexCount + nVertexStreamPadding, 0.0f);
+			vertexZ.resize(nVertexCount + nVertexStreamPadding, 0.0f);
+			vertexNormalX.resize(nVertexCount + nVertexStreamPadding, 0.0f);
+			vertexNormalY.resize(nVertexCount + nVertexStreamPadding, 0.0f);
+			vertexNormalZ.resize(nVertexCount + nVertexStreamPadding, 0.0f);
+			vertexU.resize(nVertexCount + nVertexStreamPadding, 0.0f);
+			vertexV.resize(nVertexCount + nVertexStreamPadding, 0.0f);
+		}
+		SetVertexNormal(nVertexCount, vertex.normal);
+		SetVertexTexCoord(nVertexCount, vertex.texCoord);
+		SetVertexPosition(nVertexCount++, vertex.position);
+	}
+
+	//Normal of the nTriangle'th triangle in object space
+	Math::Vector3 GetNormal(std::size_t nTriangle) const { return Math::Vector3(normalX[nTriangle], normalY[nTriangle], normalZ[nTriangle]); }
+
+	//Post-transform buffer. Holds the screen space positions of the vertices for the current frame.
+	//It stays allocated between the frames, so we don't allocate a new one for every mesh every frame
+	std::vector<Math::Vector4> vec4TransformedVertices;
+
+	//Clusters of neighbouring triangles and a bounding volume hierarchy over them. BuildMeshlets() fills these when the mesh is loaded
+	//The renderer culls whole meshlets against the frustum and by their normal cones before it transforms their vertices
+	std::vector<Meshlet> meshlets;
+	std::vector<MeshletBVHNode> meshletBVH;
+
+	//The levels of detail, the full mesh first (See MeshLOD). BuildLODs() fills these when the mesh is loaded
+	//The triangles, the vertices, the meshlets and the hierarchy nodes of all the levels are in the arrays above, one level after the other
+	//The indices of a level count from its first vertex (MeshLOD::nFirstVertex). So the width of the indices only depends on the biggest level, which is level 0
+	//Everything that is built before BuildLODs() (the bounds, the occluder, the statistics) only knows level 0
+	std::vector<MeshLOD> lods;
+
+	//The triangles the occlusion pre-pass draws for this mesh, 3 object space corners per triangle. BuildOccluder() fills this
+	//Set bOccluder to false for meshes that should never hide anything (glass, leaves, ...)
+	std::vector<Math::Vector3> occluderVertices;
+	bool bOccluder = true;
+
+	//Maximum number of triangles of an occluder
+	static const std::size_t nMaxOccluderTriangles = 256;
+
+	//Bounding volumes of the mesh in object space. CalculateBounds() fills these when the mesh is loaded
+	Math::AABB boundingBox;
+	Math::BoundingSphere boundingSphere;
+
+	//Matrices built from the transform. Call UpdateTransformCache() before using these
+	Math::Mat4x4 ModelMatrix = Math::Mat4x4::Identity(); // object space to world space
+	Math::Mat3x3 NormalMatrix = Math::Mat3x3::Identity(); // rotates the normals from object space to world space
+
+	//The bounding volumes moved to world space. UpdateTransformCache() keeps these up to date too
+	Math::AABB worldBoundingBox;
+	Math::BoundingSphere worldBoundingSphere;
+
+	//Rebuild ModelMatrix and NormalMatrix. This only does the work if the transform changed since the last call
+	void UpdateTransformCache() {
+		if (bTransformCacheValid &&
+			cachedTransform.position.x == transform.position.x && cachedTransform.position.y == transform.position.y && cachedTransform.position.z == transform.position.z &&
+			cachedTransform.rotation.x == transform.rotation.x && cachedTransform.rotation.y == transform.rotation.y && cachedTransform.rotation.z == transform.rotation.z) {
+			return;
+		}
+
+		ModelMatrix = Math::Mat4MakeRotationZXY(transform.rotation) * Math::Mat4MakeTranslation(transform.position);
+		//The model matrix only rotates and translates. So the normal matrix (inverse transpose of the model matrix) is just the rotation
+		NormalMatrix = Math::Mat3MakeRotationZXY(transform.rotation);
+
+		//The transform only rotates and translates. So the sphere keeps its radius and only its center moves
+		worldBoundingBox = Math::AABBTransform(boundingBox, ModelMatrix);
+		const Math::Vector4 center = Math::Vector4(boundingSphere.center) * ModelMatrix;
+		worldBoundingSphere.center = Math::Vector3(center.x, center.y, center.z);
+		worldBoundingSphere.fRadius = boundingSphere.fRadius;
+
+		cachedTransform = transform;
+		bTransformCacheValid = true;
+	}
 
 	//a helper function to load a obj file
-	bool LoadFromOBJFile(std::string filename) {
-		std::ifstream file(filename);
-		if (!file.is_open()) {
+	//The whole file is read into memory and parsed in place (See ParseObj()). The triangles get the material of the last usemtl line before them
+	//The materials come from the .mtl files of the mtllib lines (See LoadMaterials())
+	//With a thread pool a big file is cut into pieces that are parsed at the same time (See ParseObjParallel()). The mesh comes out the same either way
+	bool LoadFromOBJFile(std::string filename, ThreadPool* pThreadPool = nullptr) {
+		//The triangles before the first usemtl line and the ones of unknown materials use material 0
+		materials.assign(1, Material());
+
+		std::string sContents;
+		if (!ReadWholeFile(filename, sContents)) {
 			return false;
 		}
+		ObjData obj;
+		if (pThreadPool) ParseObjParallel(sContents.data(), sContents.data() + sContents.size(), obj, *pThreadPool);
+		else ParseObj(sContents.data(), sContents.data() + sContents.size(), obj);
+
+		//The .mtl files are next to the .obj file
+		const std::size_t nLastSlash = filename.find_last_of("/\\");
+		const std::string sDirectory = nLastSlash == std::string::npos ? "" : filename.substr(0, nLastSlash + 1);
+		for (const std::string& sLibrary : obj.materialLibraries) LoadMaterials(sDirectory + sLibrary);
+		materialLibraries = obj.materialLibraries;
+
+		//The material of every usemtl name. The last material with that name wins
+		std::vector<uint16_t> vecMaterialOfName(obj.materialNames.size(), 0);
+		for (std::size_t n = 1; n < obj.materialNames.size(); n++) {
+			for (std::size_t m = 1; m < materials.size(); m++) {
+				if (materials[m].sName == obj.materialNames[n]) vecMaterialOfName[n] = (uint16_t)m;
+			}
+		}
+		triangleMaterials.reserve(triangleMaterials.size() + obj.triangleMaterials.size());
+		for (uint16_t nName : obj.triangleMaterials) triangleMaterials.push_back(vecMaterialOfName[nName]);
+
+		ReserveVertices(obj.positions.size());
+		for (const Math::Vector3& position : obj.positions) AddVertex({ position, Math::Vector3(), Math::Vector2() });
+		std::vector<uint32_t> vecIndices = indices.ToVector();
+		vecIndices.reserve(vecIndices.size() + obj.corners.size());
+
+		//A vertex takes the normal and the texture coordinate of the first corners that give it one. A corner that uses the same position with another normal (a hard edge)
+		//or another texture coordinate (a seam of the texture) gets a copy of the vertex. A corner without a normal or a texture coordinate takes whatever the vertex has
+		const std::vector<Math::Vector3>& vecNormals = obj.normals;
+		const std::vector<Math::Vector2>& vecTexCoords = obj.texCoords;
+		std::vector<int> vecTexCoordOfVertex(nVertexCount, -1);
+		std::vector<int> vecNormalOfVertex(nVertexCount, -1);
+		std::map<std::tuple<int, int, int>, uint32_t> mapVertexCopies;
+		for (const ObjCorner& objCorner : obj.corners) {
+			const std::tuple<int, int, int> corner(objCorner.nPosition, objCorner.nTexCoord, objCorner.nNormal);
+			int nVertex = objCorner.nPosition;
+			const int nTexCoord = objCorner.nTexCoord, nNormal = objCorner.nNormal;
+			const bool bTexCoordMatches = nTexCoord == -1 || vecTexCoordOfVertex[nVertex] == -1 || vecTexCoordOfVertex[nVertex] == nTexCoord;
+			const bool bNormalMatches = nNormal == -1 || vecNormalOfVertex[nVertex] == -1 || vecNormalOfVertex[nVertex] == nNormal;
+			if (bTexCoordMatches && bNormalMatches) {
+				if (nTexCoord != -1 && vecTexCoordOfVertex[nVertex] == -1) {
+					vecTexCoordOfVertex[nVertex] = nTexCoord;
+					SetVertexTexCoord(nVertex, vecTexCoords[nTexCoord]);
+				}
+				if (nNormal != -1 && vecNormalOfVertex[nVertex] == -1) {
+					vecNormalOfVertex[nVertex] = nNormal;
+					SetVertexNormal(nVertex, vecNormals[nNormal]);
+				}
+			}
+			else {
+				std::map<std::tuple<int, int, int>, uint32_t>::iterator copy = mapVertexCopies.find(corner);
+				if (copy == mapVertexCopies.end()) {
+					copy = mapVertexCopies.insert({ corner, (uint32_t)nVertexCount }).first;
+					AddVertex({ GetVertexPosition(nVertex), nNormal != -1 ? vecNormals[nNormal] : GetVertexNormal(nVertex), nTexCoord != -1 ? vecTexCoords[nTexCoord] : GetVertexTexCoord(nVertex) });
+				}
+				nVertex = copy->second;
+			}
+			vecIndices.push_back((uint32_t)nVertex);
+		}
+		//The copies are known now, so is the number of vertices and with it the width of the indices
+		indices.Assign(vecIndices, nVertexCount);
+
+		return true;
+	}
+
+	//Append the materials of a .mtl file to materials. Only the newmtl, Kd and map_Kd lines are read
+	//The textures are loaded once the file is read, so they are multiplied by the right Kd whatever order the lines come in
+	void LoadMaterials(const std::string& filename) {
+		std::string sContents;
+		if (!ReadWholeFile(filename, sContents)) {
+			return;
+		}
 
-		std::string line;
-		while (std::getline(file, line)) {
-			std::istringstream iss(line);
-			std::vector<std::string> words(std::istream_iterator<std::string>{iss},
-				std::istream_iterator<std::string>());
-			if (words[0] == "v") {
-				vertices.push_back({ Math::Vector3(std::stof(words[1]), std::stof(words[2]), std::stof(words[3])) });
+		//The textures are next to the .mtl file
+		const std::size_t nLastSlash = filename.find_last_of("/\\");
+		const std::string sDirectory = nLastSlash == std::string::npos ? "" : filename.substr(0, nLastSlash + 1);
+
+		const std::size_t nFirstMaterial = materials.size();
+
+		ObjLineReader reader(sContents.data(), sContents.data() + sContents.size());
+		std::string_view line;
+		while (reader.NextLine(line)) {
+			const std::string_view keyword = ObjLineReader::NextWord(line);
+			if (keyword.empty() || keyword[0] == '#') continue;
+			if (keyword == "newmtl") {
+				Material material;
+				material.sName = std::string(ObjLineReader::Rest(line));
+				materials.push_back(material);
 			}
-			if (words[0] == "f") {
-				indices.push_back(std::stoi(words[1]) - 1);
-				indices.push_back(std::stoi(words[2]) - 1);
-				indices.push_back(std::stoi(words[3]) - 1);
+			//Lines before the first newmtl belong to no material
+			if (materials.size() == nFirstMaterial) continue;
+			if (keyword == "Kd") {
+				const float r = ObjLineReader::ParseFloat(ObjLineReader::NextWord(line), 1.0f);
+				const float g = ObjLineReader::ParseFloat(ObjLineReader::NextWord(line), r);
+				const float b = ObjLineReader::ParseFloat(ObjLineReader::NextWord(line), r);
+				materials.back().diffuseColor = Math::Vector3(r, g, b);
 			}
+			if (keyword == "map_Kd") {
+				//The options (-s, -o, ...) come before the file name
+				std::string_view sFile;
+				for (std::string_view word = ObjLineReader::NextWord(line); !word.empty(); word = ObjLineReader::NextWord(line)) sFile = word;
+				if (!sFile.empty()) materials.back().sDiffuseMap = sDirectory + std::string(sFile);
+			}
+		}
+
+		for (std::size_t m = nFirstMaterial; m < materials.size(); m++) {
+			materials[m].diffuseTexture = LoadTexture(materials[m].sDiffuseMap, materials[m].diffuseColor);
+		}
+	}
 
+	//The texture of a material: the image sFilename times color. Without an image (sFilename is empty or can't be loaded) it's just the color, or nullptr if that is white
+	//The textures are kept by file name and color, so the copies of an object share them
+	static std::shared_ptr<Texture> LoadTexture(const std::string& sFilename, const Math::Vector3& color) {
+		const olc::Pixel tint(
+			(uint8_t)(std::min(std::max(color.x, 0.0f), 1.0f) * 255.0f + 0.5f),
+			(uint8_t)(std::min(std::max(color.y, 0.0f), 1.0f) * 255.0f + 0.5f),
+			(uint8_t)(std::min(std::max(color.z, 0.0f), 1.0f) * 255.0f + 0.5f));
+
+		static std::map<std::pair<std::string, uint32_t>, std::shared_ptr<Texture>> mapTextureCache;
+		const std::pair<std::string, uint32_t> key(sFilename, tint.n);
+		std::map<std::pair<std::string, uint32_t>, std::shared_ptr<Texture>>::iterator cached = mapTextureCache.find(key);
+		if (cached != mapTextureCache.end()) return cached->second;
+
+		std::shared_ptr<Texture> texture = std::make_shared<Texture>();
+		olc::Sprite image;
+		if (!sFilename.empty() && image.LoadFromFile(sFilename) == olc::rcode::OK && image.width > 0 && image.height > 0) {
+			texture->Create((const uint32_t*)image.GetData(), image.width, image.height, tint.n);
+		}
+		else if (tint != olc::WHITE) {
+			const uint32_t nWhite = olc::WHITE.n;
+			texture->Create(&nWhite, 1, 1, tint.n);
 		}
+		else texture = nullptr;
 
+		mapTextureCache.insert({ key, texture });
+		return texture;
+	}
+
+	//Throw away the vertices, the triangles, the materials and everything built from them. The transform and the settings stay
+	void ClearGeometry() {
+		indices.clear();
+		for (AlignedVector<float>* pStream : { &vertexX, &vertexY, &vertexZ, &vertexNormalX, &vertexNormalY, &vertexNormalZ, &vertexU, &vertexV, &normalX, &normalY, &normalZ }) pStream->clear();
+		materials.clear();
+		triangleMaterials.clear();
+		materialLibraries.clear();
+		meshlets.clear();
+		meshletBVH.clear();
+		lods.clear();
+		occluderVertices.clear();
+		boundingBox = Math::AABB();
+		boundingSphere = Math::BoundingSphere();
+		vertexCacheStatsBefore = VertexCacheStats();
+		vertexCacheStatsAfter = VertexCacheStats();
+		nVerticesBeforeWeld = 0;
+		fWeldEpsilon = 0.0f;
+		nVertexCount = 0;
+		bTransformCacheValid = false;
+	}
+
+	//The binary cache of a mesh (See MeshCache.h). It holds the mesh the way Load() leaves it: the sorted vertex and index arrays, the normals, the meshlets,
+	//the occluder, the levels of detail and the materials. So loading it skips the parsing and all the building. The textures are still loaded from their files
+	//Bump nCacheVersion whenever one of the sections or the way the mesh is built changes
+	static const uint32_t nCacheVersion = 5;
+
+	enum CacheSection : uint32_t {
+		CacheSources, // MeshCacheSource of the .obj file and then the .mtl files
+		CacheStrings, // the names of the sources and the materials
+		CacheInfo,
+		CacheIndices16, // only one of the two index sections is there, the one of the width the mesh uses
+		CacheIndices32,
+		CacheVertexX, CacheVertexY, CacheVertexZ,
+		CacheVertexNormalX, CacheVertexNormalY, CacheVertexNormalZ,
+		CacheVertexU, CacheVertexV,
+		CacheNormalX, CacheNormalY, CacheNormalZ,
+		CacheTriangleMaterials,
+		CacheMaterials,
+		CacheMeshlets,
+		CacheMeshletBVH,
+		CacheOccluderVertices,
+		CacheLODs
+	};
+
+	struct CachedInfo {
+		uint64_t nVertexCount;
+		Math::AABB boundingBox;
+		Math::BoundingSphere boundingSphere;
+		VertexCacheStats vertexCacheStatsBefore;
+		VertexCacheStats vertexCacheStatsAfter;
+		uint64_t nVerticesBeforeWeld;
+		float fWeldEpsilon; // a cache welded with another epsilon is rebuilt
+	};
+
+	//A material without its texture. The strings are in the string section
+	struct CachedMaterial {
+		uint32_t nNameOffset, nNameLength;
+		uint32_t nDiffuseMapOffset, nDiffuseMapLength;
+		float fDiffuseColor[3];
+	};
+
+	//The cache of filename. It's next to it
+	static std::string CacheFilename(const std::string& filename) {
+		return filename + ".p3dmesh";
+	}
+
+	//Write the cache of the mesh that was just loaded from filename. Nothing happens if it can't be written (a read only directory for example)
+	bool WriteCache(const std::string& filename) const {
+		//File names are stored relative to the directory of the .obj file, so the cache still works if the directory is moved
+		const std::size_t nLastSlash = filename.find_last_of("/\\");
+		const std::string sDirectory = nLastSlash == std::string::npos ? "" : filename.substr(0, nLastSlash + 1);
+		std::vector<char> vecStrings;
+		auto AddString = [&vecStrings](const std::string& s, uint32_t& nOffset, uint32_t& nLength) {
+			nOffset = (uint32_t)vecStrings.size();
+			nLength = (uint32_t)s.size();
+			vecStrings.insert(vecStrings.end(), s.begin(), s.end());
+		};
+
+		std::vector<MeshCacheSource> vecSources;
+		std::vector<std::string> vecSourceNames = { filename.substr(sDirectory.size()) };
+		vecSourceNames.insert(vecSourceNames.end(), materialLibraries.begin(), materialLibraries.end());
+		for (const std::string& sSource : vecSourceNames) {
+			MeshCacheSource source;
+			source.Read(sDirectory + sSource);
+			AddString(sSource, source.nNameOffset, source.nNameLength);
+			vecSources.push_back(source);
+		}
+
+		std::vector<CachedMaterial> vecMaterials;
+		for (const Material& material : materials) {
+			CachedMaterial cached;
+			AddString(material.sName, cached.nNameOffset, cached.nNameLength);
+			const bool bInDirectory = material.sDiffuseMap.compare(0, sDirectory.size(), sDirectory) == 0;
+			AddString(bInDirectory ? material.sDiffuseMap.substr(sDirectory.size()) : material.sDiffuseMap, cached.nDiffuseMapOffset, cached.nDiffuseMapLength);
+			cached.fDiffuseColor[0] = material.diffuseColor.x;
+			cached.fDiffuseColor[1] = material.diffuseColor.y;
+			cached.fDiffuseColor[2] = material.diffuseColor.z;
+			vecMaterials.push_back(cached);
+		}
+
+		const CachedInfo info = { (uint64_t)nVertexCount, boundingBox, boundingSphere, vertexCacheStatsBefore, vertexCacheStatsAfter, (uint64_t)nVerticesBeforeWeld, fWeldEpsilon };
+
+		MeshCacheWriter writer;
+		writer.AddSection(CacheSources, vecSources);
+		writer.AddSection(CacheStrings, vecStrings);
+		writer.AddSection(CacheInfo, &info, sizeof(info), 1);
+		if (indices.Is32Bit()) writer.AddSection(CacheIndices32, indices.Indices32());
+		else writer.AddSection(CacheIndices16, indices.Indices16());
+		writer.AddSection(CacheVertexX, vertexX);
+		writer.AddSection(CacheVertexY, vertexY);
+		writer.AddSection(CacheVertexZ, vertexZ);
+		writer.AddSection(CacheVertexNormalX, vertexNormalX);
+		writer.AddSection(CacheVertexNormalY, vertexNormalY);
+		writer.AddSection(CacheVertexNormalZ, vertexNormalZ);
+		writer.AddSection(CacheVertexU, vertexU);
+		writer.AddSection(CacheVertexV, vertexV);
+		writer.AddSection(CacheNormalX, normalX);
+		writer.AddSection(CacheNormalY, normalY);
+		writer.AddSection(CacheNormalZ, normalZ);
+		writer.AddSection(CacheTriangleMaterials, triangleMaterials);
+		writer.AddSection(CacheMaterials, vecMaterials);
+		writer.AddSection(CacheMeshlets, meshlets);
+		writer.AddSection(CacheMeshletBVH, meshletBVH);
+		writer.AddSection(CacheOccluderVertices, occluderVertices);
+		writer.AddSection(CacheLODs, lods);
+		return writer.Write(CacheFilename(filename), nCacheVersion);
+	}
+
+	//Load the mesh from the cache of filename. False if there is no cache, it's broken, it was welded with another epsilon or the .obj file or one of its .mtl files changed since it was written
+	//The cache is mapped into memory. The arrays are copied straight out of the mapping into the aligned vertex streams, nothing is parsed or converted
+	bool LoadFromCache(const std::string& filename, float fEpsilon) {
+		MeshCacheReader reader;
+		if (!reader.Open(CacheFilename(filename), nCacheVersion)) return false;
+
+		const std::size_t nLastSlash = filename.find_last_of("/\\");
+		const std::string sDirectory = nLastSlash == std::string::npos ? "" : filename.substr(0, nLastSlash + 1);
+		const void* pData = nullptr;
+		std::size_t nStrings = 0, nSources = 0, nMaterials = 0;
+		if (!reader.Find(CacheStrings, sizeof(char), pData, nStrings)) return false;
+		const char* pStrings = (const char*)pData;
+		auto GetString = [pStrings, nStrings](uint32_t nOffset, uint32_t nLength, std::string& s) {
+			if ((uint64_t)nOffset + nLength > nStrings) return false;
+			s.assign(pStrings + nOffset, nLength);
+			return true;
+		};
+
+		//Every source must be unchanged. The first one is the .obj file itself
+		if (!reader.Find(CacheSources, sizeof(MeshCacheSource), pData, nSources) || nSources == 0) return false;
+		std::vector<std::string> vecSourceNames(nSources);
+		for (std::size_t i = 0; i < nSources; i++) {
+			const MeshCacheSource& source = ((const MeshCacheSource*)pData)[i];
+			if (!GetString(source.nNameOffset, source.nNameLength, vecSourceNames[i]) || !source.IsUnchanged(sDirectory + vecSourceNames[i])) return false;
+		}
+
+		//Nothing of a cache that turns out to be broken is kept
+		auto Fail = [this]() {
+			ClearGeometry();
+			return false;
+		};
+		CachedInfo info;
+		if (!reader.ReadOne(CacheInfo, info) || info.fWeldEpsilon != fEpsilon) return false;
+		std::vector<uint16_t> vecIndices16;
+		std::vector<uint32_t> vecIndices32;
+		if (reader.Read(CacheIndices16, vecIndices16)) indices.Assign16(std::move(vecIndices16));
+		else if (reader.Read(CacheIndices32, vecIndices32)) indices.Assign32(std::move(vecIndices32));
+		else return false;
+		if (			!reader.Read(CacheVertexX, vertexX) || !reader.Read(CacheVertexY, vertexY) || !reader.Read(CacheVertexZ, vertexZ) ||
+			!reader.Read(CacheVertexNormalX, vertexNormalX) || !reader.Read(CacheVertexNormalY, vertexNormalY) || !reader.Read(CacheVertexNormalZ, vertexNormalZ) ||
+			!reader.Read(CacheVertexU, vertexU) || !reader.Read(CacheVertexV, vertexV) ||
+			!reader.Read(CacheNormalX, normalX) || !reader.Read(CacheNormalY, normalY) || !reader.Read(CacheNormalZ, normalZ) ||
+			!reader.Read(CacheTriangleMaterials, triangleMaterials) ||
+			!reader.Read(CacheMeshlets, meshlets) || !reader.Read(CacheMeshletBVH, meshletBVH) ||
+			!reader.Read(CacheOccluderVertices, occluderVertices) || !reader.Read(CacheLODs, lods) ||
+			!reader.Find(CacheMaterials, sizeof(CachedMaterial), pData, nMaterials)) {
+			return Fail();
+		}
+
+		//The arrays must fit together. A mesh built from a broken cache would read past them while rendering
+		const std::size_t nTriangles = indices.size() / 3;
+		bool bValid = info.nVertexCount <= vertexX.size() && vertexX.size() % nVertexStreamPadding == 0 && indices.size() % 3 == 0 && nMaterials > 0 &&
+			triangleMaterials.size() == nTriangles && normalX.size() == nTriangles && normalY.size() == nTriangles && normalZ.size() == nTriangles;
+		for (const AlignedVector<float>* pStream : { &vertexY, &vertexZ, &vertexNormalX, &vertexNormalY, &vertexNormalZ, &vertexU, &vertexV }) bValid = bValid && pStream->size() == vertexX.size();
+		for (std::size_t i = 0; bValid && i < nTriangles; i++) bValid = triangleMaterials[i] < nMaterials;
+		for (std::size_t i = 0; bValid && i < meshlets.size(); i++) bValid = (uint64_t)meshlets[i].nFirstTriangle + meshlets[i].nTriangleCount <= nTriangles && meshlets[i].nLastVertex < info.nVertexCount;
+		for (std::size_t i = 0; bValid && i < meshletBVH.size(); i++) {
+			bValid = meshletBVH[i].nCount > 0 ? (uint64_t)meshletBVH[i].nFirst + meshletBVH[i].nCount <= meshlets.size() : meshletBVH[i].nFirst > i && (uint64_t)meshletBVH[i].nFirst + 1 < meshletBVH.size();
+		}
+		//The levels follow each other and cover all the triangles. Every index of a level is one of its vertices, counted from its first one
+		bValid = bValid && !lods.empty();
+		uint64_t nLevelEnd = 0;
+		for (std::size_t i = 0; bValid && i < lods.size(); i++) {
+			const MeshLOD& lod = lods[i];
+			bValid = lod.nFirstTriangle == nLevelEnd && (uint64_t)lod.nFirstVertex + lod.nVertexCount <= info.nVertexCount &&
+				(uint64_t)lod.nFirstMeshlet + lod.nMeshletCount <= meshlets.size() && (lod.nMeshletCount == 0 || lod.nBVHRoot < meshletBVH.size());
+			nLevelEnd = (uint64_t)lod.nFirstTriangle + lod.nTriangleCount;
+			for (std::size_t j = (std::size_t)lod.nFirstTriangle * 3; bValid && j < (std::size_t)nLevelEnd * 3; j++) bValid = indices[j] < lod.nVertexCount;
+		}
+		bValid = bValid && nLevelEnd == nTriangles;
+		if (!bValid) return Fail();
+
+		materials.clear();
+		for (std::size_t m = 0; m < nMaterials; m++) {
+			const CachedMaterial& cached = ((const CachedMaterial*)pData)[m];
+			Material material;
+			std::string sDiffuseMap;
+			if (!GetString(cached.nNameOffset, cached.nNameLength, material.sName) || !GetString(cached.nDiffuseMapOffset, cached.nDiffuseMapLength, sDiffuseMap)) return Fail();
+			const bool bAbsolute = !sDiffuseMap.empty() && (sDiffuseMap[0] == '/' || sDiffuseMap[0] == '\\' || sDiffuseMap.find(':') != std::string::npos);
+			material.sDiffuseMap = sDiffuseMap.empty() || bAbsolute ? sDiffuseMap : sDirectory + sDiffuseMap;
+			material.diffuseColor = Math::Vector3(cached.fDiffuseColor[0], cached.fDiffuseColor[1], cached.fDiffuseColor[2]);
+			materials.push_back(material);
+		}
+		for (Material& material : materials) material.diffuseTexture = LoadTexture(material.sDiffuseMap, material.diffuseColor);
+
+		materialLibraries.assign(vecSourceNames.begin() + 1, vecSourceNames.end());
+		nVertexCount = (std::size_t)info.nVertexCount;
+		boundingBox = info.boundingBox;
+		boundingSphere = info.boundingSphere;
+		vertexCacheStatsBefore = info.vertexCacheStatsBefore;
+		vertexCacheStatsAfter = info.vertexCacheStatsAfter;
+		nVerticesBeforeWeld = (std::size_t)info.nVerticesBeforeWeld;
+		fWeldEpsilon = info.fWeldEpsilon;
+		bTransformCacheValid = false;
 		return true;
 	}
 
+private:
+	Transform cachedTransform; // the transform the cached matrices were built from
+	bool bTransformCacheValid = false;
+
+	std::size_t nVertexCount = 0; // number of real vertices in vertexX, vertexY and vertexZ
+
+public:
 	//Calculate the normals of the each triangle of the mesh
 	void CalculateNormals() {
+		normalX.clear();
+		normalY.clear();
+		normalZ.clear();
 		for (std::size_t i = 0; i < indices.size(); i += 3) {
-			const Vertex& v0 = vertices[indices[i]];
-			const Vertex& v1 = vertices[indices[i + 1]];
-			const Vertex& v2 = vertices[indices[i + 2]];
+			const Math::Vector3 v0 = GetVertexPosition(indices[i]);
+			const Math::Vector3 v1 = GetVertexPosition(indices[i + 1]);
+			const Math::Vector3 v2 = GetVertexPosition(indices[i + 2]);
 
-			const Math::Vector3 line1 = v1.position - v0.position;
-			const Math::Vector3 line2 = v2.position - v0.position;
+			const Math::Vector3 line1 = v1 - v0;
+			const Math::Vector3 line2 = v2 - v0;
 
 			Math::Vector3 normal = Math::Vec3CrossProduct(line1, line2);
 			normal.Normalize();
-			normals.push_back(normal);
+			normalX.push_back(normal.x);
+			normalY.push_back(normal.y);
+			normalZ.push_back(normal.z);
+		}
+	}
+
+	//Calculate the normal of every vertex that didn't get one from the file by averaging the normals of the triangles around it
+	//The length of the cross product is twice the area of the triangle. Adding the cross products up weights every triangle by its area, so thin slivers don't bend the normal
+	void CalculateVertexNormals() {
+		std::vector<Math::Vector3> vecNormalSums(nVertexCount);
+		for (std::size_t i = 0; i < indices.size(); i += 3) {
+			const Math::Vector3 v0 = GetVertexPosition(indices[i]);
+			const Math::Vector3 cross = Math::Vec3CrossProduct(GetVertexPosition(indices[i + 1]) - v0, GetVertexPosition(indices[i + 2]) - v0);
+			for (std::size_t k = 0; k < 3; k++) vecNormalSums[indices[i + k]] += cross;
+		}
+
+		for (std::size_t i = 0; i < nVertexCount; i++) {
+			if (vertexNormalX[i] != 0.0f || vertexNormalY[i] != 0.0f || vertexNormalZ[i] != 0.0f) continue;
+			const float fLength = vecNormalSums[i].Magnitude();
+			if (fLength > 0.0f) SetVertexNormal(i, vecNormalSums[i] / fLength);
+		}
+	}
+
+	//Merge the vertices that are the same into one: the same position, normal and texture coordinate. Exporters list a position more than once where they split a mesh,
+	//and every v/vt/vn corner of the .obj file that differs becomes a vertex of its own (See LoadFromOBJFile()). Every vertex that goes saves its transform every frame
+	//With fEpsilon > 0 the positions only have to be within fEpsilon of each other on every axis. The normals and the texture coordinates must still be the same,
+	//so hard edges and texture seams stay where they are. A merged vertex takes the position of the first one
+	//The vertices are hashed by the cell of a grid of fEpsilon they are in, so a vertex is only compared with the vertices of its cell and the cells around it
+	//Triangles that lose their area because two of their corners were merged are dropped. Call this right after LoadFromOBJFile(), before anything is built from the vertices
+	void WeldVertices(float fEpsilon = 0.0f) {
+		nVerticesBeforeWeld = nVertexCount;
+		fWeldEpsilon = fEpsilon;
+		const bool bEpsilon = fEpsilon > 0.0f;
+
+		//The cell of a vertex. Without an epsilon every position is a cell of its own (+ 0.0f makes -0 and 0 the same cell, they are equal)
+		auto GetCell = [&](std::size_t nVertex, int64_t cell[3]) {
+			const float fPosition[3] = { vertexX[nVertex] + 0.0f, vertexY[nVertex] + 0.0f, vertexZ[nVertex] + 0.0f };
+			for (int k = 0; k < 3; k++) {
+				if (bEpsilon) cell[k] = (int64_t)std::floor(fPosition[k] / fEpsilon);
+				else {
+					uint32_t nBits;
+					std::memcpy(&nBits, &fPosition[k], sizeof(nBits));
+					cell[k] = nBits;
+				}
+			}
+		};
+		auto HashCell = [](int64_t x, int64_t y, int64_t z) {
+			return ((uint64_t)x * 0x9e3779b97f4a7c15ull) ^ ((uint64_t)y * 0xc2b2ae3d27d4eb4full) ^ ((uint64_t)z * 0x165667b19e3779f9ull);
+		};
+		auto IsSame = [&](std::size_t a, std::size_t b) {
+			const bool bPosition = bEpsilon ?
+				std::fabs(vertexX[a] - vertexX[b]) <= fEpsilon && std::fabs(vertexY[a] - vertexY[b]) <= fEpsilon && std::fabs(vertexZ[a] - vertexZ[b]) <= fEpsilon :
+				vertexX[a] == vertexX[b] && vertexY[a] == vertexY[b] && vertexZ[a] == vertexZ[b];
+			return bPosition && vertexNormalX[a] == vertexNormalX[b] && vertexNormalY[a] == vertexNormalY[b] && vertexNormalZ[a] == vertexNormalZ[b] &&
+				vertexU[a] == vertexU[b] && vertexV[a] == vertexV[b];
+		};
+
+		//The vertices that stay, by the hash of their cell. Every vertex either finds one it is the same as or stays itself
+		//They are stored with their new numbers. The arrays are packed as we go, so that's where their data is
+		std::unordered_multimap<uint64_t, uint32_t> mapCells;
+		mapCells.reserve(nVertexCount);
+		std::vector<uint32_t> vecRemap(nVertexCount);
+		std::size_t nWelded = 0;
+		const int nReach = bEpsilon ? 1 : 0;
+		for (std::size_t v = 0; v < nVertexCount; v++) {
+			int64_t cell[3];
+			GetCell(v, cell);
+			uint32_t nSame = 0xffffffffu;
+			for (int dz = -nReach; dz <= nReach && nSame == 0xffffffffu; dz++) {
+				for (int dy = -nReach; dy <= nReach && nSame == 0xffffffffu; dy++) {
+					for (int dx = -nReach; dx <= nReach && nSame == 0xffffffffu; dx++) {
+						const auto range = mapCells.equal_range(HashCell(cell[0] + dx, cell[1] + dy, cell[2] + dz));
+						for (auto it = range.first; it != range.second; ++it) {
+							if (IsSame(v, it->second)) {
+								nSame = it->second;
+								break;
+							}
+						}
+					}
+				}
+			}
+			if (nSame != 0xffffffffu) {
+				vecRemap[v] = nSame;
+				continue;
+			}
+			mapCells.insert({ HashCell(cell[0], cell[1], cell[2]), (uint32_t)nWelded });
+
+			//The vertices that stay keep their order. A vertex only ever moves down, so the arrays can be packed in place
+			vecRemap[v] = (uint32_t)nWelded;
+			for (AlignedVector<float>* pStream : { &vertexX, &vertexY, &vertexZ, &vertexNormalX, &vertexNormalY, &vertexNormalZ, &vertexU, &vertexV }) (*pStream)[nWelded] = (*pStream)[v];
+			nWelded++;
+		}
+
+		//Shrink the arrays to the vertices that are left and pad them with zeros again
+		const std::size_t nPaddedCount = (nWelded + nVertexStreamPadding - 1) / nVertexStreamPadding * nVertexStreamPadding;
+		for (AlignedVector<float>* pStream : { &vertexX, &vertexY, &vertexZ, &vertexNormalX, &vertexNormalY, &vertexNormalZ, &vertexU, &vertexV }) {
+			pStream->resize(nPaddedCount);
+			std::fill(pStream->begin() + nWelded, pStream->end(), 0.0f);
+		}
+		nVertexCount = nWelded;
+
+		const std::size_t nTriangles = indices.size() / 3;
+		const bool bMaterials = triangleMaterials.size() == nTriangles;
+		std::vector<uint32_t> vecIndices;
+		vecIndices.reserve(indices.size());
+		std::size_t nKept = 0;
+		for (std::size_t i = 0; i < nTriangles; i++) {
+			const uint32_t n0 = vecRemap[indices[i * 3]], n1 = vecRemap[indices[i * 3 + 1]], n2 = vecRemap[indices[i * 3 + 2]];
+			if (n0 == n1 || n1 == n2 || n2 == n0) continue;
+			vecIndices.push_back(n0);
+			vecIndices.push_back(n1);
+			vecIndices.push_back(n2);
+			if (bMaterials) triangleMaterials[nKept] = triangleMaterials[i];
+			nKept++;
+		}
+		if (bMaterials) triangleMaterials.resize(nKept);
+		indices.Assign(vecIndices, nVertexCount);
+	}
+
+	//Calculate the bounding box and the bounding sphere of the vertices
+	//The sphere is centered on the box and just big enough to hold the vertex that is the furthest from that center
+	void CalculateBounds() {
+		if (nVertexCount == 0) {
+			boundingBox = Math::AABB();
+			boundingSphere = Math::BoundingSphere();
+			return;
+		}
+
+		boundingBox.min = boundingBox.max = GetVertexPosition(0);
+		for (std::size_t i = 1; i < nVertexCount; i++) {
+			boundingBox.min.x = std::min(boundingBox.min.x, vertexX[i]); boundingBox.max.x = std::max(boundingBox.max.x, vertexX[i]);
+			boundingBox.min.y = std::min(boundingBox.min.y, vertexY[i]); boundingBox.max.y = std::max(boundingBox.max.y, vertexY[i]);
+			boundingBox.min.z = std::min(boundingBox.min.z, vertexZ[i]); boundingBox.max.z = std::max(boundingBox.max.z, vertexZ[i]);
+		}
+
+		boundingSphere.center = boundingBox.Center();
+		float fRadiusSquared = 0.0f;
+		for (std::size_t i = 0; i < nVertexCount; i++) {
+			const float dx = vertexX[i] - boundingSphere.center.x;
+			const float dy = vertexY[i] - boundingSphere.center.y;
+			const float dz = vertexZ[i] - boundingSphere.center.z;
+			fRadiusSquared = std::max(fRadiusSquared, dx * dx + dy * dy + dz * dz);
+		}
+		boundingSphere.fRadius = std::sqrt(fRadiusSquared);
+
+		//The world space volumes depend on these
+		bTransformCacheValid = false;
+	}
+
+	//Sort the triangles by the direction they face (See NormalDirection()) and then along a z-order curve through the bounding box
+	//So the triangles that are next to each other in the index buffer are next to each other in space and face roughly the same way
+	//Call this before CalculateNormals() and BuildMeshlets(). It needs the bounding box
+	void SortTrianglesSpatially() {
+		const std::size_t nTriangles = indices.size() / 3;
+		std::vector<std::pair<uint64_t, uint32_t>> vecTriangleCodes(nTriangles);
+		for (std::size_t i = 0; i < nTriangles; i++) {
+			const Math::Vector3 v0 = GetVertexPosition(indices[i * 3]), v1 = GetVertexPosition(indices[i * 3 + 1]), v2 = GetVertexPosition(indices[i * 3 + 2]);
+			const Math::Vector3 centroid = (v0 + v1 + v2) / 3.0f;
+			const uint64_t nDirection = NormalDirection(Math::Vec3CrossProduct(v1 - v0, v2 - v0));
+			vecTriangleCodes[i] = { (nDirection << 32) | MortonCode(centroid, boundingBox), (uint32_t)i };
+		}
+		std::sort(vecTriangleCodes.begin(), vecTriangleCodes.end());
+
+		std::vector<uint32_t> vecOrder(nTriangles);
+		for (std::size_t i = 0; i < nTriangles; i++) vecOrder[i] = vecTriangleCodes[i].second;
+		ReorderTriangles(vecOrder);
+	}
+
+	//Reorder the triangles for the vertex cache (See OrderTrianglesForVertexCache()). A triangle then mostly finds its vertices in the cache,
+	//or in vec4TransformedVertices in the CPU caches, because the triangles right before it used them
+	//Every run of triangles that face the same direction is ordered on its own, so the meshlets still never mix two directions. Where the order has to jump,
+	//it goes on in the order of SortTrianglesSpatially(). The order walks across the surface from neighbour to neighbour, so the meshlets stay as tight as before
+	//Call this after SortTrianglesSpatially() and CalculateNormals() and before BuildMeshlets()
+	void OptimizeVertexCache() {
+		const uint32_t nTriangles = (uint32_t)(indices.size() / 3);
+		const std::vector<uint32_t> vecIndices = indices.ToVector();
+		std::vector<uint32_t> vecOrder(nTriangles);
+		for (uint32_t nFirstTriangle = 0; nFirstTriangle < nTriangles; ) {
+			const uint32_t nDirection = NormalDirection(GetNormal(nFirstTriangle));
+			uint32_t nTriangleCount = 1;
+			while (nFirstTriangle + nTriangleCount < nTriangles && NormalDirection(GetNormal(nFirstTriangle + nTriangleCount)) == nDirection) nTriangleCount++;
+			OrderTrianglesForVertexCache(&vecIndices[(std::size_t)nFirstTriangle * 3], nTriangleCount, &vecOrder[nFirstTriangle]);
+			for (uint32_t i = nFirstTriangle; i < nFirstTriangle + nTriangleCount; i++) vecOrder[i] += nFirstTriangle;
+			nFirstTriangle += nTriangleCount;
+		}
+		ReorderTriangles(vecOrder);
+	}
+
+	//Put the triangles in the order of vecOrder (the old numbers of the triangles in their new order), along with their normals and materials
+	//Then number the vertices in the order the triangles first use them. The vertices of a run of triangles end up close together in the vertex arrays that way,
+	//so fetching them reads whole cache lines instead of a vertex here and there
+	void ReorderTriangles(const std::vector<uint32_t>& vecOrder) {
+		const std::size_t nTriangles = indices.size() / 3;
+
+		//New number of every vertex. Vertices no triangle uses go to the end in their old order
+		const uint32_t nUnused = 0xffffffffu;
+		std::vector<uint32_t> vecRemap(nVertexCount, nUnused);
+		std::vector<uint32_t> vecSortedIndices(indices.size());
+		uint32_t nNextVertex = 0;
+		for (std::size_t i = 0; i < nTriangles; i++) {
+			for (std::size_t k = 0; k < 3; k++) {
+				const uint32_t nVertex = indices[vecOrder[i] * 3 + k];
+				if (vecRemap[nVertex] == nUnused) vecRemap[nVertex] = nNextVertex++;
+				vecSortedIndices[i * 3 + k] = vecRemap[nVertex];
+			}
+		}
+		for (std::size_t i = 0; i < nVertexCount; i++) {
+			if (vecRemap[i] == nUnused) vecRemap[i] = nNextVertex++;
+		}
+		indices.Assign(vecSortedIndices, nVertexCount);
+
+		if (triangleMaterials.size() == nTriangles) {
+			std::vector<uint16_t> vecSortedMaterials(nTriangles);
+			for (std::size_t i = 0; i < nTriangles; i++) vecSortedMaterials[i] = triangleMaterials[vecOrder[i]];
+			triangleMaterials.swap(vecSortedMaterials);
+		}
+
+		//The normals of the triangles, if CalculateNormals() already ran
+		for (AlignedVector<float>* pStream : { &normalX, &normalY, &normalZ }) {
+			if (pStream->size() != nTriangles) continue;
+			AlignedVector<float> sorted(nTriangles);
+			for (std::size_t i = 0; i < nTriangles; i++) sorted[i] = (*pStream)[vecOrder[i]];
+			pStream->swap(sorted);
+		}
+
+		for (AlignedVector<float>* pStream : { &vertexX, &vertexY, &vertexZ, &vertexNormalX, &vertexNormalY, &vertexNormalZ, &vertexU, &vertexV }) {
+			AlignedVector<float> sorted(pStream->size(), 0.0f);
+			for (std::size_t i = 0; i < nVertexCount; i++) sorted[vecRemap[i]] = (*pStream)[i];
+			pStream->swap(sorted);
 		}
 	}
+
+	//Pick the triangles the occlusion pre-pass draws. These are the nMaxOccluderTriangles biggest triangles of the mesh
+	//They are a part of the real surface, so they can never hide something the mesh itself doesn't hide. The big ones hide the most for the least work
+	void BuildOccluder() {
+		occluderVertices.clear();
+		const std::size_t nTriangles = indices.size() / 3;
+		std::vector<std::pair<float, uint32_t>> vecTriangleAreas(nTriangles);
+		for (std::size_t i = 0; i < nTriangles; i++) {
+			Math::Vector3 cross = Math::Vec3CrossProduct(GetVertexPosition(indices[i * 3 + 1]) - GetVertexPosition(indices[i * 3]),
+				GetVertexPosition(indices[i * 3 + 2]) - GetVertexPosition(indices[i * 3]));
+			vecTriangleAreas[i] = { cross.Magnitude(), (uint32_t)i };
+		}
+		const std::size_t nOccluderTriangles = std::min(nTriangles, nMaxOccluderTriangles);
+		std::partial_sort(vecTriangleAreas.begin(), vecTriangleAreas.begin() + nOccluderTriangles, vecTriangleAreas.end(),
+			[](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b) { return a.first > b.first; });
+		for (std::size_t i = 0; i < nOccluderTriangles; i++) {
+			for (std::size_t k = 0; k < 3; k++) occluderVertices.push_back(GetVertexPosition(indices[vecTriangleAreas[i].second * 3 + k]));
+		}
+	}
+
+	//Cut the index buffer into meshlets of nMeshletTriangles triangles and build the hierarchy over them
+	//A meshlet also ends where the triangles start to face another direction (See NormalDirection())
+	//The triangles should be sorted with SortTrianglesSpatially() first, otherwise the meshlets are scattered all over the mesh. Needs the normals
+	void BuildMeshlets() {
+		meshlets.clear();
+		const uint32_t nTriangles = (uint32_t)(indices.size() / 3);
+		for (uint32_t nFirstTriangle = 0; nFirstTriangle < nTriangles; ) {
+			Meshlet meshlet;
+			meshlet.nFirstTriangle = nFirstTriangle;
+			const uint32_t nDirection = NormalDirection(GetNormal(nFirstTriangle));
+			while (meshlet.nTriangleCount < nMeshletTriangles && nFirstTriangle + meshlet.nTriangleCount < nTriangles &&
+				NormalDirection(GetNormal(nFirstTriangle + meshlet.nTriangleCount)) == nDirection) {
+				meshlet.nTriangleCount++;
+			}
+
+			//Bounding box and vertex range
+			meshlet.nFirstVertex = meshlet.nLastVertex = indices[nFirstTriangle * 3];
+			meshlet.boundingBox.min = meshlet.boundingBox.max = GetVertexPosition(indices[nFirstTriangle * 3]);
+			for (uint32_t i = nFirstTriangle * 3; i < (nFirstTriangle + meshlet.nTriangleCount) * 3; i++) {
+				const Math::Vector3 position = GetVertexPosition(indices[i]);
+				meshlet.boundingBox.min = Math::Vector3(std::min(meshlet.boundingBox.min.x, position.x), std::min(meshlet.boundingBox.min.y, position.y), std::min(meshlet.boundingBox.min.z, position.z));
+				meshlet.boundingBox.max = Math::Vector3(std::max(meshlet.boundingBox.max.x, position.x), std::max(meshlet.boundingBox.max.y, position.y), std::max(meshlet.boundingBox.max.z, position.z));
+				meshlet.nFirstVertex = std::min(meshlet.nFirstVertex, (uint32_t)indices[i]);
+				meshlet.nLastVertex = std::max(meshlet.nLastVertex, (uint32_t)indices[i]);
+			}
+
+			//Bounding sphere centered on the box, the same way CalculateBounds() does it for the whole mesh
+			meshlet.boundingSphere.center = meshlet.boundingBox.Center();
+			float fRadiusSquared = 0.0f;
+			for (uint32_t i = nFirstTriangle * 3; i < (nFirstTriangle + meshlet.nTriangleCount) * 3; i++) {
+				const Math::Vector3 offset = GetVertexPosition(indices[i]) - meshlet.boundingSphere.center;
+				fRadiusSquared = std::max(fRadiusSquared, Math::Vec3DotProduct(offset, offset));
+			}
+			meshlet.boundingSphere.fRadius = std::sqrt(fRadiusSquared);
+
+			//Normal cone. The axis is the average normal, the angle is the one of the normal the furthest away from it
+			//Degenerate triangles have no normal. They have no area on the screen either, so the cone can ignore them
+			Math::Vector3 axis;
+			for (uint32_t i = nFirstTriangle; i < nFirstTriangle + meshlet.nTriangleCount; i++) {
+				const Math::Vector3 normal = GetNormal(i);
+				if (std::isfinite(normal.x) && std::isfinite(normal.y) && std::isfinite(normal.z)) axis += normal;
+			}
+			const float fAxisLength = axis.Magnitude();
+			if (fAxisLength > 1e-6f) {
+				meshlet.coneAxis = axis / fAxisLength;
+				float fMinCos = 1.0f;
+				for (uint32_t i = nFirstTriangle; i < nFirstTriangle + meshlet.nTriangleCount; i++) {
+					const Math::Vector3 normal = GetNormal(i);
+					if (std::isfinite(normal.x) && std::isfinite(normal.y) && std::isfinite(normal.z)) fMinCos = std::min(fMinCos, Math::Vec3DotProduct(normal, meshlet.coneAxis));
+				}
+				meshlet.fConeCos = fMinCos;
+				meshlet.fConeSin = std::sqrt(std::max(1.0f - fMinCos * fMinCos, 0.0f));
+			}
+
+			meshlets.push_back(meshlet);
+			nFirstTriangle += meshlet.nTriangleCount;
+		}
+
+		BuildMeshletBVH(meshlets, meshletBVH);
+	}
+
+	//Build the levels of detail (See MeshLOD). Level 0 is the mesh as it is. Every level after it simplifies the mesh further (See QuadricSimplifier),
+	//aiming for fLODReduction of the triangles of the level before. Its error is the largest error of all the collapses that made it
+	//A level is a mesh of its own while it's built: only the vertices it uses, sorted, ordered for the vertex cache and cut into meshlets the same way Load() does it.
+	//Then its arrays are appended to the arrays of this mesh and its meshlets get a hierarchy of their own in meshletBVH. Its indices stay the ones of its own vertices,
+	//so the indices keep the width level 0 needs (the renderer adds MeshLOD::nFirstVertex). The vertex streams grow by the vertices of all the levels, about as many as level 0 has
+	//The chain ends at nMaxLODs levels, at nMinLODTriangles triangles or when a level can't get rid of a quarter of the triangles without more error than fMaxLODError allows.
+	//The seams of the normals and the texture coordinates never move, so meshes with a lot of them can end it early (See QuadricSimplifier)
+	//Call this last. The bounds, the occluder and the vertex cache statistics stay the ones of level 0
+	void BuildLODs() {
+		lods.clear();
+		MeshLOD full;
+		full.nTriangleCount = (uint32_t)(indices.size() / 3);
+		full.nVertexCount = (uint32_t)nVertexCount;
+		full.nMeshletCount = (uint32_t)meshlets.size();
+		lods.push_back(full);
+		if (full.nTriangleCount <= nMinLODTriangles || triangleMaterials.size() != full.nTriangleCount) return;
+
+		std::vector<uint32_t> vecIndices = indices.ToVector();
+		QuadricSimplifier simplifier(vecIndices.data(), full.nTriangleCount, vertexX.data(), vertexY.data(), vertexZ.data(), nVertexCount);
+		const float fMaxError = fMaxLODError * boundingSphere.fRadius;
+		const uint32_t nUnused = 0xffffffffu;
+		std::vector<uint32_t> vecLODIndices, vecSourceTriangles;
+		std::vector<uint32_t> vecRemap(nVertexCount);
+		std::size_t nTriangles = full.nTriangleCount;
+		while (lods.size() < nMaxLODs) {
+			const std::size_t nTarget = std::max((std::size_t)(nTriangles * fLODReduction), (std::size_t)nMinLODTriangles);
+			if (nTarget >= nTriangles) break;
+			const float fError = simplifier.Simplify(nTarget, fMaxError);
+			if (simplifier.TriangleCount() > nTriangles * 3 / 4) break;
+			nTriangles = simplifier.TriangleCount();
+
+			//The level as a mesh of its own, with the vertices it uses in the order it first uses them
+			simplifier.GetTriangles(vecLODIndices, vecSourceTriangles);
+			Mesh level;
+			std::fill(vecRemap.begin(), vecRemap.end(), nUnused);
+			for (uint32_t& nVertex : vecLODIndices) {
+				if (vecRemap[nVertex] == nUnused) {
+					vecRemap[nVertex] = (uint32_t)level.VertexCount();
+					level.AddVertex(GetVertex(nVertex));
+				}
+				nVertex = vecRemap[nVertex];
+			}
+			level.indices.Assign(vecLODIndices, level.VertexCount());
+			level.triangleMaterials.resize(nTriangles);
+			for (std::size_t i = 0; i < nTriangles; i++) level.triangleMaterials[i] = triangleMaterials[vecSourceTriangles[i]];
+			level.boundingBox = boundingBox;
+			level.SortTrianglesSpatially();
+			level.CalculateNormals();
+			level.OptimizeVertexCache();
+			level.BuildMeshlets();
+
+			MeshLOD lod;
+			lod.nFirstTriangle = (uint32_t)(vecIndices.size() / 3);
+			lod.nTriangleCount = (uint32_t)nTriangles;
+			lod.nFirstVertex = (uint32_t)nVertexCount;
+			lod.nVertexCount = (uint32_t)level.VertexCount();
+			lod.nFirstMeshlet = (uint32_t)meshlets.size();
+			lod.nMeshletCount = (uint32_t)level.meshlets.size();
+			lod.fError = fError;
+
+			ReserveVertices(level.VertexCount());
+			for (std::size_t i = 0; i < level.VertexCount(); i++) AddVertex(level.GetVertex(i));
+			for (std::size_t i = 0; i < level.indices.size(); i++) vecIndices.push_back(level.indices[i]);
+			normalX.insert(normalX.end(), level.normalX.begin(), level.normalX.end());
+			normalY.insert(normalY.end(), level.normalY.begin(), level.normalY.end());
+			normalZ.insert(normalZ.end(), level.normalZ.begin(), level.normalZ.end());
+			triangleMaterials.insert(triangleMaterials.end(), level.triangleMaterials.begin(), level.triangleMaterials.end());
+			for (Meshlet meshlet : level.meshlets) {
+				meshlet.nFirstTriangle += lod.nFirstTriangle;
+				meshlet.nFirstVertex += lod.nFirstVertex;
+				meshlet.nLastVertex += lod.nFirstVertex;
+				meshlets.push_back(meshlet);
+			}
+			lod.nBVHRoot = AppendMeshletBVH(meshlets, lod.nFirstMeshlet, lod.nMeshletCount, meshletBVH);
+			lods.push_back(lod);
+		}
+		indices.Assign(vecIndices, full.nVertexCount);
+	}
 };
 
 //A Struct that holds the information about the camera
@@ -98,11 +1063,209 @@ struct Camera {
 	float fCameraRotatingSpeed = 5.0f;
 };
 
+//A struct that holds a scripted camera path
+//We use this to drive the main camera when there is nobody at the keyboard (headless mode)
+struct CameraPath {
+	std::vector<Transform> keyframes; // The camera moves linearly from one keyframe to the next
+
+	//Get the camera transform at t. t must be between 0 and 1 (0 is the first keyframe and 1 is the last keyframe)
+	Transform Evaluate(float t) const {
+		if (keyframes.empty()) return Transform();
+		if (keyframes.size() == 1 || t <= 0.0f) return keyframes.front();
+		if (t >= 1.0f) return keyframes.back();
+
+		float fKeyframe = t * (float)(keyframes.size() - 1);
+		std::size_t index = (std::size_t)fKeyframe;
+		float fBlend = fKeyframe - (float)index;
+
+		const Transform& a = keyframes[index];
+		const Transform& b = keyframes[index + 1];
+
+		Transform result;
+		result.position = a.position + (b.position - a.position) * fBlend;
+		result.rotation = a.rotation + (b.rotation - a.rotation) * fBlend;
+		return result;
+	}
+
+	//Make a path that orbits once around the center point at the given radius while always looking at the center
+	static CameraPath MakeOrbit(Math::Vector3 center, float fRadius, int nKeyframes = 64) {
+		CameraPath path;
+		for (int i = 0; i <= nKeyframes; i++) {
+			float fAngle = 2.0f * Math::fPi * (float)i / (float)nKeyframes;
+			//Forward direction of the camera is (sin(rotation.y), 0, cos(rotation.y)). So we place the camera behind the center along that direction
+			Transform transform;
+			transform.position = Math::Vector3(center.x - std::sin(fAngle) * fRadius, center.y, center.z - std::cos(fAngle) * fRadius);
+			transform.rotation = Math::Vector3(0.0f, fAngle, 0.0f);
+			path.keyframes.push_back(transform);
+		}
+		return path;
+	}
+};
+
+//A struct that holds the counters and the timings of the rendering pipeline
+//All the timings are in seconds
+struct RenderStats {
+	double dClearTime = 0.0; // clearing the screen and the depth buffer
+	double dOcclusionTime = 0.0; // drawing the occluders into the occlusion buffer
+	double dTransformTime = 0.0; // transforming the vertices to the screen space
+	double dShadingTime = 0.0; // calculating the normals and the lighting of the triangles
+	double dRasterTime = 0.0; // rasterizing the triangles
+	double dResolveTime = 0.0; // lighting the visible pixels from the visibility buffer (deferred shading only)
+	double dFrameTime = 0.0; // the whole OnUserUpdate()
+	uint64_t nFrames = 0;
+	uint64_t nObjectsCulled = 0; // objects that were completely outside the view frustum
+	uint64_t nObjectsOccluded = 0; // objects the occlusion pre-pass found hidden behind the occluders
+	uint64_t nClusters = 0; // meshlets of the objects that were not culled
+	uint64_t nClustersCulled = 0; // meshlets that were outside the view frustum or faced the wrong way as a whole
+	uint64_t nClustersOcclusionCulled = 0; // meshlets of the visible objects the occlusion pre-pass found hidden
+	uint64_t nTrianglesClusterCulled = 0; // triangles of the meshlets culled either way. They are not counted in nTrianglesCulled
+	uint64_t nTrianglesSubmitted = 0; // triangles of all the meshes we went through
+	uint64_t nTrianglesCulled = 0; // triangles thrown away by backface culling one by one
+	uint64_t nTrianglesRasterized = 0; // triangles that reached the rasterizer
+	uint64_t nPixelsWritten = 0; // pixels that passed the depth test
+	uint64_t nPixelsShaded = 0; // pixels that got a color. The same as nPixelsWritten in forward shading, the visible pixels in deferred shading
+	uint64_t nClustersOccluded = 0; // meshlets the rasterizer skipped in a tile because they were behind the hierarchical depth buffer. Counted once per tile
+	uint64_t nHiZBlocksCulled = 0; // 8x8 pixel blocks of triangles skipped for the same reason
+	uint64_t nObjectsLOD = 0; // visible objects drawn with one of their simplified levels of detail
+	uint64_t nTrianglesLODReduced = 0; // triangles those levels have less than the full meshes
+
+	RenderStats& operator += (const RenderStats& rhs) {
+		dClearTime += rhs.dClearTime;
+		dOcclusionTime += rhs.dOcclusionTime;
+		dTransformTime += rhs.dTransformTime;
+		dShadingTime += rhs.dShadingTime;
+		dRasterTime += rhs.dRasterTime;
+		dResolveTime += rhs.dResolveTime;
+		dFrameTime += rhs.dFrameTime;
+		nFrames += rhs.nFrames;
+		nObjectsCulled += rhs.nObjectsCulled;
+		nObjectsOccluded += rhs.nObjectsOccluded;
+		nClustersOcclusionCulled += rhs.nClustersOcclusionCulled;
+		nClusters += rhs.nClusters;
+		nClustersCulled += rhs.nClustersCulled;
+		nTrianglesClusterCulled += rhs.nTrianglesClusterCulled;
+		nTrianglesSubmitted += rhs.nTrianglesSubmitted;
+		nTrianglesCulled += rhs.nTrianglesCulled;
+		nTrianglesRasterized += rhs.nTrianglesRasterized;
+		nPixelsWritten += rhs.nPixelsWritten;
+		nPixelsShaded += rhs.nPixelsShaded;
+		nClustersOccluded += rhs.nClustersOccluded;
+		nHiZBlocksCulled += rhs.nHiZBlocksCulled;
+		nObjectsLOD += rhs.nObjectsLOD;
+		nTrianglesLODReduced += rhs.nTrianglesLODReduced;
+		return *this;
+	}
+};
+
+//A struct that holds a triangle that is ready to be rasterized
+struct ScreenTriangle {
+	Math::Vector3 p0, p1, p2; // x and y are in screen space. z holds the depth value (1 / w)
+	olc::Pixel color; // the lit color of the triangle. Deferred shading leaves it empty
+	Math::Vector3 normal; // the world space normal. Deferred shading lights the visible pixels with it
+	uint32_t nCluster = 0; // the ScreenCluster this triangle belongs to
+	const Texture* pTexture = nullptr; // the diffuse texture of its material. nullptr if it has none or texture mapping is off
+};
+
+//Corner values of a smooth shaded or a textured triangle. They sit at the same index in vecTriangleAttributes as the triangle in vecTrianglesToRaster
+//Gouraud: the gray level of the corner is fAttributes[corner][0]. Phong: fAttributes[corner] is the world space normal of the corner
+struct ScreenTriangleAttributes {
+	float fAttributes[3][3];
+	float fTexCoords[3][2]; // only set if the triangle has a texture
+};
+
+//A value that changes linearly over the screen, fDx * x + fDy * y + fC. It's set up from the values at the three corners of a triangle
+struct ScreenPlane {
+	float fDx = 0.0f, fDy = 0.0f, fC = 0.0f;
+
+	ScreenPlane() {}
+	ScreenPlane(const Math::Vector3& p0, const Math::Vector3& p1, const Math::Vector3& p2, float v0, float v1, float v2) {
+		const float fInvArea = 1.0f / ((p1.x - p0.x) * (p2.y - p0.y) - (p2.x - p0.x) * (p1.y - p0.y));
+		fDx = ((v1 - v0) * (p2.y - p0.y) - (v2 - v0) * (p1.y - p0.y)) * fInvArea;
+		fDy = ((v2 - v0) * (p1.x - p0.x) - (v1 - v0) * (p2.x - p0.x)) * fInvArea;
+		fC = v0 - fDx * p0.x - fDy * p0.y;
+	}
+
+	float At(float x, float y) const { return fDx * x + fDy * y + fC; }
+};
+
+//Screen space bounds of the triangles of a meshlet that are waiting to be rasterized
+//The rasterizer tests these against the hierarchical depth buffer before it looks at the triangles one by one
+struct ScreenCluster {
+	float fMinX, fMinY, fMaxX, fMaxY;
+	float fNearestDepth; // the biggest depth value (1 / w) of the triangles
+};
+
+//The rasterizers the engine can choose from
+enum class Rasterizer {
+	Scanline,	// Walks down the edges of the triangle and fills it one horizontal span at a time
+	HalfSpace	// Tests the pixels of the bounding box against the three edge functions of the triangle
+};
+
+//How the triangles are lit
+enum class ShadingMode {
+	Flat,		// one color per triangle from its face normal
+	Gouraud,	// the corners are lit with the vertex normals and the colors are interpolated over the triangle
+	Phong		// the vertex normals are interpolated over the triangle and every pixel is lit with its own normal
+};
+
+//Helper to get the seconds passed since a time point. We use this to time the stages of the rendering pipeline
+static double SecondsSince(const std::chrono::high_resolution_clock::time_point& tp) {
+	return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tp).count();
+}
+
 //A struct that holds the directional light data
 struct DirectionalLight {
 	Math::Vector3 rotation;
 };
 
+//Gray level (0 to 255) of a surface with this normal. Both must be normalized
+static float ShadeGrayLevel(const Math::Vector3& normal, const Math::Vector3& directional_light_direction) {
+	//Since we are calculating the dot product of 2 normalized vectors dot product will be between -1 and 1. We have to normalize that before feeding it into the ClassifyPixel() function to determine the color of the pixel
+	float dot_product_of_the_triangle_normal_and_light_direction = Math::Vec3DotProduct(normal, directional_light_direction);
+
+	//Normalize the dot_product_of_the_triangle_normal_and_light_direction
+	dot_product_of_the_triangle_normal_and_light_direction = dot_product_of_the_triangle_normal_and_light_direction * 0.5f + 0.5f;
+
+	float pixel_grayscaled_color = dot_product_of_the_triangle_normal_and_light_direction * 255.0f;
+
+	//Clamp the pixel_grayscaled_color So it won't go out of boundary
+	if (pixel_grayscaled_color < 0.0f) pixel_grayscaled_color = 0.0f;
+	else if(pixel_grayscaled_color > 255.0f) pixel_grayscaled_color = 255.0f;
+
+	return pixel_grayscaled_color;
+}
+
+//Flat shading. The color of a triangle only depends on the angle between its normal and the light direction. Both must be normalized
+static olc::Pixel ShadeFlat(const Math::Vector3& normal, const Math::Vector3& directional_light_direction) {
+	const int nGray = (int)ShadeGrayLevel(normal, directional_light_direction);
+	return olc::Pixel(nGray, nGray, nGray);
+}
+
+//Gray level (0 to 255) of a pixel of a smooth shaded triangle (See ScreenTriangleAttributes). z is the depth (1 / w) of the pixel
+//pAttributes are the corner attributes times the corner depths, interpolated linearly over the screen. Dividing by z makes that perspective correct
+//Gouraud does that division. Phong doesn't need to, the normal is normalized anyway and that takes the z out too
+template <ShadingMode shadingMode>
+static inline float SmoothGrayLevel(const float* pAttributes, float z, const Math::Vector3& directional_light_direction) {
+	float fGray;
+	if (shadingMode == ShadingMode::Gouraud) {
+		fGray = pAttributes[0] / z;
+	}
+	else {
+		const float fDot = pAttributes[0] * directional_light_direction.x + pAttributes[1] * directional_light_direction.y + pAttributes[2] * directional_light_direction.z;
+		const float fLengthSquared = pAttributes[0] * pAttributes[0] + pAttributes[1] * pAttributes[1] + pAttributes[2] * pAttributes[2];
+		fGray = (fDot / std::sqrt(fLengthSquared) * 0.5f + 0.5f) * 255.0f;
+	}
+	//A vertex without a normal gives NaN here. The comparisons are false for NaN, so it ends up black
+	return fGray > 0.0f ? (fGray < 255.0f ? fGray : 255.0f) : 0.0f;
+}
+
+//Color of a pixel of a smooth shaded triangle without a texture (See SmoothGrayLevel())
+template <ShadingMode shadingMode>
+static inline uint32_t ShadeSmoothPixel(const float* pAttributes, float z, const Math::Vector3& directional_light_direction) {
+	const uint8_t nGray = (uint8_t)SmoothGrayLevel<shadingMode>(pAttributes, z, directional_light_direction);
+	return olc::Pixel(nGray, nGray, nGray).n;
+}
+
 //Our renderer class which inherits from olc::PixelGameEngine class
 class Pixel3DRenderingEngine : public olc::PixelGameEngine {
 public:
@@ -110,12 +1273,174 @@ public:
 		sAppName = "Pixel 3D Rendering Engine";
 	}
 
+	//Select the instruction set of the vertex transform kernel. Falls back to the best one the CPU supports
+	void SetSimdLevel(Math::SimdLevel level) {
+		simdLevel = std::min(level, Math::GetSimdLevel());
+	}
+
+	//Set the number of threads that render the frame. 0 means one thread per hardware thread. Must be called before Start() or RunHeadless()
+	void SetThreadCount(unsigned int nThreads) {
+		nThreadCount = nThreads;
+	}
+
+	//Select the rasterizer. This can be changed at any time, even between two frames (Press R to switch between them while running)
+	void SetRasterizer(Rasterizer _rasterizer) {
+		rasterizer = _rasterizer;
+	}
+
+	//Select the faces every mesh culls when it's loaded. Each mesh can change its own Mesh::cullMode after that
+	//Must be called before Start() or RunHeadless()
+	void SetCullMode(CullMode _cullMode) {
+		defaultCullMode = _cullMode;
+	}
+
+	//Do the backface test in object space (against the camera position) instead of screen space (the winding of the projected triangle)
+	//The object space test runs before the transformed vertices are read, the screen space one also works for clipped triangles
+	void SetObjectSpaceCulling(bool bEnable) {
+		bObjectSpaceCulling = bEnable;
+	}
+
+	//Skip the objects whose bounding volumes are outside the view frustum. On by default
+	void SetFrustumCulling(bool bEnable) {
+		bFrustumCulling = bEnable;
+	}
+
+	//Cull the meshlets of the visible objects against the frustum and by their normal cones before transforming their vertices. On by default
+	void SetClusterCulling(bool bEnable) {
+		bClusterCulling = bEnable;
+	}
+
+	//Keep the farthest depth of every 8x8 pixel block next to the depth buffer and skip the meshlets and blocks of triangles that are behind it. On by default
+	//The visible meshlets are drawn front to back then, so the near ones hide the far ones. Only the halfspace rasterizer uses it
+	void SetHiZCulling(bool bEnable) {
+		bHiZCulling = bEnable;
+	}
+
+	//Draw the big triangles of the objects that are big on the screen into a small depth buffer first (See OcclusionBuffer)
+	//Then skip the objects and the meshlets whose bounding boxes are behind it. Off by default
+	void SetOcclusionCulling(bool bEnable) {
+		bOcclusionCulling = bEnable;
+	}
+
+	//Deferred shading. The rasterizer only writes the depth and the index of the triangle into the visibility buffer
+	//Then every visible pixel is lit exactly once, however many triangles were drawn over it. Off by default
+	void SetDeferredShading(bool bEnable) {
+		bDeferredShading = bEnable;
+	}
+
+	//Select how the triangles are lit. Flat by default (Press M to go through the modes while running)
+	//The scanline rasterizer can't interpolate. It draws the smooth modes flat shaded, unless deferred shading lights the pixels
+	void SetShadingMode(ShadingMode _shadingMode) {
+		shadingMode = _shadingMode;
+	}
+
+	//Draw the textures of the materials (map_Kd) and their colors (Kd). On by default (Press T to switch it while running)
+	//The scanline rasterizer can't interpolate the texture coordinates. It draws the textured triangles without their textures, unless deferred shading lights the pixels
+	void SetTextureMapping(bool bEnable) {
+		bTextureMapping = bEnable;
+	}
+
+	//Keep every mesh in a binary cache next to its .obj file and load it from there the next time (See Mesh::Load()). On by default
+	void SetMeshCache(bool bEnable) {
+		bMeshCache = bEnable;
+	}
+
+	//Merge the vertices of the meshes that are closer than fEpsilon to each other when they are loaded (See Mesh::WeldVertices()). 0, the default, only merges the same vertices
+	void SetWeldEpsilon(float fEpsilon) {
+		fWeldEpsilon = fEpsilon;
+	}
+
+	//Draw every object with the coarsest of its levels of detail whose estimated mean error is at most fPixels pixels on the screen (See SelectLOD()). 1 by default, 0 always draws the full meshes
+	void SetLODThreshold(float fPixels) {
+		fLODThreshold = fPixels;
+	}
+
+	//Seconds OnUserCreate() spent loading the meshes (See Mesh::Load()), from their .obj files or their caches. The rest of the load time starts the threads and allocates the buffers
+	double GetMeshLoadTime() const {
+		return dMeshLoadTime;
+	}
+
+	//Number of meshes OnUserCreate() loaded from their caches
+	int GetCachedMeshCount() const {
+		return nCachedMeshes;
+	}
+
+	//Vertices of all the meshes OnUserCreate() loaded, before and after Mesh::WeldVertices()
+	void GetWeldStats(uint64_t& nVerticesBefore, uint64_t& nVerticesAfter) const {
+		nVerticesBefore = nVerticesBeforeWeld;
+		nVerticesAfter = nVerticesAfterWeld;
+	}
+
+	//Vertex cache statistics of all the meshes OnUserCreate() loaded, before and after Mesh::OptimizeVertexCache()
+	void GetVertexCacheStats(VertexCacheStats& before, VertexCacheStats& after) const {
+		before = vertexCacheStatsBefore;
+		after = vertexCacheStatsAfter;
+	}
+
+	//Replace the objects that will be loaded in OnUserCreate(). Must be called before Start() or RunHeadless()
+	void SetObjFiles(const std::unordered_map<int, std::pair<std::string, Transform>>& objFiles) {
+		ObjFiles = objFiles;
+	}
+
+	//Run the same OnUserCreate() / OnUserUpdate() pipeline without opening a window or an OpenGL context
+	//Construct() must be called before this. Frames are rendered into an offscreen sprite and the camera follows the given path
+	//If sFrameDumpDirectory is not empty every frame is written there as a .ppm image. Otherwise frames are discarded
+	//If pTotalStats is not null the stats of all the frames are added to it. pLoadTime receives the time OnUserCreate() took (in seconds)
+	bool RunHeadless(int nFrames, const CameraPath& cameraPath, const std::string& sFrameDumpDirectory = "", RenderStats* pTotalStats = nullptr, double* pLoadTime = nullptr) {
+		//olc::PixelGameEngine only gives us a draw target after Start() created the window. So we provide our own
+		olc::Sprite* pHeadlessTarget = new olc::Sprite(ScreenWidth(), ScreenHeight());
+		SetDrawTarget(pHeadlessTarget);
+
+		std::chrono::high_resolution_clock::time_point tpLoad = std::chrono::high_resolution_clock::now();
+		if (!OnUserCreate()) {
+			delete pHeadlessTarget;
+			return false;
+		}
+		if (pLoadTime) *pLoadTime = SecondsSince(tpLoad);
+
+		//Use a fixed time step so every run renders exactly the same frames
+		const float fElapsedTime = 1.0f / 60.0f;
+
+		for (int frame = 0; frame < nFrames; frame++) {
+			mainCamera.transform = cameraPath.Evaluate(nFrames > 1 ? (float)frame / (float)(nFrames - 1) : 0.0f);
+
+			bool bContinue = OnUserUpdate(fElapsedTime);
+			if (pTotalStats) *pTotalStats += frameStats;
+
+			if (!sFrameDumpDirectory.empty()) {
+				char filename[32];
+				snprintf(filename, sizeof(filename), "/frame_%05d.ppm", frame);
+				SaveSpriteAsPPM(pHeadlessTarget, sFrameDumpDirectory + filename);
+			}
+
+			if (!bContinue) break;
+		}
+
+		OnUserDestroy();
+		pfDepthBuffer = nullptr;
+		delete pHeadlessTarget;
+
+		return true;
+	}
+
 private:
 	bool OnUserCreate() override {
 		//Alocate the memory for the pfDepthBuffer
 		pfDepthBuffer = new float[ScreenWidth() * ScreenHeight()]; // Depth buffer must be the same size as our screen buffer
 		//We must delete the pfDepthBuffer in our OnDestroy() function
 
+		//Start the worker threads. They live until OnUserDestroy()
+		threadPool.reset(new ThreadPool(nThreadCount));
+		vecThreadStats.assign(threadPool->GetThreadCount(), RenderStats());
+
+		//The hierarchical depth buffer has one value for every nHiZBlockSize x nHiZBlockSize block of pixels
+		nHiZBlocksX = (ScreenWidth() + nHiZBlockSize - 1) / nHiZBlockSize;
+		vecHiZBlocks.assign(nHiZBlocksX * ((ScreenHeight() + nHiZBlockSize - 1) / nHiZBlockSize), HiZBlock());
+		occlusionBuffer.Resize(ScreenWidth(), ScreenHeight());
+
+		//The visibility buffer is never cleared. A pixel of it is only read if the depth buffer says something was drawn there this frame
+		vecVisibilityBuffer.assign(ScreenWidth() * ScreenHeight(), 0);
+
 		// Set up the projection matrix
 		ProjectionMatrix = Math::Mat4MakeProjectionMatrix((float)ScreenWidth() / (float)ScreenHeight(), 90.0f, 0.05f, 1000.0f);
 
@@ -137,8 +1462,24 @@ private:
 		);
 
 		//Load object models
+		dMeshLoadTime = 0.0;
+		nCachedMeshes = 0;
+		vertexCacheStatsBefore = VertexCacheStats();
+		vertexCacheStatsAfter = VertexCacheStats();
+		nVerticesBeforeWeld = 0;
+		nVerticesAfterWeld = 0;
 		for (const std::pair<int, std::pair<std::string, Transform>>& obj : ObjFiles) {
-			Mesh gameObject(obj.second.first, obj.second.second);
+			Mesh gameObject(obj.second.first, obj.second.second, threadPool.get(), bMeshCache, fWeldEpsilon);
+			dMeshLoadTime += gameObject.dLoadTime;
+			if (gameObject.bLoadedFromCache) nCachedMeshes++;
+			vertexCacheStatsBefore += gameObject.vertexCacheStatsBefore;
+			vertexCacheStatsAfter += gameObject.vertexCacheStatsAfter;
+			nVerticesBeforeWeld += gameObject.nVerticesBeforeWeld;
+			nVerticesAfterWeld += gameObject.lods[0].nVertexCount;
+			gameObject.cullMode = defaultCullMode;
+			for (const Material& material : gameObject.materials) {
+				if (material.diffuseTexture) bSceneHasTextures = true;
+			}
 			GameObjects.insert({ obj.first, gameObject });
 		}
 
@@ -148,11 +1489,15 @@ private:
 	}
 
 	bool OnUserUpdate(float fElapsedTime) override {
+		//Reset the stats of the last frame
+		frameStats = RenderStats();
+		frameStats.nFrames = 1;
+		std::chrono::high_resolution_clock::time_point tpFrame = std::chrono::high_resolution_clock::now();
 
-		//Clear the screen to black before drawing anything
-		Clear(olc::Pixel(255, 255, 70));
-		//Clear the depdth buffer alongside with the screen buffer
-		ClearDepthBuffer(pfDepthBuffer);
+		//Clear the screen before drawing anything. The depdth buffer is cleared alongside with the screen buffer
+		std::chrono::high_resolution_clock::time_point tpStage = std::chrono::high_resolution_clock::now();
+		ClearBuffers(olc::Pixel(255, 255, 70), pfDepthBuffer);
+		frameStats.dClearTime = SecondsSince(tpStage);
 
 		//Get Inputs
 		if (GetKey(olc::W).bHeld) {
@@ -209,137 +1554,938 @@ private:
 			//Rotate counter-clockwise around y axis of the directoinalLight
 			directoinalLight.rotation.y -= 1.0f * fElapsedTime;
 		}
+		if (GetKey(olc::R).bPressed) {
+			//Switch between the rasterizers so we can compare them
+			rasterizer = rasterizer == Rasterizer::Scanline ? Rasterizer::HalfSpace : Rasterizer::Scanline;
+		}
+		if (GetKey(olc::M).bPressed) {
+			//Go to the next shading mode
+			shadingMode = shadingMode == ShadingMode::Flat ? ShadingMode::Gouraud : shadingMode == ShadingMode::Gouraud ? ShadingMode::Phong : ShadingMode::Flat;
+		}
+		if (GetKey(olc::T).bPressed) {
+			//Switch the textures on or off
+			bTextureMapping = !bTextureMapping;
+		}
 
 		////Rotate the cube around its x axis and z axis
 		//GameObjects[0].transform.rotation.x += 1.0f * fElapsedTime;
 		//GameObjects[0].transform.rotation.z += 1.0f * fElapsedTime;
 
 		//Rendering routine
+		//The triangles of all the objects are collected into vecTrianglesToRaster first and rasterized after that. So each stage can be timed on its own
+		vecTrianglesToRaster.clear();
+		vecTriangleAttributes.clear();
+		vecClustersToRaster.clear();
+
+		//The corner attributes are only needed if somebody interpolates them: the halfspace rasterizer or the deferred resolve
+		//The texture coordinates too. If any triangle of the frame has a texture, every triangle gets its attributes, so they stay at the same index as the triangles
+		const bool bSmoothShading = shadingMode != ShadingMode::Flat && (bDeferredShading || rasterizer == Rasterizer::HalfSpace);
+		const bool bTexturing = bTextureMapping && bSceneHasTextures && (bDeferredShading || rasterizer == Rasterizer::HalfSpace);
+		const bool bInterpolate = bSmoothShading || bTexturing;
+
+		//Build the camera matrices once per frame instead of once per vertex
+		//ViewMatrix gets the position of a vertex in CamaraSpcae by translating and rotating the vertex by camera position and rotation
+		const Math::Mat4x4 ViewMatrix = Math::Mat4MakeTranslationInv(mainCamera.transform.position) * Math::Mat4MakeRotationZXYInv(mainCamera.transform.rotation);
+		const Math::Mat4x4 ViewProjectionMatrix = ViewMatrix * ProjectionMatrix;
+
+		//The 6 planes of the view frustum in world space. Objects that are completely outside one of them are skipped
+		const Math::Frustum frustum = Math::FrustumFromMatrix(ViewProjectionMatrix);
+
+		//Directional Light direction
+		//This is recalculated every frame. So if you modified the rotation of the directional light at runtime you still get realtime results
+		Math::Vector3 directional_light_direction = Math::VEC3_Forward * Math::Mat3MakeRotationZXY(directoinalLight.rotation);
+		directional_light_direction.Normalize();
+
+		//Occlusion pre-pass. Everything that is tested against the occlusion buffer below is tested against these occluders
+		tpStage = std::chrono::high_resolution_clock::now();
+		if (bOcclusionCulling) RenderOccluders(ViewProjectionMatrix, frustum);
+		frameStats.dOcclusionTime = SecondsSince(tpStage);
+
 		//Loop through the elements of the GameObjects map
-		for (const std::pair<int, Mesh>& GameObject : GameObjects) {
+		for (std::pair<const int, Mesh>& GameObject : GameObjects) {
 			//GameObject.second contains the actual mesh
 			//GameObject.first conatains the id of that mesh. We don't need that id in this loop. But It is useful if we needed to make changes to the position or the rotation of that particuler object. We can simply get the mesh by using that id as the key from GameObjects map
-			std::vector<Math::Vector4> vec4TransformedVertices;
-			for (const Vertex& vertex : GameObject.second.vertices) {
-				Math::Vector4 transformedVertex =
-					Math::Vector4(vertex.position) * // vertex.position is in object space. Meaning, It's relative to the object's origin
-					Math::Mat4MakeRotationZXY(GameObject.second.transform.rotation) * // We rotate the vertex.position according to the object's rotation information in object space
-					Math::Mat4MakeTranslation(GameObject.second.transform.position) * // Convert the position from Object space to world space by adding the object position to the vertex position
-					Math::Mat4MakeTranslationInv(mainCamera.transform.position) *
-					Math::Mat4MakeRotationZXYInv(mainCamera.transform.rotation) * // Get the position of the vertex in CamaraSpcae by translating and rotating the vertex by camera position and rotation
-					ProjectionMatrix; // Finaly Multiply the position of the vertex so we can convert it to the screen spcae
-
-
-				//This is just a quick fix alternative to clipping. Once triangle clipping algorithm implemented this check won't be neccesory 
-				if (transformedVertex.w > 1.0f) {
-					// Get the position of the vertex in normalized screen space by deviding the vector by its w component
-					transformedVertex /= transformedVertex.w;
-					// Finaly convert it to real screen cordinates
-					transformedVertex.x = (transformedVertex.x * 0.5f + 0.5f) * (float)ScreenWidth();
-					transformedVertex.y = (1.0f - (transformedVertex.y * 0.5f + 0.5f)) * (float)ScreenHeight();
-				}
-				// Push the final transformed vertex position to vec4TransformedVertices vector
-				vec4TransformedVertices.push_back(transformedVertex);
+			tpStage = std::chrono::high_resolution_clock::now();
+
+			//Combine everything into a single model-view-projection matrix. The model matrix is only rebuilt when the transform of the object changed
+			GameObject.second.UpdateTransformCache();
+
+			//Frustum culling. The sphere test is the cheapest, the box is tighter for long and flat objects
+			//An object that fails either of them can't put a single pixel on the screen, so none of its vertices are touched
+			if (bFrustumCulling &&
+				(!Math::FrustumIntersectsSphere(frustum, GameObject.second.worldBoundingSphere) || !Math::FrustumIntersectsAABB(frustum, GameObject.second.worldBoundingBox))) {
+				frameStats.nObjectsCulled++;
+				frameStats.nTrianglesSubmitted += GameObject.second.lods[0].nTriangleCount;
+				frameStats.dTransformTime += SecondsSince(tpStage);
+				continue;
 			}
 
-			for (std::size_t i = 0; i < GameObject.second.indices.size(); i += 3) {
+			const Math::Mat4x4 ModelViewProjectionMatrix = GameObject.second.ModelMatrix * ViewProjectionMatrix;
+			const Mesh& mesh = GameObject.second;
 
-				//Get the right points of the right triangle from vec4TransformedVertices
-				Math::Vector4 p0_in_screen_space = vec4TransformedVertices[GameObject.second.indices[i]];
-				Math::Vector4 p1_in_screen_space = vec4TransformedVertices[GameObject.second.indices[i + 1]];
-				Math::Vector4 p2_in_screen_space = vec4TransformedVertices[GameObject.second.indices[i + 2]];
+			//Occlusion culling. The object space box turned with the object is tighter than the world space one
+			if (bOcclusionCulling && IsBoxOccluded(mesh.boundingBox, ModelViewProjectionMatrix)) {
+				frameStats.nObjectsOccluded++;
+				frameStats.nTrianglesSubmitted += mesh.lods[0].nTriangleCount;
+				frameStats.dTransformTime += SecondsSince(tpStage);
+				continue;
+			}
 
-				//This is just a quick fix alternative to clipping. Once triangle clipping algorithm implemented this check won't be neccesory 
-				// TODO : Implement a triangle clipping algorithm
-				if (p0_in_screen_space.w == 1.0f && p1_in_screen_space.w == 1.0f && p2_in_screen_space.w == 1.0f) {
+			//Which faces of this mesh get culled. And the camera position in the object space of the mesh for the object space tests
+			//The model matrix only rotates and translates, so its inverse is the inverse translation followed by the inverse rotation
+			const CullMode cullMode = GameObject.second.cullMode;
+			const Math::Vector4 vec4_camera_position_in_object_space = Math::Vector4(mainCamera.transform.position) *
+				Math::Mat4MakeTranslationInv(GameObject.second.transform.position) * Math::Mat4MakeRotationZXYInv(GameObject.second.transform.rotation);
+			const Math::Vector3 camera_position_in_object_space(vec4_camera_position_in_object_space.x, vec4_camera_position_in_object_space.y, vec4_camera_position_in_object_space.z);
+
+			//Level of detail. Everything after this only sees the triangles, the vertices and the meshlets of that level
+			const MeshLOD& lod = SelectLOD(mesh, camera_position_in_object_space);
+			if (&lod != &mesh.lods[0]) {
+				frameStats.nObjectsLOD++;
+				frameStats.nTrianglesLODReduced += mesh.lods[0].nTriangleCount - lod.nTriangleCount;
+			}
 
-					//Get the normal of this particular triangle (in world space)
-					Math::Vector3 normal = GameObject.second.normals[(int)(i / 3)];
+			//Cluster culling. Walk the meshlet hierarchy of the level with the frustum planes in object space (the ones of the model-view-projection matrix)
+			//The normal cones throw away the meshlets that are made of back faces only. Nothing of a culled meshlet is touched after this
+			vecVisibleMeshlets.clear();
+			if (bClusterCulling) {
+				const float fFacing = cullMode == CullMode::Back ? 1.0f : cullMode == CullMode::Front ? -1.0f : 0.0f;
+				frameStats.nClustersCulled += CullMeshlets(mesh.meshletBVH, mesh.meshlets, Math::FrustumFromMatrix(ModelViewProjectionMatrix),
+					camera_position_in_object_space, fFacing, vecVisibleMeshlets, lod.nBVHRoot);
+			}
+			else {
+				for (uint32_t i = lod.nFirstMeshlet; i < lod.nFirstMeshlet + lod.nMeshletCount; i++) vecVisibleMeshlets.push_back(i);
+			}
+			frameStats.nClusters += lod.nMeshletCount;
+
+			//The meshlets hidden behind the occluders go too
+			if (bOcclusionCulling) {
+				const std::size_t nVisibleMeshlets = vecVisibleMeshlets.size();
+				vecVisibleMeshlets.erase(std::remove_if(vecVisibleMeshlets.begin(), vecVisibleMeshlets.end(), [&](uint32_t nMeshlet) {
+					return IsBoxOccluded(mesh.meshlets[nMeshlet].boundingBox, ModelViewProjectionMatrix);
+				}), vecVisibleMeshlets.end());
+				frameStats.nClustersOcclusionCulled += nVisibleMeshlets - vecVisibleMeshlets.size();
+			}
+
+			//Front to back, so the hierarchical depth buffer already holds the near meshlets when the rasterizer gets to the far ones
+			if (bHiZCulling) {
+				std::sort(vecVisibleMeshlets.begin(), vecVisibleMeshlets.end(), [&](uint32_t a, uint32_t b) {
+					const Math::Vector3 toA = mesh.meshlets[a].boundingSphere.center - camera_position_in_object_space;
+					const Math::Vector3 toB = mesh.meshlets[b].boundingSphere.center - camera_position_in_object_space;
+					return Math::Vec3DotProduct(toA, toA) < Math::Vec3DotProduct(toB, toB);
+				});
+			}
+
+			//The vertex ranges of the visible meshlets, widened to whole AVX2 registers and merged where they overlap
+			//A mesh with no meshlets culled ends up with the one range over all the vertices
+			vecTransformRanges.clear();
+			for (uint32_t nMeshlet : vecVisibleMeshlets) {
+				const Meshlet& meshlet = mesh.meshlets[nMeshlet];
+				const std::size_t nFirstVertex = meshlet.nFirstVertex / Mesh::nVertexStreamPadding * Mesh::nVertexStreamPadding;
+				const std::size_t nEndVertex = std::min((meshlet.nLastVertex / Mesh::nVertexStreamPadding + 1) * Mesh::nVertexStreamPadding, mesh.PaddedVertexCount());
+				vecTransformRanges.push_back({ nFirstVertex, nEndVertex });
+			}
+			std::sort(vecTransformRanges.begin(), vecTransformRanges.end());
+			std::size_t nMergedRanges = 0;
+			for (const std::pair<std::size_t, std::size_t>& range : vecTransformRanges) {
+				if (nMergedRanges > 0 && range.first <= vecTransformRanges[nMergedRanges - 1].second) {
+					vecTransformRanges[nMergedRanges - 1].second = std::max(vecTransformRanges[nMergedRanges - 1].second, range.second);
+				}
+				else vecTransformRanges[nMergedRanges++] = range;
+			}
+			vecTransformRanges.resize(nMergedRanges);
+
+			//Split the ranges into chunks of nVerticesPerChunk vertices at most
+			const std::size_t nRanges = vecTransformRanges.size();
+			for (std::size_t i = 0; i < nRanges; i++) {
+				while (vecTransformRanges[i].second - vecTransformRanges[i].first > nVerticesPerChunk) {
+					vecTransformRanges.push_back({ vecTransformRanges[i].first, vecTransformRanges[i].first + nVerticesPerChunk });
+					vecTransformRanges[i].first += nVerticesPerChunk;
+				}
+			}
+
+			//The transformed vertices go to the post-transform buffer of the mesh. It keeps its memory between the frames
+			//The padding vertices are transformed too. That's cheaper than a scalar loop for the last few vertices
+			//The slots of the vertices no visible meshlet uses keep whatever they had. No triangle reads them this frame
+			std::vector<Math::Vector4>& vec4TransformedVertices = GameObject.second.vec4TransformedVertices;
+			vec4TransformedVertices.resize(mesh.PaddedVertexCount());
+
+			//Transform the chunks on all the threads
+			//Every vertex is written to its own slot of vec4TransformedVertices, so the threads never write to the same memory
+			//Every chunk starts and ends on a multiple of the padding, so every chunk is a whole number of AVX2 registers
+			const float fScreenWidth = (float)ScreenWidth();
+			const float fScreenHeight = (float)ScreenHeight();
+			threadPool->ParallelFor((int)vecTransformRanges.size(), [&](int nChunk, unsigned int) {
+				const std::size_t nFirstVertex = vecTransformRanges[nChunk].first;
+				const std::size_t nLastVertex = vecTransformRanges[nChunk].second;
+				// vertex.position is in object space. Meaning, It's relative to the object's origin
+				// ModelViewProjectionMatrix takes it all the way from object space to world space, camera space and then to the screen space in one go
+				// Then the kernel devides the position by its w component and converts it to real screen cordinates, 4 or 8 vertices at a time
+				// Vertices outside the near or the far plane or the guard band are left in clip space with w = 0. The triangles that use them get clipped below
+				Math::Vec3TransformToScreenBatch(&mesh.vertexX[nFirstVertex], &mesh.vertexY[nFirstVertex], &mesh.vertexZ[nFirstVertex], nLastVertex - nFirstVertex,
+					ModelViewProjectionMatrix, fScreenWidth, fScreenHeight, &vec4TransformedVertices[nFirstVertex], simdLevel);
+			});
+			frameStats.dTransformTime += SecondsSince(tpStage);
+
+			tpStage = std::chrono::high_resolution_clock::now();
+			frameStats.nTrianglesSubmitted += lod.nTriangleCount;
+
+			//Go through the triangles of the visible meshlets
+			//A template on the type of the indices (a generic lambda), so meshes with 16 bit indices read 16 bit indices
+			uint64_t nTrianglesVisible = 0;
+			auto SetupTriangles = [&](const auto* pIndices) {
+				for (uint32_t nMeshlet : vecVisibleMeshlets) {
+					const Meshlet& meshlet = mesh.meshlets[nMeshlet];
+					nTrianglesVisible += meshlet.nTriangleCount;
+					const std::size_t nFirstScreenTriangle = vecTrianglesToRaster.size();
+					const uint32_t nCluster = (uint32_t)vecClustersToRaster.size();
+					for (std::size_t i = (std::size_t)meshlet.nFirstTriangle * 3; i < (std::size_t)(meshlet.nFirstTriangle + meshlet.nTriangleCount) * 3; i += 3) {
+
+						//The vertices of the triangle. The indices of a level count from its first vertex
+						const uint32_t nCorners[3] = { lod.nFirstVertex + (uint32_t)pIndices[i], lod.nFirstVertex + (uint32_t)pIndices[i + 1], lod.nFirstVertex + (uint32_t)pIndices[i + 2] };
+
+						//Get the normal of this particular triangle (in object space)
+						const Math::Vector3 object_space_normal = GameObject.second.GetNormal(i / 3);
+
+						//Backface culling in object space. The triangle faces away from the camera if the camera is behind the plane of the triangle
+						//This runs before we even look at the transformed vertices. It's exact for perspective projection too, but it doesn't know about clipping
+						if (cullMode != CullMode::Disabled && bObjectSpaceCulling) {
+							const float fFacing = Math::Vec3DotProduct(object_space_normal, GameObject.second.GetVertexPosition(nCorners[0]) - camera_position_in_object_space);
+							if (cullMode == CullMode::Back ? fFacing >= 0.0f : fFacing <= 0.0f) {
+								frameStats.nTrianglesCulled++;
+								continue;
+							}
+						}
 
-					//Convert the normal from Object space to world space by rotating it by object's rotation
-					normal = normal * Math::Mat3MakeRotationZXY(GameObject.second.transform.rotation);
-					normal.Normalize();
+						//Get the right points of the right triangle from vec4TransformedVertices
+						Math::Vector4 p0_in_screen_space = vec4TransformedVertices[nCorners[0]];
+						Math::Vector4 p1_in_screen_space = vec4TransformedVertices[nCorners[1]];
+						Math::Vector4 p2_in_screen_space = vec4TransformedVertices[nCorners[2]];
+
+						//Triangles with a vertex outside the near or the far plane or the guard band (w == 0) are clipped in clip space
+						//The clip space positions are transformed again from the object space positions. Vec3TransformToClip() does that the same way the kernel did, so the shared edges still match
+						//The clipped polygon is convex. So it gets split into a fan of triangles around its first corner below
+						const bool bNeedsClipping = p0_in_screen_space.w == 0.0f || p1_in_screen_space.w == 0.0f || p2_in_screen_space.w == 0.0f;
+						//The weights of the corners of the clipped polygon are needed to interpolate the vertex attributes for them
+						Math::Vector4 vec4ScreenPolygon[Math::nMaxClippedPolygonVertices];
+						Math::Vector3 vec3PolygonWeights[Math::nMaxClippedPolygonVertices];
+						int nClippedPolygonVertices = 0;
+						if (bNeedsClipping) {
+							Math::Vector4 vec4ClippedPolygon[Math::nMaxClippedPolygonVertices];
+							nClippedPolygonVertices = Math::ClipTriangle(
+								Math::Vec3TransformToClip(GameObject.second.GetVertexPosition(nCorners[0]), ModelViewProjectionMatrix),
+								Math::Vec3TransformToClip(GameObject.second.GetVertexPosition(nCorners[1]), ModelViewProjectionMatrix),
+								Math::Vec3TransformToClip(GameObject.second.GetVertexPosition(nCorners[2]), ModelViewProjectionMatrix),
+								vec4ClippedPolygon, bInterpolate ? vec3PolygonWeights : nullptr);
+							//Completely behind the near plane, beyond the far plane or far off to a side
+							if (nClippedPolygonVertices == 0) continue;
+
+							for (int k = 0; k < nClippedPolygonVertices; k++) {
+								vec4ScreenPolygon[k] = Math::ClipToScreen(vec4ClippedPolygon[k], fScreenWidth, fScreenHeight);
+							}
+						}
 
-					//Normal of the object relative to the main camera ( This is for testing purposes only )
-					Math::Vector3 normal_relative_to_mainCamera = normal * Math::Mat3MakeRotationZXYInv(mainCamera.transform.rotation);
+						//Backface culling in screen space. The winding of a front face is counter clockwise on the screen, so twice its signed area is positive
+						//The corners of a clipped polygon wind the same way as the triangle they came from
+						if (cullMode != CullMode::Disabled && !bObjectSpaceCulling) {
+							float fSignedArea = 0.0f;
+							if (!bNeedsClipping) {
+								fSignedArea = (p1_in_screen_space.x - p0_in_screen_space.x) * (p2_in_screen_space.y - p0_in_screen_space.y) -
+									(p2_in_screen_space.x - p0_in_screen_space.x) * (p1_in_screen_space.y - p0_in_screen_space.y);
+							}
+							else {
+								for (int k = 1; k + 1 < nClippedPolygonVertices; k++) {
+									fSignedArea += (vec4ScreenPolygon[k].x - vec4ScreenPolygon[0].x) * (vec4ScreenPolygon[k + 1].y - vec4ScreenPolygon[0].y) -
+										(vec4ScreenPolygon[k + 1].x - vec4ScreenPolygon[0].x) * (vec4ScreenPolygon[k].y - vec4ScreenPolygon[0].y);
+								}
+							}
+							if (cullMode == CullMode::Back ? fSignedArea <= 0.0f : fSignedArea >= 0.0f) {
+								frameStats.nTrianglesCulled++;
+								continue;
+							}
+						}
 
-					//Get the vertex of the triangle relative to the camera (Vector4)
-					Math::Vector4 vec4_vertex_of_the_triangle_rel_to_mainCamera = Math::Vector4(GameObject.second.vertices[GameObject.second.indices[i + 1]].position) * Math::Mat4MakeRotationZXY(GameObject.second.transform.rotation) * Math::Mat4MakeTranslation(GameObject.second.transform.position) * Math::Mat4MakeTranslationInv(mainCamera.transform.position) * Math::Mat4MakeRotationZXYInv(mainCamera.transform.rotation);
+						//Convert the normal from Object space to world space by rotating it by object's rotation
+						Math::Vector3 normal = object_space_normal * GameObject.second.NormalMatrix;
+						normal.Normalize();
+
+						//Light the triangle now. Deferred shading does it later, only for the pixels where the triangle ends up visible
+						//Smooth shading lights the corners (Gouraud) or just rotates their normals to world space (Phong). The pixels get lit by whoever interpolates them
+						const olc::Pixel pixel = bDeferredShading || bSmoothShading ? olc::BLANK : ShadeFlat(normal, directional_light_direction);
+						ScreenTriangleAttributes attributes;
+						if (bSmoothShading) {
+							for (int k = 0; k < 3; k++) {
+								const Math::Vector3 corner_normal = GameObject.second.GetVertexNormal(nCorners[k]) * GameObject.second.NormalMatrix;
+								if (shadingMode == ShadingMode::Gouraud) attributes.fAttributes[k][0] = ShadeGrayLevel(corner_normal, directional_light_direction);
+								else for (int a = 0; a < 3; a++) attributes.fAttributes[k][a] = corner_normal.element[a];
+							}
+						}
 
-					//Turn the above vertex position to vector3 So we can apply this to Math::Vec3DotProduct() function below
-					Math::Vector3 vertex_of_the_triangle_rel_to_mainCamera(
-						vec4_vertex_of_the_triangle_rel_to_mainCamera.x,
-						vec4_vertex_of_the_triangle_rel_to_mainCamera.y,
-						vec4_vertex_of_the_triangle_rel_to_mainCamera.z
-					);
+						//The texture of the material of the triangle and the texture coordinates of its corners
+						//The texture repeats, so they are moved by whole textures until none is negative. Texture::Sample() needs that
+						const Texture* pTexture = bTexturing ? mesh.materials[mesh.triangleMaterials[i / 3]].diffuseTexture.get() : nullptr;
+						if (pTexture) {
+							for (int k = 0; k < 3; k++) {
+								const Math::Vector2 texCoord = mesh.GetVertexTexCoord(nCorners[k]);
+								attributes.fTexCoords[k][0] = texCoord.x;
+								attributes.fTexCoords[k][1] = texCoord.y;
+							}
+							for (int a = 0; a < 2; a++) Texture::MoveToPositive(attributes.fTexCoords[0][a], attributes.fTexCoords[1][a], attributes.fTexCoords[2][a]);
+						}
 
+						//Finaly queue the triangle for the rasterizer
+						//The depth value is 1 / w. It gets bigger the closer the pixel is to the camera
+						if (!bNeedsClipping) {
+							vecTrianglesToRaster.push_back({
+								Math::Vector3(p0_in_screen_space.x, p0_in_screen_space.y, p0_in_screen_space.w),
+								Math::Vector3(p1_in_screen_space.x, p1_in_screen_space.y, p1_in_screen_space.w),
+								Math::Vector3(p2_in_screen_space.x, p2_in_screen_space.y, p2_in_screen_space.w),
+								pixel,
+								normal,
+								nCluster,
+								pTexture
+							});
+							if (bInterpolate) vecTriangleAttributes.push_back(attributes);
+						}
+						else {
+							for (int k = 1; k + 1 < nClippedPolygonVertices; k++) {
+								vecTrianglesToRaster.push_back({
+									Math::Vector3(vec4ScreenPolygon[0].x, vec4ScreenPolygon[0].y, vec4ScreenPolygon[0].w),
+									Math::Vector3(vec4ScreenPolygon[k].x, vec4ScreenPolygon[k].y, vec4ScreenPolygon[k].w),
+									Math::Vector3(vec4ScreenPolygon[k + 1].x, vec4ScreenPolygon[k + 1].y, vec4ScreenPolygon[k + 1].w),
+									pixel,
+									normal,
+									nCluster,
+									pTexture
+								});
+								if (bInterpolate) {
+									//The attributes of the corners of the fan triangle, mixed from the ones of the original triangle
+									ScreenTriangleAttributes fanAttributes;
+									const int nPolygonCorners[3] = { 0, k, k + 1 };
+									for (int c = 0; c < 3; c++) {
+										const Math::Vector3& weights = vec3PolygonWeights[nPolygonCorners[c]];
+										if (bSmoothShading) {
+											for (int a = 0; a < 3; a++) {
+												fanAttributes.fAttributes[c][a] = weights.x * attributes.fAttributes[0][a] + weights.y * attributes.fAttributes[1][a] + weights.z * attributes.fAttributes[2][a];
+											}
+										}
+										if (pTexture) {
+											for (int a = 0; a < 2; a++) {
+												fanAttributes.fTexCoords[c][a] = weights.x * attributes.fTexCoords[0][a] + weights.y * attributes.fTexCoords[1][a] + weights.z * attributes.fTexCoords[2][a];
+											}
+										}
+									}
+									vecTriangleAttributes.push_back(fanAttributes);
+								}
+							}
+						}
+					}
 
-					//Directional Light direction
-					//We could pre calcultate this instead of recalculating this every frame
-					//But this way it gets a more dynamic look. I mean if you modified the rotation of the directional light at runtime pre calculated results won't give you realtime results
-					Math::Vector3 directional_light_direction = Math::VEC3_Forward * Math::Mat3MakeRotationZXY(directoinalLight.rotation);
-					directional_light_direction.Normalize();
+					//Bounds of the triangles of the meshlet that made it through
+					if (vecTrianglesToRaster.size() > nFirstScreenTriangle) {
+						ScreenCluster cluster = { FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, 0.0f };
+						for (std::size_t k = nFirstScreenTriangle; k < vecTrianglesToRaster.size(); k++) {
+							for (const Math::Vector3* pPoint : { &vecTrianglesToRaster[k].p0, &vecTrianglesToRaster[k].p1, &vecTrianglesToRaster[k].p2 }) {
+								cluster.fMinX = std::min(cluster.fMinX, pPoint->x); cluster.fMaxX = std::max(cluster.fMaxX, pPoint->x);
+								cluster.fMinY = std::min(cluster.fMinY, pPoint->y); cluster.fMaxY = std::max(cluster.fMaxY, pPoint->y);
+								cluster.fNearestDepth = std::max(cluster.fNearestDepth, pPoint->z);
+							}
+						}
+						vecClustersToRaster.push_back(cluster);
+					}
+				}
+			};
+			if (mesh.indices.Is32Bit()) SetupTriangles(mesh.indices.Data<uint32_t>());
+			else SetupTriangles(mesh.indices.Data<uint16_t>());
+			frameStats.nTrianglesClusterCulled += lod.nTriangleCount - nTrianglesVisible;
+			frameStats.dShadingTime += SecondsSince(tpStage);
+		}
 
-					//Since we are calculating the dot product of 2 normalized vectors dot product will be between -1 and 1. We have to normalize that before feeding it into the ClassifyPixel() function to determine the color of the pixel
-					float dot_product_of_the_triangle_normal_and_light_direction = Math::Vec3DotProduct(normal, directional_light_direction);
+		//Finaly Rasterize the triangles
+		//Forward shading writes the colors of the triangles to the screen. Deferred shading writes their indices to the visibility buffer
+		tpStage = std::chrono::high_resolution_clock::now();
+		uint32_t* pTargetBuffer = bDeferredShading ? vecVisibilityBuffer.data() : (uint32_t*)GetDrawTarget()->GetData();
+		if (rasterizer == Rasterizer::HalfSpace) {
+			//The rasterizer only lights the pixels itself in forward smooth shading. Otherwise it writes the color or the index it is given, like for flat shading
+			switch (bDeferredShading ? ShadingMode::Flat : shadingMode) {
+			case ShadingMode::Flat: RasterizeTrianglesInTiles<ShadingMode::Flat>(pfDepthBuffer, pTargetBuffer, directional_light_direction); break;
+			case ShadingMode::Gouraud: RasterizeTrianglesInTiles<ShadingMode::Gouraud>(pfDepthBuffer, pTargetBuffer, directional_light_direction); break;
+			case ShadingMode::Phong: RasterizeTrianglesInTiles<ShadingMode::Phong>(pfDepthBuffer, pTargetBuffer, directional_light_direction); break;
+			}
+		}
+		else {
+			for (std::size_t i = 0; i < vecTrianglesToRaster.size(); i++) {
+				const ScreenTriangle& triangle = vecTrianglesToRaster[i];
+				RasterizeTriangle(triangle.p0, triangle.p1, triangle.p2, pfDepthBuffer, pTargetBuffer, bDeferredShading ? (uint32_t)i : triangle.color.n);
+			}
+		}
+		frameStats.nTrianglesRasterized = vecTrianglesToRaster.size();
+		frameStats.dRasterTime = SecondsSince(tpStage);
+
+		//Light the visible pixels
+		tpStage = std::chrono::high_resolution_clock::now();
+		if (bDeferredShading) {
+			switch (shadingMode) {
+			case ShadingMode::Flat:
+				if (bTexturing) ResolveVisibilityBuffer<ShadingMode::Flat, true>(directional_light_direction, pfDepthBuffer);
+				else ResolveVisibilityBuffer<ShadingMode::Flat, false>(directional_light_direction, pfDepthBuffer);
+				break;
+			case ShadingMode::Gouraud:
+				if (bTexturing) ResolveVisibilityBuffer<ShadingMode::Gouraud, true>(directional_light_direction, pfDepthBuffer);
+				else ResolveVisibilityBuffer<ShadingMode::Gouraud, false>(directional_light_direction, pfDepthBuffer);
+				break;
+			case ShadingMode::Phong:
+				if (bTexturing) ResolveVisibilityBuffer<ShadingMode::Phong, true>(directional_light_direction, pfDepthBuffer);
+				else ResolveVisibilityBuffer<ShadingMode::Phong, false>(directional_light_direction, pfDepthBuffer);
+				break;
+			}
+		}
+		else frameStats.nPixelsShaded = frameStats.nPixelsWritten;
+		frameStats.dResolveTime = SecondsSince(tpStage);
 
-					//Normalize the dot_product_of_the_triangle_normal_and_light_direction
-					dot_product_of_the_triangle_normal_and_light_direction = dot_product_of_the_triangle_normal_and_light_direction * 0.5f + 0.5f;
+		frameStats.dFrameTime = SecondsSince(tpFrame);
+		return true;
+	}
 
+	bool OnUserDestroy() override {
+		//Delete the float array we created.
+		if (pfDepthBuffer) delete[] pfDepthBuffer;
+		//Stop the worker threads
+		threadPool.reset();
+		return true;
+	}
 
+private:
+	//Write the sprite to a binary .ppm file. This format doesn't need any image library so it works everywhere
+	static bool SaveSpriteAsPPM(olc::Sprite* sprite, const std::string& filename) {
+		std::ofstream file(filename, std::ios::binary);
+		if (!file.is_open()) {
+			return false;
+		}
 
-					float pixel_grayscaled_color = dot_product_of_the_triangle_normal_and_light_direction * 255.0f;
+		file << "P6\n" << sprite->width << " " << sprite->height << "\n255\n";
+		std::vector<uint8_t> row(sprite->width * 3);
+		for (int y = 0; y < sprite->height; y++) {
+			const olc::Pixel* pixels = sprite->GetData() + y * sprite->width;
+			for (int x = 0; x < sprite->width; x++) {
+				row[x * 3 + 0] = pixels[x].r;
+				row[x * 3 + 1] = pixels[x].g;
+				row[x * 3 + 2] = pixels[x].b;
+			}
+			file.write((const char*)row.data(), row.size());
+		}
 
-					//Clamp the pixel_grayscaled_color So it won't go out of boundary
-					if (pixel_grayscaled_color < 0.0f) pixel_grayscaled_color = 0.0f;
-					else if(pixel_grayscaled_color > 255.0f) pixel_grayscaled_color = 255.0f;
-					
-					olc::Pixel pixel((int)pixel_grayscaled_color, (int)pixel_grayscaled_color, (int)pixel_grayscaled_color);
+		return true;
+	}
 
-					// Only draw the triangle if the dot product of the vertex_of_the_triangle_rel_to_mainCamera vector and normal_relative_to_mainCamera vector is equal or less than zero. \
-					//This is for backface culling. If you want to know about why we do this. Google "How does backface culling work in computer graphics) 
+	//Clear the screen buffer to the color and the depth buffer and the hierarchical depth buffer to 0. Every thread clears a band of rows
+	void ClearBuffers(olc::Pixel color, float* _pfDepthBuffer) {
+		const int nScreenWidth = ScreenWidth();
+		const int nScreenHeight = ScreenHeight();
+		olc::Pixel* pColorBuffer = GetDrawTarget()->GetData();
+
+		const int nBands = (nScreenHeight + nTileSize - 1) / nTileSize;
+		threadPool->ParallelFor(nBands, [&](int nBand, unsigned int) {
+			const int nFirstRow = nBand * nTileSize;
+			const int nLastRow = std::min(nFirstRow + nTileSize, nScreenHeight);
+			std::fill(pColorBuffer + nFirstRow * nScreenWidth, pColorBuffer + nLastRow * nScreenWidth, color);
+			memset(_pfDepthBuffer + nFirstRow * nScreenWidth, 0, sizeof(float) * (nLastRow - nFirstRow) * nScreenWidth);
+			//A band is a whole number of block rows (nTileSize is a multiple of nHiZBlockSize)
+			std::fill(vecHiZBlocks.begin() + nFirstRow / nHiZBlockSize * nHiZBlocksX,
+				vecHiZBlocks.begin() + (nLastRow + nHiZBlockSize - 1) / nHiZBlockSize * nHiZBlocksX, HiZBlock());
+		});
+	}
 
-					// TODO : Right now Getting the dot product of the vertex_of_the_triangle_rel_to_mainCamera and normal_relative_to_mainCamera to determine to cull a face or not doesn't work very well. 
-					//So I have skipped the backface culling part for now. I may fix it later. Right now back face culling doesn't make any visual difernce because we already have implemented the depth buffer. 
-					//It certenly gives a perfomance improvement so I will fix it. Until then no backface culling!
+	//Rasterize vecTrianglesToRaster with the half-space rasterizer on all the threads
+	//First every triangle is put into the bins of the screen tiles its bounding box touches. Then the tiles are handed out to the threads.
+	//A tile is only ever rasterized by one thread. So no two threads can touch the same pixel and the depth test needs no locks
+	//Triangles stay in submission order inside a tile, so the result is the same no matter how many threads there are
+	//pTargetBuffer is the color buffer in forward shading and the visibility buffer in deferred shading. shadingMode is the one the rasterizer lights the pixels with (See RasterizeTriangleHalfSpace())
+	template <ShadingMode shadingMode>
+	void RasterizeTrianglesInTiles(float* _pfDepthBuffer, uint32_t* pTargetBuffer, const Math::Vector3& directional_light_direction) {
+		const int nScreenWidth = ScreenWidth();
+		const int nScreenHeight = ScreenHeight();
+		const int nTilesX = (nScreenWidth + nTileSize - 1) / nTileSize;
+		const int nTilesY = (nScreenHeight + nTileSize - 1) / nTileSize;
+
+		//Binning
+		vecTileBins.resize(nTilesX * nTilesY);
+		for (std::vector<uint32_t>& bin : vecTileBins) bin.clear();
+
+		for (std::size_t i = 0; i < vecTrianglesToRaster.size(); i++) {
+			const ScreenTriangle& triangle = vecTrianglesToRaster[i];
+			const float fMinX = std::min({ triangle.p0.x, triangle.p1.x, triangle.p2.x });
+			const float fMaxX = std::max({ triangle.p0.x, triangle.p1.x, triangle.p2.x });
+			const float fMinY = std::min({ triangle.p0.y, triangle.p1.y, triangle.p2.y });
+			const float fMaxY = std::max({ triangle.p0.y, triangle.p1.y, triangle.p2.y });
+			if (fMaxX < 0.0f || fMaxY < 0.0f || fMinX >= (float)nScreenWidth || fMinY >= (float)nScreenHeight) continue;
+
+			const int nFirstTileX = (int)std::max(0.0f, fMinX) / nTileSize;
+			const int nFirstTileY = (int)std::max(0.0f, fMinY) / nTileSize;
+			const int nLastTileX = (int)std::min((float)(nScreenWidth - 1), fMaxX) / nTileSize;
+			const int nLastTileY = (int)std::min((float)(nScreenHeight - 1), fMaxY) / nTileSize;
+			for (int ty = nFirstTileY; ty <= nLastTileY; ty++)
+				for (int tx = nFirstTileX; tx <= nLastTileX; tx++)
+					vecTileBins[tx + ty * nTilesX].push_back((uint32_t)i);
+		}
 
-					//if (Math::Vec3DotProduct(vertex_of_the_triangle_rel_to_mainCamera, normal_relative_to_mainCamera) <= 0.0f) {
-						//Finaly draw the driangle in wireframe mode using DrawTriangle() function
-						//DrawTriangle( Math::Vector2i((int)p0_in_screen_space.x, (int)p0_in_screen_space.y), Math::Vector2i((int)p1_in_screen_space.x, (int)p1_in_screen_space.y), Math::Vector2i((int)p2_in_screen_space.x, (int)p2_in_screen_space.y) );
+		//Rasterization
+		std::fill(vecThreadStats.begin(), vecThreadStats.end(), RenderStats());
+		threadPool->ParallelFor(nTilesX * nTilesY, [&](int nTile, unsigned int nThread) {
+			const int nTileMinX = (nTile % nTilesX) * nTileSize;
+			const int nTileMinY = (nTile / nTilesX) * nTileSize;
+			const int nTileMaxX = std::min(nTileMinX + nTileSize, nScreenWidth);
+			const int nTileMaxY = std::min(nTileMinY + nTileSize, nScreenHeight);
+
+			//The triangles of a meshlet come one after the other. When a new meshlet starts, test its bounds once
+			//If it is behind the hierarchical depth buffer everywhere in this tile, all of its triangles are skipped here
+			RenderStats tileStats;
+			uint32_t nCurrentCluster = UINT32_MAX;
+			bool bClusterOccluded = false;
+			for (uint32_t index : vecTileBins[nTile]) {
+				const ScreenTriangle& triangle = vecTrianglesToRaster[index];
+				if (bHiZCulling && triangle.nCluster != nCurrentCluster) {
+					nCurrentCluster = triangle.nCluster;
+					//The pixels whose centers can be inside the bounds, clamped to the tile
+					const ScreenCluster& cluster = vecClustersToRaster[nCurrentCluster];
+					const int nMinX = std::max((int)std::floor(cluster.fMinX), nTileMinX), nMaxX = std::min((int)std::floor(cluster.fMaxX) + 1, nTileMaxX);
+					const int nMinY = std::max((int)std::floor(cluster.fMinY), nTileMinY), nMaxY = std::min((int)std::floor(cluster.fMaxY) + 1, nTileMaxY);
+					bClusterOccluded = nMinX < nMaxX && nMinY < nMaxY && IsOccludedHiZ(nMinX, nMinY, nMaxX, nMaxY, cluster.fNearestDepth, _pfDepthBuffer);
+					if (bClusterOccluded) tileStats.nClustersOccluded++;
+				}
+				if (bClusterOccluded) continue;
 
-						//Finaly Rasterize the triangle
-					RasterizeTriangle(
-						Math::Vector3(p0_in_screen_space.x, p0_in_screen_space.y, 1.0f / p0_in_screen_space.z),
-						Math::Vector3(p1_in_screen_space.x, p1_in_screen_space.y, 1.0f / p1_in_screen_space.z),
-						Math::Vector3(p2_in_screen_space.x, p2_in_screen_space.y, 1.0f / p2_in_screen_space.z),
-						pfDepthBuffer,
-						pixel
-					);
-					//}
+				//The visibility buffer only takes the index, the resolve samples the textures
+				if (triangle.pTexture && !bDeferredShading) {
+					tileStats.nPixelsWritten += RasterizeTriangleHalfSpace<shadingMode, true>(triangle.p0, triangle.p1, triangle.p2, _pfDepthBuffer, pTargetBuffer, triangle.color.n,
+						&vecTriangleAttributes[index], triangle.pTexture, directional_light_direction,
+						nTileMinX, nTileMinY, nTileMaxX, nTileMaxY, tileStats.nHiZBlocksCulled);
 				}
+				else {
+					tileStats.nPixelsWritten += RasterizeTriangleHalfSpace<shadingMode, false>(triangle.p0, triangle.p1, triangle.p2, _pfDepthBuffer, pTargetBuffer, bDeferredShading ? index : triangle.color.n,
+						shadingMode == ShadingMode::Flat ? nullptr : &vecTriangleAttributes[index], nullptr, directional_light_direction,
+						nTileMinX, nTileMinY, nTileMaxX, nTileMaxY, tileStats.nHiZBlocksCulled);
+				}
+			}
+			vecThreadStats[nThread] += tileStats;
+		});
+
+		for (const RenderStats& threadStats : vecThreadStats) frameStats += threadStats;
+	}
+
+	//Deferred shading. Light every pixel that was drawn this frame with the triangle the visibility buffer holds for it. Every thread lights a band of rows
+	//The pixels next to each other mostly show the same triangle, so its color is only worked out again when the triangle changes
+	//The planes of the attributes take longer to set up. A band keeps the ones of the last triangles it saw, the next rows mostly cut through the same triangles again
+	//They are set up from the corners snapped the same way the rasterizer snaps them, so both interpolate the same values
+	//bTextures: some of the triangles have a texture. Their texture coordinates are interpolated the same way and the mip level is picked per 2 x 2 pixel quad like the rasterizer does
+	template <ShadingMode shadingMode, bool bTextures>
+	void ResolveVisibilityBuffer(const Math::Vector3& directional_light_direction, const float* _pfDepthBuffer) {
+		const int nScreenWidth = ScreenWidth();
+		const int nScreenHeight = ScreenHeight();
+		olc::Pixel* pColorBuffer = GetDrawTarget()->GetData();
+
+		std::fill(vecThreadStats.begin(), vecThreadStats.end(), RenderStats());
+		const int nBands = (nScreenHeight + nTileSize - 1) / nTileSize;
+		threadPool->ParallelFor(nBands, [&](int nBand, unsigned int nThread) {
+			const int nFirstRow = nBand * nTileSize;
+			const int nLastRow = std::min(nFirstRow + nTileSize, nScreenHeight);
+			uint64_t nPixelsShaded = 0;
+			const int nLightAttributes = shadingMode == ShadingMode::Phong ? 3 : shadingMode == ShadingMode::Gouraud ? 1 : 0;
+			//The planes of the lighting attributes, then U = u * z, V = v * z and z for the textured triangles
+			struct CachedPlanes {
+				uint32_t nTriangle = UINT32_MAX;
+				ScreenPlane attributePlanes[3];
+				ScreenPlane texCoordPlanes[2];
+				ScreenPlane depthPlane;
+			};
+			CachedPlanes cache[shadingMode == ShadingMode::Flat && !bTextures ? 1 : nResolveCacheSize];
+			const CachedPlanes* pPlanes = nullptr;
+			for (int y = nFirstRow; y < nLastRow; y++) {
+				const float* pDepth = _pfDepthBuffer + y * nScreenWidth;
+				const uint32_t* pVisibility = vecVisibilityBuffer.data() + y * nScreenWidth;
+				olc::Pixel* pColor = pColorBuffer + y * nScreenWidth;
+				uint32_t nLastTriangle = UINT32_MAX;
+				olc::Pixel color;
+				float fFlatGray = 0.0f;
+				const Texture* pTexture = nullptr;
+				int nLevel = 0, nLevelQuadX = -1;
+				for (int x = 0; x < nScreenWidth; x++) {
+					if (pDepth[x] == 0.0f) continue; // nothing was drawn here, the pixel keeps the clear color
+					if (pVisibility[x] != nLastTriangle) {
+						nLastTriangle = pVisibility[x];
+						const ScreenTriangle& triangle = vecTrianglesToRaster[nLastTriangle];
+						pTexture = bTextures ? triangle.pTexture : nullptr;
+						nLevelQuadX = -1;
+						if (shadingMode == ShadingMode::Flat) {
+							color = ShadeFlat(triangle.normal, directional_light_direction);
+							fFlatGray = (float)color.r; // the rasterizer gets the gray level from the flat color too
+						}
+						CachedPlanes& cached = cache[nLastTriangle % (sizeof(cache) / sizeof(cache[0]))];
+						pPlanes = &cached;
+						if ((shadingMode != ShadingMode::Flat || pTexture) && cached.nTriangle != nLastTriangle) {
+							cached.nTriangle = nLastTriangle;
+							//The rasterizer moves the pixel centers onto the integer grid and the corners onto a grid of 1/16 pixel (See RasterizeTriangleHalfSpace())
+							const ScreenTriangleAttributes& attributes = vecTriangleAttributes[nLastTriangle];
+							const Math::Vector3 p0((float)std::lround((triangle.p0.x - 0.5f) * 16.0f) / 16.0f, (float)std::lround((triangle.p0.y - 0.5f) * 16.0f) / 16.0f, triangle.p0.z);
+							const Math::Vector3 p1((float)std::lround((triangle.p1.x - 0.5f) * 16.0f) / 16.0f, (float)std::lround((triangle.p1.y - 0.5f) * 16.0f) / 16.0f, triangle.p1.z);
+							const Math::Vector3 p2((float)std::lround((triangle.p2.x - 0.5f) * 16.0f) / 16.0f, (float)std::lround((triangle.p2.y - 0.5f) * 16.0f) / 16.0f, triangle.p2.z);
+							for (int a = 0; a < nLightAttributes; a++) {
+								cached.attributePlanes[a] = ScreenPlane(p0, p1, p2, attributes.fAttributes[0][a] * p0.z, attributes.fAttributes[1][a] * p1.z, attributes.fAttributes[2][a] * p2.z);
+							}
+							if (pTexture) {
+								//In texels, like the rasterizer does it
+								for (int a = 0; a < 2; a++) {
+									const float fTexels = (float)(a == 0 ? pTexture->Width() : pTexture->Height());
+									cached.texCoordPlanes[a] = ScreenPlane(p0, p1, p2, attributes.fTexCoords[0][a] * fTexels * p0.z, attributes.fTexCoords[1][a] * fTexels * p1.z, attributes.fTexCoords[2][a] * fTexels * p2.z);
+								}
+								cached.depthPlane = ScreenPlane(p0, p1, p2, p0.z, p1.z, p2.z);
+							}
+						}
+					}
+					if (shadingMode != ShadingMode::Flat || pTexture) {
+						float fAttributes[3];
+						for (int a = 0; a < nLightAttributes; a++) fAttributes[a] = pPlanes->attributePlanes[a].At((float)x, (float)y);
+						if (pTexture) {
+							//The mip level of the quad, from the planes at its center
+							if ((x >> 1) != nLevelQuadX) {
+								nLevelQuadX = x >> 1;
+								const float fCenterX = (float)(x & ~1) + 0.5f, fCenterY = (float)(y & ~1) + 0.5f;
+								const ScreenPlane& uPlane = pPlanes->texCoordPlanes[0];
+								const ScreenPlane& vPlane = pPlanes->texCoordPlanes[1];
+								const ScreenPlane& zPlane = pPlanes->depthPlane;
+								nLevel = pTexture->SelectLevelPerspective(uPlane.At(fCenterX, fCenterY), vPlane.At(fCenterX, fCenterY), zPlane.At(fCenterX, fCenterY),
+									uPlane.fDx, vPlane.fDx, uPlane.fDy, vPlane.fDy, zPlane.fDx, zPlane.fDy);
+							}
+							const float fInvZ = 1.0f / pDepth[x];
+							const uint32_t nTexel = pTexture->Sample(pPlanes->texCoordPlanes[0].At((float)x, (float)y) * fInvZ, pPlanes->texCoordPlanes[1].At((float)x, (float)y) * fInvZ, nLevel);
+							const float fGray = shadingMode == ShadingMode::Flat ? fFlatGray : SmoothGrayLevel<shadingMode>(fAttributes, pDepth[x], directional_light_direction);
+							color.n = Texture::ModulateColor(nTexel, fGray);
+						}
+						else color.n = ShadeSmoothPixel<shadingMode>(fAttributes, pDepth[x], directional_light_direction);
+					}
+					pColor[x] = color;
+					nPixelsShaded++;
+				}
+			}
+			vecThreadStats[nThread].nPixelsShaded += nPixelsShaded;
+		});
+
+		for (const RenderStats& threadStats : vecThreadStats) frameStats.nPixelsShaded += threadStats.nPixelsShaded;
+	}
+
+	//Draw the occluders of the objects that are big enough on the screen into the occlusion buffer
+	//Triangles that would need clipping are left out, and so are the faces the mesh culls. Leaving out an occluder only ever hides less
+	void RenderOccluders(const Math::Mat4x4& ViewProjectionMatrix, const Math::Frustum& frustum) {
+		occlusionBuffer.Clear();
+		const float fScreenWidth = (float)ScreenWidth();
+		const float fScreenHeight = (float)ScreenHeight();
+
+		for (std::pair<const int, Mesh>& GameObject : GameObjects) {
+			Mesh& mesh = GameObject.second;
+			if (!mesh.bOccluder || mesh.occluderVertices.empty()) continue;
+			mesh.UpdateTransformCache();
+			if (!Math::FrustumIntersectsSphere(frustum, mesh.worldBoundingSphere)) continue;
+
+			//Small objects on the screen hide little. The camera can be inside the sphere too, then the object is all around it
+			Math::Vector3 toObject = mesh.worldBoundingSphere.center - mainCamera.transform.position;
+			const float fDistance = toObject.Magnitude();
+			if (fDistance > mesh.worldBoundingSphere.fRadius && mesh.worldBoundingSphere.fRadius < fMinOccluderSize * fDistance) continue;
+
+			const Math::Mat4x4 ModelViewProjectionMatrix = mesh.ModelMatrix * ViewProjectionMatrix;
+			for (std::size_t i = 0; i + 2 < mesh.occluderVertices.size(); i += 3) {
+				const Math::Vector4 p0 = Math::Vec3TransformToClip(mesh.occluderVertices[i], ModelViewProjectionMatrix);
+				const Math::Vector4 p1 = Math::Vec3TransformToClip(mesh.occluderVertices[i + 1], ModelViewProjectionMatrix);
+				const Math::Vector4 p2 = Math::Vec3TransformToClip(mesh.occluderVertices[i + 2], ModelViewProjectionMatrix);
+				if (!Math::IsInsideGuardBand(p0) || !Math::IsInsideGuardBand(p1) || !Math::IsInsideGuardBand(p2)) continue;
+
+				const Math::Vector4 s0 = Math::ClipToScreen(p0, fScreenWidth, fScreenHeight);
+				const Math::Vector4 s1 = Math::ClipToScreen(p1, fScreenWidth, fScreenHeight);
+				const Math::Vector4 s2 = Math::ClipToScreen(p2, fScreenWidth, fScreenHeight);
+				const float fSignedArea = (s1.x - s0.x) * (s2.y - s0.y) - (s2.x - s0.x) * (s1.y - s0.y);
+				if (mesh.cullMode == CullMode::Back ? fSignedArea <= 0.0f : mesh.cullMode == CullMode::Front ? fSignedArea >= 0.0f : false) continue;
+
+				occlusionBuffer.RasterizeTriangle(Math::Vector3(s0.x, s0.y, s0.w), Math::Vector3(s1.x, s1.y, s1.w), Math::Vector3(s2.x, s2.y, s2.w));
 			}
 		}
+	}
 
-		return true;
+	//The level of detail to draw mesh with. The coarsest one whose estimated mean error is at most fLODThreshold pixels on the screen
+	//The error is measured where the bounding sphere comes the closest to the camera. camera is in the object space of the mesh
+	//MeshLOD::fError is a mean error estimate, not a bound, so small parts of the mesh can be off by a bit more than fLODThreshold pixels
+	//A unit at distance d is ProjectionMatrix[0][0] * ScreenWidth() / 2 / d pixels wide
+	const MeshLOD& SelectLOD(const Mesh& mesh, const Math::Vector3& camera) {
+		if (fLODThreshold <= 0.0f || mesh.lods.size() < 2) return mesh.lods[0];
+		Math::Vector3 toCenter = mesh.boundingSphere.center - camera;
+		const float fDistance = std::max(toCenter.Magnitude() - mesh.boundingSphere.fRadius, 0.05f); // not closer than the near plane
+		const float fMaxError = fLODThreshold * fDistance / (ProjectionMatrix[0][0] * (float)ScreenWidth() * 0.5f);
+		for (std::size_t i = mesh.lods.size() - 1; i > 0; i--) {
+			if (mesh.lods[i].fError <= fMaxError) return mesh.lods[i];
+		}
+		return mesh.lods[0];
 	}
 
-	bool OnUserDestroy() override {
-		//Delete the float array we created.
-		if (pfDepthBuffer) delete[] pfDepthBuffer;
+	//True if the box (in the space the matrix transforms from) is hidden behind the occluders
+	//The nearest point of a box is one of its corners and its projection is inside the rectangle around the projected corners
+	//A box that reaches in front of the near plane is never hidden
+	bool IsBoxOccluded(const Math::AABB& box, const Math::Mat4x4& ModelViewProjectionMatrix) const {
+		const float fScreenWidth = (float)ScreenWidth();
+		const float fScreenHeight = (float)ScreenHeight();
+		float fMinX = FLT_MAX, fMinY = FLT_MAX, fMaxX = -FLT_MAX, fMaxY = -FLT_MAX, fNearestDepth = 0.0f;
+		for (int nCorner = 0; nCorner < 8; nCorner++) {
+			const Math::Vector3 corner(nCorner & 1 ? box.max.x : box.min.x, nCorner & 2 ? box.max.y : box.min.y, nCorner & 4 ? box.max.z : box.min.z);
+			const Math::Vector4 clip = Math::Vec3TransformToClip(corner, ModelViewProjectionMatrix);
+			if (clip.z < 0.0f || clip.w <= 0.0f) return false;
+			const Math::Vector4 screen = Math::ClipToScreen(clip, fScreenWidth, fScreenHeight);
+			fMinX = std::min(fMinX, screen.x); fMaxX = std::max(fMaxX, screen.x);
+			fMinY = std::min(fMinY, screen.y); fMaxY = std::max(fMaxY, screen.y);
+			fNearestDepth = std::max(fNearestDepth, screen.w);
+		}
+		return occlusionBuffer.IsRectOccluded(fMinX, fMinY, fMaxX, fMaxY, fNearestDepth);
+	}
+
+	//True if nothing at fNearestDepth or farther away can pass the depth test in the block
+	//The farthest depth of a block is only looked for again if pixels were drawn to it since the last time. A value that is out of date is smaller than the real one, so it can only cull less, never more
+	//While the block still has empty pixels its farthest depth is 0. We remember one of them, so most of the time a single look at that pixel tells us nothing changed
+	bool IsBlockOccluded(int nBlockX, int nBlockY, float fNearestDepth, const float* _pfDepthBuffer) {
+		HiZBlock& block = vecHiZBlocks[nBlockX + nBlockY * nHiZBlocksX];
+		if (fNearestDepth <= block.fFarthestDepth) return true;
+		if (!block.bDirty) return false;
+
+		const int nScreenWidth = ScreenWidth();
+		if (block.nHoleX >= 0 && _pfDepthBuffer[block.nHoleX + block.nHoleY * nScreenWidth] == 0.0f) return false;
+
+		const int nFirstX = nBlockX * nHiZBlockSize, nLastX = std::min(nFirstX + nHiZBlockSize, nScreenWidth);
+		const int nFirstY = nBlockY * nHiZBlockSize, nLastY = std::min(nFirstY + nHiZBlockSize, ScreenHeight());
+		float fFarthest = FLT_MAX;
+		for (int y = nFirstY; y < nLastY; y++) {
+			const float* pDepth = _pfDepthBuffer + y * nScreenWidth;
+			for (int x = nFirstX; x < nLastX; x++) {
+				if (pDepth[x] == 0.0f) {
+					block.nHoleX = x;
+					block.nHoleY = y;
+					return false;
+				}
+				fFarthest = std::min(fFarthest, pDepth[x]);
+			}
+		}
+		block.fFarthestDepth = fFarthest;
+		block.bDirty = false;
+		return fNearestDepth <= fFarthest;
+	}
+
+	//True if every block the pixel rectangle [nMinX, nMaxX) x [nMinY, nMaxY) touches is occluded for fNearestDepth (See IsBlockOccluded())
+	bool IsOccludedHiZ(int nMinX, int nMinY, int nMaxX, int nMaxY, float fNearestDepth, const float* _pfDepthBuffer) {
+		for (int nBlockY = nMinY / nHiZBlockSize; nBlockY <= (nMaxY - 1) / nHiZBlockSize; nBlockY++) {
+			for (int nBlockX = nMinX / nHiZBlockSize; nBlockX <= (nMaxX - 1) / nHiZBlockSize; nBlockX++) {
+				if (!IsBlockOccluded(nBlockX, nBlockY, fNearestDepth, _pfDepthBuffer)) return false;
+			}
+		}
 		return true;
 	}
 
-private:
-	//Clear DepthBuffer
-	void ClearDepthBuffer(float* _pfDepthBuffer) {
-		memset(_pfDepthBuffer, 0, sizeof(float) * ScreenWidth() * ScreenHeight());
+	//Rasterize the triangle using edge functions (half-space rasterization)
+	//The vertices are snapped to a 28.4 fixed point grid (1/16 of a pixel) and a pixel is drawn if its center is inside all three edges.
+	//Pixels exactly on an edge follow the top-left fill rule. So two triangles that share an edge never draw the same pixel twice and never leave a crack between them
+	//The depth is a plane over the triangle. So we get the depth of the next pixel by adding a constant instead of dividing
+	//Big triangles are walked in blocks of the hierarchical depth buffer. A block is skipped without looking at its pixels if it is outside one of the edges,
+	//or if the triangle is farther away than the block everywhere in it (that's counted in nHiZBlocksCulled)
+	//Only the pixels inside the rectangle [nClipMinX, nClipMaxX) x [nClipMinY, nClipMaxY) are touched. Returns the number of pixels that passed the depth test
+	//Flat: nValue is written to pTargetBuffer for every pixel that passes. That's the color of the triangle, or its index for the visibility buffer
+	//Gouraud and Phong: the corner attributes are interpolated with perspective correction and every pixel that passes gets its own color (See ShadeSmoothPixel())
+	//Like the depth, an attribute times the depth is a plane over the screen, so the next pixel is one add away. That keeps smooth shading cheap
+	//bTextured: the texture coordinates are interpolated the same way and the texel is multiplied by the light (nValue is the flat gray color then)
+	//The mip level is picked once for every 2 x 2 pixel quad, from the steps of the texture coordinates at the center of the quad (See Texture::SelectLevelPerspective())
+	template <ShadingMode shadingMode, bool bTextured>
+	uint64_t RasterizeTriangleHalfSpace(const Math::Vector3& p0,
+		const Math::Vector3& p1, const Math::Vector3& p2,
+		float* _pfDepthBuffer,
+		uint32_t* pTargetBuffer, uint32_t nValue,
+		const ScreenTriangleAttributes* pAttributes, const Texture* pTexture, const Math::Vector3& directional_light_direction,
+		int nClipMinX, int nClipMinY, int nClipMaxX, int nClipMaxY,
+		uint64_t& nHiZBlocksCulled) {
+
+		//The vertices are inside the guard band (See Math::fGuardBand), so they are at most a few screens away and the fixed point math can't overflow
+		//28.4 fixed point coordinates. We subtract half a pixel so the pixel centers land on the integer grid
+		int64_t x0 = (int64_t)std::lround((p0.x - 0.5f) * 16.0f), y0 = (int64_t)std::lround((p0.y - 0.5f) * 16.0f);
+		int64_t x1 = (int64_t)std::lround((p1.x - 0.5f) * 16.0f), y1 = (int64_t)std::lround((p1.y - 0.5f) * 16.0f);
+		int64_t x2 = (int64_t)std::lround((p2.x - 0.5f) * 16.0f), y2 = (int64_t)std::lround((p2.y - 0.5f) * 16.0f);
+		float z0 = p0.z, z1 = p1.z, z2 = p2.z;
+
+		//The attributes times the depth at the corners. The lighting attributes come first, then the texture coordinates
+		const int nLightAttributes = shadingMode == ShadingMode::Phong ? 3 : shadingMode == ShadingMode::Gouraud ? 1 : 0;
+		const int nAttributes = nLightAttributes + (bTextured ? 2 : 0);
+		float a0[5], a1[5], a2[5];
+		for (int a = 0; a < nLightAttributes; a++) {
+			a0[a] = pAttributes->fAttributes[0][a] * z0;
+			a1[a] = pAttributes->fAttributes[1][a] * z1;
+			a2[a] = pAttributes->fAttributes[2][a] * z2;
+		}
+		//The texture coordinates in texels (See Texture::Sample())
+		for (int a = nLightAttributes; a < nAttributes; a++) {
+			const float fTexels = (float)(a == nLightAttributes ? pTexture->Width() : pTexture->Height());
+			a0[a] = pAttributes->fTexCoords[0][a - nLightAttributes] * fTexels * z0;
+			a1[a] = pAttributes->fTexCoords[1][a - nLightAttributes] * fTexels * z1;
+			a2[a] = pAttributes->fTexCoords[2][a - nLightAttributes] * fTexels * z2;
+		}
+		const float fFlatGray = (float)(nValue & 0xff);
+
+		//Twice the signed area of the triangle. Flip the winding if needed so the inside of every edge function is positive
+		const int64_t area = (x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0);
+		if (area == 0) return 0;
+		if (area > 0) {
+			std::swap(x1, x2); std::swap(y1, y2); std::swap(z1, z2);
+			for (int a = 0; a < nAttributes; a++) std::swap(a1[a], a2[a]);
+		}
+
+		//Bounding box of the triangle in pixels, clamped to the clip rectangle
+		const int nScreenWidth = ScreenWidth();
+		int nMinX = (int)((std::min({ x0, x1, x2 }) + 15) >> 4);
+		int nMaxX = (int)((std::max({ x0, x1, x2 }) + 15) >> 4);
+		int nMinY = (int)((std::min({ y0, y1, y2 }) + 15) >> 4);
+		int nMaxY = (int)((std::max({ y0, y1, y2 }) + 15) >> 4);
+		nMinX = std::max(nMinX, nClipMinX); nMaxX = std::min(nMaxX, nClipMaxX);
+		nMinY = std::max(nMinY, nClipMinY); nMaxY = std::min(nMaxY, nClipMaxY);
+		if (nMinX >= nMaxX || nMinY >= nMaxY) return 0;
+
+		//Steps of the edge functions. Edge a goes from p0 to p1, edge b goes from p1 to p2 and edge c goes from p2 to p0
+		const int64_t dxa = x0 - x1, dya = y0 - y1;
+		const int64_t dxb = x1 - x2, dyb = y1 - y2;
+		const int64_t dxc = x2 - x0, dyc = y2 - y0;
+
+		//Edge function constants. A pixel on a top or a left edge counts as inside, a pixel on any other edge counts as outside
+		int64_t ca = dya * x0 - dxa * y0;
+		int64_t cb = dyb * x1 - dxb * y1;
+		int64_t cc = dyc * x2 - dxc * y2;
+		if (dya < 0 || (dya == 0 && dxa > 0)) ca++;
+		if (dyb < 0 || (dyb == 0 && dxb > 0)) cb++;
+		if (dyc < 0 || (dyc == 0 && dxc > 0)) cc++;
+
+		//Depth plane of the triangle. dzdx and dzdy are the changes of depth per pixel
+		const float fx0 = (float)x0 / 16.0f, fy0 = (float)y0 / 16.0f;
+		const float fx1 = (float)x1 / 16.0f, fy1 = (float)y1 / 16.0f;
+		const float fx2 = (float)x2 / 16.0f, fy2 = (float)y2 / 16.0f;
+		const float fInvArea = 1.0f / ((fx1 - fx0) * (fy2 - fy0) - (fx2 - fx0) * (fy1 - fy0));
+		const float dzdx = ((z1 - z0) * (fy2 - fy0) - (z2 - z0) * (fy1 - fy0)) * fInvArea;
+		const float dzdy = ((z2 - z0) * (fx1 - fx0) - (z1 - z0) * (fx2 - fx0)) * fInvArea;
+		float dadx[5], dady[5];
+		for (int a = 0; a < nAttributes; a++) {
+			dadx[a] = ((a1[a] - a0[a]) * (fy2 - fy0) - (a2[a] - a0[a]) * (fy1 - fy0)) * fInvArea;
+			dady[a] = ((a2[a] - a0[a]) * (fx1 - fx0) - (a1[a] - a0[a]) * (fx2 - fx0)) * fInvArea;
+		}
+		//The depth inside the triangle is never bigger than the biggest depth of its corners
+		const float fNearestDepth = std::max({ z0, z1, z2 });
+
+		//Small triangles are tested against the hierarchical depth buffer as a whole and drawn as one rectangle. Walking them block by block costs more than it saves
+		//Big triangles are drawn one block (one rectangle) at a time
+		const bool bWalkBlocks = nMaxX - nMinX > 2 * nHiZBlockSize || nMaxY - nMinY > 2 * nHiZBlockSize;
+		if (!bWalkBlocks && bHiZCulling && IsOccludedHiZ(nMinX, nMinY, nMaxX, nMaxY, fNearestDepth, _pfDepthBuffer)) {
+			nHiZBlocksCulled += ((nMaxX - 1) / nHiZBlockSize - nMinX / nHiZBlockSize + 1) * ((nMaxY - 1) / nHiZBlockSize - nMinY / nHiZBlockSize + 1);
+			return 0;
+		}
+		const int nFirstRectX = bWalkBlocks ? nMinX / nHiZBlockSize * nHiZBlockSize : nMinX, nRectStepX = bWalkBlocks ? nHiZBlockSize : nMaxX - nMinX;
+		const int nFirstRectY = bWalkBlocks ? nMinY / nHiZBlockSize * nHiZBlockSize : nMinY, nRectStepY = bWalkBlocks ? nHiZBlockSize : nMaxY - nMinY;
+
+		uint64_t nPixelsWritten = 0;
+
+		for (int nRectY = nFirstRectY; nRectY < nMaxY; nRectY += nRectStepY) {
+			const int nRectMinY = std::max(nRectY, nMinY), nRectMaxY = std::min(nRectY + nRectStepY, nMaxY);
+			for (int nRectX = nFirstRectX; nRectX < nMaxX; nRectX += nRectStepX) {
+				const int nRectMinX = std::max(nRectX, nMinX), nRectMaxX = std::min(nRectX + nRectStepX, nMaxX);
+
+				//Values of the edge functions at the first pixel of the rectangle
+				int64_t eaRow = ca + dxa * ((int64_t)nRectMinY << 4) - dya * ((int64_t)nRectMinX << 4);
+				int64_t ebRow = cb + dxb * ((int64_t)nRectMinY << 4) - dyb * ((int64_t)nRectMinX << 4);
+				int64_t ecRow = cc + dxc * ((int64_t)nRectMinY << 4) - dyc * ((int64_t)nRectMinX << 4);
+				float zRow = z0 + ((float)nRectMinX - fx0) * dzdx + ((float)nRectMinY - fy0) * dzdy;
+				float aRow[5];
+				for (int a = 0; a < nAttributes; a++) aRow[a] = a0[a] + ((float)nRectMinX - fx0) * dadx[a] + ((float)nRectMinY - fy0) * dady[a];
+
+				if (bWalkBlocks) {
+					//The biggest value of an edge function in the block is at one of its corners. If that is not positive, no pixel of the block is inside the edge
+					const int64_t nSpanX = (int64_t)(nRectMaxX - 1 - nRectMinX) << 4, nSpanY = (int64_t)(nRectMaxY - 1 - nRectMinY) << 4;
+					if (eaRow + std::max<int64_t>(0, dxa * nSpanY) + std::max<int64_t>(0, -dya * nSpanX) < 1 ||
+						ebRow + std::max<int64_t>(0, dxb * nSpanY) + std::max<int64_t>(0, -dyb * nSpanX) < 1 ||
+						ecRow + std::max<int64_t>(0, dxc * nSpanY) + std::max<int64_t>(0, -dyc * nSpanX) < 1) {
+						continue;
+					}
+
+					//The biggest depth of the triangle in the block is at one of its corners too
+					if (bHiZCulling) {
+						const float fBlockNearestDepth = std::min(fNearestDepth,
+							zRow + std::max(0.0f, dzdx * (float)(nRectMaxX - 1 - nRectMinX)) + std::max(0.0f, dzdy * (float)(nRectMaxY - 1 - nRectMinY)));
+						if (IsBlockOccluded(nRectX / nHiZBlockSize, nRectY / nHiZBlockSize, fBlockNearestDepth, _pfDepthBuffer)) {
+							nHiZBlocksCulled++;
+							continue;
+						}
+					}
+				}
+
+				const uint64_t nPixelsWrittenBefore = nPixelsWritten;
+				for (int y = nRectMinY; y < nRectMaxY; y++) {
+					int64_t ea = eaRow, eb = ebRow, ec = ecRow;
+					float z = zRow;
+					float attribute[5];
+					for (int a = 0; a < nAttributes; a++) attribute[a] = aRow[a];
+					float* pDepth = _pfDepthBuffer + y * nScreenWidth;
+					uint32_t* pTarget = pTargetBuffer + y * nScreenWidth;
+					int nLevel = 0, nLevelQuadX = -1;
+
+					bool bInside = false;
+					for (int x = nRectMinX; x < nRectMaxX; x++) {
+						if (((ea - 1) | (eb - 1) | (ec - 1)) >= 0) { // all three are positive, so the pixel is inside the triangle
+							bInside = true;
+							if (z > pDepth[x]) {
+								if (bTextured) {
+									//The values at the center of the quad are a step of half a pixel or less away
+									if ((x >> 1) != nLevelQuadX) {
+										nLevelQuadX = x >> 1;
+										const float fToCenterX = (float)(x & ~1) + 0.5f - (float)x, fToCenterY = (float)(y & ~1) + 0.5f - (float)y;
+										nLevel = pTexture->SelectLevelPerspective(
+											attribute[nLightAttributes] + fToCenterX * dadx[nLightAttributes] + fToCenterY * dady[nLightAttributes],
+											attribute[nLightAttributes + 1] + fToCenterX * dadx[nLightAttributes + 1] + fToCenterY * dady[nLightAttributes + 1],
+											z + fToCenterX * dzdx + fToCenterY * dzdy,
+											dadx[nLightAttributes], dadx[nLightAttributes + 1], dady[nLightAttributes], dady[nLightAttributes + 1], dzdx, dzdy);
+									}
+									const float fInvZ = 1.0f / z;
+									const uint32_t nTexel = pTexture->Sample(attribute[nLightAttributes] * fInvZ, attribute[nLightAttributes + 1] * fInvZ, nLevel);
+									pTarget[x] = Texture::ModulateColor(nTexel, shadingMode == ShadingMode::Flat ? fFlatGray : SmoothGrayLevel<shadingMode>(attribute, z, directional_light_direction));
+								}
+								else pTarget[x] = shadingMode == ShadingMode::Flat ? nValue : ShadeSmoothPixel<shadingMode>(attribute, z, directional_light_direction);
+								pDepth[x] = z;
+								nPixelsWritten++;
+							}
+						}
+						else if (bInside) {
+							break; // A triangle is convex. Once we left it there is nothing more on this row
+						}
+						ea -= dya << 4; eb -= dyb << 4; ec -= dyc << 4;
+						z += dzdx;
+						for (int a = 0; a < nAttributes; a++) attribute[a] += dadx[a];
+					}
+
+					eaRow += dxa << 4; ebRow += dxb << 4; ecRow += dxc << 4;
+					zRow += dzdy;
+					for (int a = 0; a < nAttributes; a++) aRow[a] += dady[a];
+				}
+
+				//Pixels came nearer. The blocks of the rectangle have to find their farthest depth again (See IsBlockOccluded())
+				if (nPixelsWritten != nPixelsWrittenBefore) {
+					for (int nBlockY = nRectMinY / nHiZBlockSize; nBlockY <= (nRectMaxY - 1) / nHiZBlockSize; nBlockY++)
+						for (int nBlockX = nRectMinX / nHiZBlockSize; nBlockX <= (nRectMaxX - 1) / nHiZBlockSize; nBlockX++)
+							vecHiZBlocks[nBlockX + nBlockY * nHiZBlocksX].bDirty = true;
+				}
+			}
+		}
+
+		return nPixelsWritten;
 	}
 
-	//Rasterize the triangle 
+	//Rasterize the triangle (Scanline)
+	//nValue is written to pTargetBuffer for every pixel that passes the depth test (See RasterizeTriangleHalfSpace())
 	void RasterizeTriangle(Math::Vector3 p0,
 		Math::Vector3 p1, Math::Vector3 p2,
 		float* _pfDepthBuffer,
-		olc::Pixel p = olc::WHITE ) {
+		uint32_t* pTargetBuffer, uint32_t nValue) {
 
 		//Sort the points according to the y values of points
 		if (p0.y > p1.y) { std::swap(p0, p1); }
@@ -356,9 +2502,16 @@ private:
 		Math::Vector2i delta_xy_of_p0p2_line = xy_values_of_p2 - xy_values_of_p0; float delta_z_value_of_p0p2_line = z_value_of_p2 - z_value_of_p0;
 		Math::Vector2i delta_xy_of_p0p1_line = xy_values_of_p1 - xy_values_of_p0; float delta_z_value_of_p0p1_line = z_value_of_p1 - z_value_of_p0;
 
+		//The rows and the spans are clamped to the screen before the loops start. So the loops themselves never check if a pixel is on the screen
+		//The vertices are inside the guard band (See Math::fGuardBand), so the triangle is at most a few screens big and the integer math can't overflow
+		const int nScreenWidth = ScreenWidth();
+		const int nScreenHeight = ScreenHeight();
+
 		//Draw the first half of the triangle
 		if (delta_xy_of_p0p1_line.y) {
-			for (int _y = 0; _y < delta_xy_of_p0p1_line.y; _y++) {
+			const int nFirstRow = std::max(0, -xy_values_of_p0.y);
+			const int nLastRow = std::min(delta_xy_of_p0p1_line.y, nScreenHeight - xy_values_of_p0.y);
+			for (int _y = nFirstRow; _y < nLastRow; _y++) {
 				//Get the two x values of the two lines from the _y value
 
 				//Get the x value of p0p2 line (Relative to p0)
@@ -385,7 +2538,9 @@ private:
 					std::swap(z_value_of_the_current_point_on_p0p1_line, z_value_of_the_current_point_on_p0p2_line);
 				}
 
-				for (int _x = xy_values_of_current_point_on_p0p1_line.x; _x < xy_values_of_current_point_on_p0p2_line.x; _x++) {
+				const int nFirstColumn = std::max(xy_values_of_current_point_on_p0p1_line.x, -xy_values_of_p0.x);
+				const int nLastColumn = std::min(xy_values_of_current_point_on_p0p2_line.x, nScreenWidth - xy_values_of_p0.x);
+				for (int _x = nFirstColumn; _x < nLastColumn; _x++) {
 					// Z value of the current pixel relative to the p0
 					float z_value_of_the_current_pixel = (float)(_x - xy_values_of_current_point_on_p0p1_line.x) / (float)(xy_values_of_current_point_on_p0p2_line.x - xy_values_of_current_point_on_p0p1_line.x) * (z_value_of_the_current_point_on_p0p2_line - z_value_of_the_current_point_on_p0p1_line) + z_value_of_the_current_point_on_p0p1_line;
 
@@ -395,11 +2550,10 @@ private:
 					float z = z_value_of_the_current_pixel + z_value_of_p0;
 
 					//Finaly draw the pixel if the depth value of that pixel higher than the depth value already there
-					if (x >= 0 && x < ScreenWidth() && y >= 0 && y < ScreenHeight()) {
-						if (z > _pfDepthBuffer[x + y * ScreenWidth()]) {
-							Draw(x, y, p);
-							_pfDepthBuffer[x + y * ScreenWidth()] = z;
-						}
+					if (z > _pfDepthBuffer[x + y * nScreenWidth]) {
+						pTargetBuffer[x + y * nScreenWidth] = nValue;
+						_pfDepthBuffer[x + y * nScreenWidth] = z;
+						frameStats.nPixelsWritten++;
 					}
 
 				}
@@ -410,7 +2564,9 @@ private:
 
 		//Draw the next half of the triangle
 		if (delta_xy_of_p1p2_line.y) {
-			for (int _y = 0; _y <= delta_xy_of_p1p2_line.y; _y++) {
+			const int nFirstRow = std::max(0, -xy_values_of_p1.y);
+			const int nLastRow = std::min(delta_xy_of_p1p2_line.y, nScreenHeight - 1 - xy_values_of_p1.y);
+			for (int _y = nFirstRow; _y <= nLastRow; _y++) {
 				//Just like above
 				//Get the two x values of the two lines from the _y value
 
@@ -440,7 +2596,9 @@ private:
 				}
 
 
-				for (int _x = xy_values_of_current_point_on_p1p2_line.x; _x < xy_values_of_current_point_on_p0p2_line.x; _x++) {
+				const int nFirstColumn = std::max(xy_values_of_current_point_on_p1p2_line.x, -xy_values_of_p1.x);
+				const int nLastColumn = std::min(xy_values_of_current_point_on_p0p2_line.x, nScreenWidth - xy_values_of_p1.x);
+				for (int _x = nFirstColumn; _x < nLastColumn; _x++) {
 					// Z value of the current pixel relative to the p0
 					float z_value_of_the_current_pixel = (float)(_x - xy_values_of_current_point_on_p1p2_line.x) / (float)(xy_values_of_current_point_on_p0p2_line.x - xy_values_of_current_point_on_p1p2_line.x) * (z_value_of_the_current_point_on_p0p2_line - z_value_of_the_current_point_on_p1p2_line) + z_value_of_the_current_point_on_p1p2_line;
 
@@ -449,11 +2607,10 @@ private:
 					int y = _y + xy_values_of_p1.y;
 					float z = z_value_of_the_current_pixel + z_value_of_p1;
 
-					if (x >= 0 && x < ScreenWidth() && y >= 0 && y < ScreenHeight()) {
-						if (z > _pfDepthBuffer[x + y * ScreenWidth()]) {
-							Draw(x, y, p);
-							_pfDepthBuffer[x + y * ScreenWidth()] = z;
-						}
+					if (z > _pfDepthBuffer[x + y * nScreenWidth]) {
+						pTargetBuffer[x + y * nScreenWidth] = nValue;
+						_pfDepthBuffer[x + y * nScreenWidth] = z;
+						frameStats.nPixelsWritten++;
 					}
 
 				}
@@ -488,12 +2645,365 @@ private:
 	//Pointer to the depth buffer where we store the information about depth values of every pixel
 	float* pfDepthBuffer = nullptr;
 
+	//The rasterizer that draws the triangles
+	Rasterizer rasterizer = Rasterizer::HalfSpace;
+
+	//How the triangles are lit (See SetShadingMode())
+	ShadingMode shadingMode = ShadingMode::Flat;
+
+	//Draw the textures of the materials (See SetTextureMapping()). bSceneHasTextures is set in OnUserCreate() if any object has a material with a texture
+	bool bTextureMapping = true;
+	bool bSceneHasTextures = false;
+
+	//See SetMeshCache(), SetWeldEpsilon(), GetMeshLoadTime(), GetCachedMeshCount(), GetWeldStats() and GetVertexCacheStats()
+	bool bMeshCache = true;
+	float fWeldEpsilon = 0.0f;
+	double dMeshLoadTime = 0.0;
+	int nCachedMeshes = 0;
+	uint64_t nVerticesBeforeWeld = 0;
+	uint64_t nVerticesAfterWeld = 0;
+	VertexCacheStats vertexCacheStatsBefore;
+	VertexCacheStats vertexCacheStatsAfter;
+
+	//Worker threads that clear and rasterize the screen tiles
+	std::unique_ptr<ThreadPool> threadPool;
+	unsigned int nThreadCount = 0; // 0 means one thread per hardware thread
+	std::vector<RenderStats> vecThreadStats; // the rasterizer counters of every thread. They are added to frameStats after the tiles are done
+
+	//Backface culling settings (See SetCullMode() and SetObjectSpaceCulling())
+	CullMode defaultCullMode = CullMode::Back;
+	bool bObjectSpaceCulling = false;
+
+	//Skip the objects outside the view frustum (See SetFrustumCulling())
+	bool bFrustumCulling = true;
+
+	//Skip the meshlets that are outside the view frustum or face away (See SetClusterCulling())
+	bool bClusterCulling = true;
+
+	//Largest estimated mean error of a level of detail in pixels (See SetLODThreshold())
+	float fLODThreshold = 1.0f;
+
+	//Meshlets of the current object that survived the culling and the vertex ranges they need transformed. Kept around so the memory is reused
+	std::vector<uint32_t> vecVisibleMeshlets;
+	std::vector<std::pair<std::size_t, std::size_t>> vecTransformRanges;
+
+	//Instruction set the vertex transform kernel uses
+	Math::SimdLevel simdLevel = Math::GetSimdLevel();
+
+	//Number of vertices a thread transforms in one go. Small enough to spread a big mesh over all the threads, big enough to keep the overhead low
+	static const std::size_t nVerticesPerChunk = 4096;
+	static_assert(nVerticesPerChunk % Mesh::nVertexStreamPadding == 0, "A chunk must not split an AVX2 register");
+
+	//Size of a screen tile in pixels and the triangles that touch each tile (indices into vecTrianglesToRaster)
+	static const int nTileSize = 64;
+	std::vector<std::vector<uint32_t>> vecTileBins;
+
+	//Triangles of the current frame that are waiting to be rasterized and the bounds of their meshlets. We keep these around so the memory is reused every frame
+	std::vector<ScreenTriangle> vecTrianglesToRaster;
+	std::vector<ScreenTriangleAttributes> vecTriangleAttributes; // only filled for smooth shading
+	std::vector<ScreenCluster> vecClustersToRaster;
+
+	//Hierarchical depth buffer. The farthest depth value (the smallest 1 / w) of every nHiZBlockSize x nHiZBlockSize block of pfDepthBuffer
+	//Something at least that near has been drawn to every pixel of the block. So a triangle that is farther away than this value everywhere in the block can't pass the depth test there
+	struct HiZBlock {
+		float fFarthestDepth = 0.0f;
+		bool bDirty = false; // pixels were drawn since fFarthestDepth was found
+		int nHoleX = -1, nHoleY = -1; // a pixel of the block that was empty (depth 0) the last time we looked. -1 if we haven't looked yet
+	};
+	static const int nHiZBlockSize = 8;
+	static_assert(nTileSize % nHiZBlockSize == 0, "A block must not cross the border of a tile");
+	std::vector<HiZBlock> vecHiZBlocks;
+	int nHiZBlocksX = 0;
+	bool bHiZCulling = true; // See SetHiZCulling()
+
+	//The occluders of the current frame (See SetOcclusionCulling())
+	OcclusionBuffer occlusionBuffer;
+	bool bOcclusionCulling = false;
+
+	//An object is only drawn into the occlusion buffer if its bounding sphere is at least this big compared to its distance (about this part of the screen height)
+	static constexpr float fMinOccluderSize = 0.1f;
+
+	//Deferred shading (See SetDeferredShading()). The index into vecTrianglesToRaster of the triangle that is visible in every pixel
+	std::vector<uint32_t> vecVisibilityBuffer;
+	bool bDeferredShading = false;
+
+	//Number of triangles a band of the resolve keeps the attribute planes of (See ResolveVisibilityBuffer())
+	static const uint32_t nResolveCacheSize = 256;
+
+	//Counters and timings of the last frame
+	RenderStats frameStats;
+
+};
+
+//The options of the renderer that can be chosen on the command line
+struct RenderSettings {
+	Rasterizer rasterizer = Rasterizer::HalfSpace;
+	unsigned int nThreads = 0; // 0 means one thread per hardware thread
+	Math::SimdLevel simdLevel = Math::GetSimdLevel();
+	CullMode cullMode = CullMode::Back;
+	bool bObjectSpaceCulling = false;
+	bool bFrustumCulling = true;
+	bool bClusterCulling = true;
+	bool bHiZCulling = true;
+	bool bOcclusionCulling = false;
+	bool bDeferredShading = false;
+	ShadingMode shadingMode = ShadingMode::Flat;
+	bool bTextureMapping = true;
+	bool bMeshCache = true;
+	float fWeldEpsilon = 0.0f;
+	float fLODThreshold = 1.0f;
+};
+
+static const char* ShadingModeName(ShadingMode shadingMode) {
+	switch (shadingMode) {
+	case ShadingMode::Gouraud: return "gouraud";
+	case ShadingMode::Phong: return "phong";
+	default: return "flat";
+	}
+}
+
+static const char* CullModeName(CullMode cullMode) {
+	switch (cullMode) {
+	case CullMode::Back: return "back";
+	case CullMode::Front: return "front";
+	default: return "none";
+	}
+}
+
+//Pass the settings to the engine. Must be called before Start() or RunHeadless()
+static void ApplyRenderSettings(Pixel3DRenderingEngine& renderingEngine, const RenderSettings& settings) {
+	renderingEngine.SetRasterizer(settings.rasterizer);
+	renderingEngine.SetThreadCount(settings.nThreads);
+	renderingEngine.SetSimdLevel(settings.simdLevel);
+	renderingEngine.SetCullMode(settings.cullMode);
+	renderingEngine.SetObjectSpaceCulling(settings.bObjectSpaceCulling);
+	renderingEngine.SetFrustumCulling(settings.bFrustumCulling);
+	renderingEngine.SetClusterCulling(settings.bClusterCulling);
+	renderingEngine.SetHiZCulling(settings.bHiZCulling);
+	renderingEngine.SetOcclusionCulling(settings.bOcclusionCulling);
+	renderingEngine.SetDeferredShading(settings.bDeferredShading);
+	renderingEngine.SetShadingMode(settings.shadingMode);
+	renderingEngine.SetTextureMapping(settings.bTextureMapping);
+	renderingEngine.SetMeshCache(settings.bMeshCache);
+	renderingEngine.SetWeldEpsilon(settings.fWeldEpsilon);
+	renderingEngine.SetLODThreshold(settings.fLODThreshold);
+}
+
+//A scene of the benchmark suite
+struct BenchmarkScene {
+	std::string sName;
+	std::unordered_map<int, std::pair<std::string, Transform>> objFiles;
+	CameraPath cameraPath; // Every scene is rendered along a fixed camera path so the runs are comparable
 };
 
-int main() {
+//nCount x nCount copies of a model on a grid on the xz plane, fSpacing apart and centered on the origin
+static std::unordered_map<int, std::pair<std::string, Transform>> MakeObjectGrid(const std::string& sFilename, int nCount, float fSpacing) {
+	std::unordered_map<int, std::pair<std::string, Transform>> objFiles;
+	for (int z = 0; z < nCount; z++) {
+		for (int x = 0; x < nCount; x++) {
+			Transform transform;
+			transform.position = Math::Vector3(((float)x - (float)(nCount - 1) * 0.5f) * fSpacing, 0.0f, ((float)z - (float)(nCount - 1) * 0.5f) * fSpacing);
+			objFiles.insert({ x + z * nCount, { sFilename, transform } });
+		}
+	}
+	return objFiles;
+}
+
+//Render every bundled model at the given resolutions and write the results as JSON to sOutputFile (or to stdout if it is empty)
+static bool RunBenchmark(int nFrames, const std::vector<std::pair<int, int>>& resolutions, const RenderSettings& settings, const std::string& sOutputFile) {
+	const std::vector<BenchmarkScene> scenes = {
+		{ "Box",				{ {0, { "Models/Box.obj",					{Math::Vector3(0.0f, 0.0f, 4.0f), Math::Vector3(0.0f, 0.0f, 0.0f)} }} },	CameraPath::MakeOrbit(Math::Vector3(0.0f, 0.0f, 4.0f), 4.0f) },
+		{ "Monkey",				{ {0, { "Models/Monkey.obj",				{Math::Vector3(0.0f, 0.0f, 4.0f), Math::Vector3(0.0f, 0.0f, 0.0f)} }} },	CameraPath::MakeOrbit(Math::Vector3(0.0f, 0.0f, 4.0f), 3.0f) },
+		{ "human_female",		{ {0, { "Models/human_female.obj",			{Math::Vector3(0.0f, 0.0f, 10.0f), Math::Vector3(0.0f, 0.0f, 0.0f)} }} },	CameraPath::MakeOrbit(Math::Vector3(0.0f, 8.5f, 10.0f), 20.0f) },
+		{ "fantacy_tree_house",	{ {0, { "Models/fantacy_tree_house.obj",	{Math::Vector3(0.0f, 0.0f, 20.0f), Math::Vector3(0.0f, 0.0f, 0.0f)} }} },	CameraPath::MakeOrbit(Math::Vector3(3.4f, 15.6f, 18.6f), 40.0f) },
+		//Lots of small objects all around the camera. The camera turns around on the spot, so most of them are behind it at any time
+		{ "monkey_field",		MakeObjectGrid("Models/Monkey.obj", 16, 4.0f),																	CameraPath::MakeOrbit(Math::Vector3(0.0f, 0.0f, 0.0f), 0.0f) },
+	};
+
+	FILE* output = sOutputFile.empty() ? stdout : fopen(sOutputFile.c_str(), "w");
+	if (!output) {
+		printf("Couldn't open %s\n", sOutputFile.c_str());
+		return false;
+	}
+
+	fprintf(output, "{\n  \"frames\": %d,\n  \"rasterizer\": \"%s\",\n  \"threads\": %u,\n  \"simd\": \"%s\",\n",
+		nFrames, settings.rasterizer == Rasterizer::HalfSpace ? "halfspace" : "scanline", settings.nThreads != 0 ? settings.nThreads : std::max(1u, std::thread::hardware_concurrency()),
+		Math::SimdLevelName(std::min(settings.simdLevel, Math::GetSimdLevel())));
+	fprintf(output, "  \"cull\": \"%s\",\n  \"cull_space\": \"%s\",\n  \"frustum_culling\": %s,\n  \"cluster_culling\": %s,\n  \"hiz_culling\": %s,\n  \"occlusion_culling\": %s,\n  \"deferred_shading\": %s,\n  \"shading\": \"%s\",\n  \"textures\": %s,\n  \"mesh_cache\": %s,\n  \"weld_epsilon\": %g,\n  \"lod_threshold\": %g,\n  \"runs\": [",
+		CullModeName(settings.cullMode), settings.bObjectSpaceCulling ? "object" : "screen", settings.bFrustumCulling ? "true" : "false", settings.bClusterCulling ? "true" : "false", settings.bHiZCulling ? "true" : "false", settings.bOcclusionCulling ? "true" : "false", settings.bDeferredShading ? "true" : "false", ShadingModeName(settings.shadingMode),
+		settings.bTextureMapping ? "true" : "false", settings.bMeshCache ? "true" : "false", settings.fWeldEpsilon, settings.fLODThreshold);
+	bool bFirstRun = true;
+	for (const BenchmarkScene& scene : scenes) {
+		for (const std::pair<int, int>& resolution : resolutions) {
+			Pixel3DRenderingEngine renderingEngine;
+			if (renderingEngine.Construct(resolution.first, resolution.second, 1, 1) != olc::rcode::OK) continue;
+			renderingEngine.SetObjFiles(scene.objFiles);
+			ApplyRenderSettings(renderingEngine, settings);
+
+			RenderStats stats;
+			double dLoadTime = 0.0;
+			if (!renderingEngine.RunHeadless(nFrames, scene.cameraPath, "", &stats, &dLoadTime)) continue;
+
+			//Everything below is the average of a frame
+			const double dFrames = stats.nFrames > 0 ? (double)stats.nFrames : 1.0;
+			const double dTotalTime = stats.dFrameTime > 0.0 ? stats.dFrameTime : 1e-9;
+
+			fprintf(output, "%s\n    {\n", bFirstRun ? "" : ",");
+			fprintf(output, "      \"scene\": \"%s\",\n", scene.sName.c_str());
+			fprintf(output, "      \"width\": %d,\n      \"height\": %d,\n", resolution.first, resolution.second);
+			fprintf(output, "      \"load_ms\": %.3f,\n      \"mesh_load_ms\": %.3f,\n      \"meshes_from_cache\": %d,\n", dLoadTime * 1000.0, renderingEngine.GetMeshLoadTime() * 1000.0, renderingEngine.GetCachedMeshCount());
+			uint64_t nVerticesBeforeWeld = 0, nVerticesAfterWeld = 0;
+			renderingEngine.GetWeldStats(nVerticesBeforeWeld, nVerticesAfterWeld);
+			fprintf(output, "      \"vertices_loaded\": %llu,\n      \"vertices_welded\": %llu,\n      \"weld_reduction\": %.4f,\n", (unsigned long long)nVerticesBeforeWeld, (unsigned long long)nVerticesAfterWeld,
+				nVerticesBeforeWeld > 0 ? 1.0 - (double)nVerticesAfterWeld / (double)nVerticesBeforeWeld : 0.0);
+			VertexCacheStats vertexCacheBefore, vertexCacheAfter;
+			renderingEngine.GetVertexCacheStats(vertexCacheBefore, vertexCacheAfter);
+			fprintf(output, "      \"vertex_cache\": { \"acmr_before\": %.3f, \"acmr_after\": %.3f, \"atvr_before\": %.3f, \"atvr_after\": %.3f, \"overfetch_before\": %.3f, \"overfetch_after\": %.3f },\n",
+				vertexCacheBefore.ACMR(), vertexCacheAfter.ACMR(), vertexCacheBefore.ATVR(), vertexCacheAfter.ATVR(), vertexCacheBefore.Overfetch(), vertexCacheAfter.Overfetch());
+			fprintf(output, "      \"frame_ms\": %.4f,\n", stats.dFrameTime * 1000.0 / dFrames);
+			fprintf(output, "      \"stages_ms\": { \"clear\": %.4f, \"occlusion\": %.4f, \"transform\": %.4f, \"shading\": %.4f, \"raster\": %.4f, \"resolve\": %.4f },\n",
+				stats.dClearTime * 1000.0 / dFrames, stats.dOcclusionTime * 1000.0 / dFrames, stats.dTransformTime * 1000.0 / dFrames,
+				stats.dShadingTime * 1000.0 / dFrames, stats.dRasterTime * 1000.0 / dFrames, stats.dResolveTime * 1000.0 / dFrames);
+			fprintf(output, "      \"objects\": %d,\n      \"objects_culled\": %.1f,\n", (int)scene.objFiles.size(), stats.nObjectsCulled / dFrames);
+			fprintf(output, "      \"objects_occluded\": %.1f,\n      \"clusters_occlusion_culled\": %.1f,\n", stats.nObjectsOccluded / dFrames, stats.nClustersOcclusionCulled / dFrames);
+			fprintf(output, "      \"clusters\": %.1f,\n      \"clusters_culled\": %.1f,\n      \"triangles_cluster_culled\": %.1f,\n",
+				stats.nClusters / dFrames, stats.nClustersCulled / dFrames, stats.nTrianglesClusterCulled / dFrames);
+			fprintf(output, "      \"triangles\": %.1f,\n      \"triangles_culled\": %.1f,\n      \"triangles_rasterized\": %.1f,\n      \"pixels_written\": %.1f,\n      \"pixels_shaded\": %.1f,\n",
+				stats.nTrianglesSubmitted / dFrames, stats.nTrianglesCulled / dFrames, stats.nTrianglesRasterized / dFrames, stats.nPixelsWritten / dFrames, stats.nPixelsShaded / dFrames);
+			fprintf(output, "      \"clusters_occluded\": %.1f,\n      \"hiz_blocks_culled\": %.1f,\n", stats.nClustersOccluded / dFrames, stats.nHiZBlocksCulled / dFrames);
+			fprintf(output, "      \"objects_lod\": %.1f,\n      \"triangles_lod_reduced\": %.1f,\n", stats.nObjectsLOD / dFrames, stats.nTrianglesLODReduced / dFrames);
+			fprintf(output, "      \"fps\": %.3f,\n", stats.nFrames / dTotalTime);
+			fprintf(output, "      \"triangles_per_sec\": %.1f,\n", stats.nTrianglesSubmitted / dTotalTime);
+			fprintf(output, "      \"pixels_per_sec\": %.1f\n", stats.nPixelsWritten / dTotalTime);
+			fprintf(output, "    }");
+			fflush(output);
+			bFirstRun = false;
+		}
+	}
+	fprintf(output, "\n  ]\n}\n");
+
+	if (output != stdout) fclose(output);
+	return true;
+}
+
+int main(int argc, char* argv[]) {
 	Pixel3DRenderingEngine renderingEngine;
 
-	if (renderingEngine.Construct(800, 600, 1, 1) == olc::rcode::OK) {
+	//Command line options
+	// --headless          Render offscreen without a window. Useful for machines without a display or a GPU
+	// --frames <n>        Number of frames to render in headless mode (default 300)
+	// --size <w> <h>      Size of the screen in pixels (default 800 600)
+	// --dump <directory>  Write every headless frame to the directory as a .ppm image. Frames are discarded if this is not given
+	// --benchmark         Render every bundled model headless at 320x240, 800x600 and 1920x1080 (or only at --size) and print the results as JSON
+	// --output <file>     Write the benchmark results to the file instead of stdout
+	// --rasterizer <name> halfspace (default) or scanline
+	// --threads <n>       Number of threads that render the frame (default 0, one per hardware thread). Only the halfspace rasterizer uses more than one
+	// --simd <level>      Instruction set of the vertex transform: scalar, sse or avx2 (default is the best one the CPU supports)
+	// --cull <mode>       Faces every mesh culls: back (default), front or none
+	// --cull-object-space Do the backface test in object space instead of screen space
+	// --no-frustum-cull   Transform every object even if it's outside the view frustum
+	// --no-cluster-cull   Transform and test every triangle of a visible object instead of culling its meshlets first
+	// --no-hiz            Don't keep the hierarchical depth buffer. Every triangle is rasterized pixel by pixel
+	// --occlusion-cull    Draw the big occluders into a small depth buffer first and skip the objects and meshlets hidden behind them
+	// --deferred          Rasterize into a visibility buffer and light every visible pixel once afterwards
+	// --shading <mode>    flat (default), gouraud or phong
+	// --no-textures       Draw the materials without their textures and colors
+	// --no-mesh-cache     Parse the .obj files every time instead of keeping them in binary caches next to them (<file>.p3dmesh)
+	// --weld-epsilon <e>  Also merge the vertices of a mesh that are less than e apart on every axis (default 0, only the same vertices are merged)
+	// --lod-threshold <p> Largest estimated mean error in pixels of the simplified level of detail an object is drawn with (default 1, 0 always draws the full meshes)
+	bool bHeadless = false;
+	bool bBenchmark = false;
+	bool bCustomSize = false;
+	int nFrames = 300;
+	int nScreenWidth = 800, nScreenHeight = 600;
+	std::string sFrameDumpDirectory;
+	std::string sOutputFile;
+	RenderSettings settings;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--headless") bHeadless = true;
+		else if (arg == "--frames" && i + 1 < argc) nFrames = std::atoi(argv[++i]);
+		else if (arg == "--size" && i + 2 < argc) { nScreenWidth = std::atoi(argv[++i]); nScreenHeight = std::atoi(argv[++i]); bCustomSize = true; }
+		else if (arg == "--dump" && i + 1 < argc) sFrameDumpDirectory = argv[++i];
+		else if (arg == "--benchmark") bBenchmark = true;
+		else if (arg == "--output" && i + 1 < argc) sOutputFile = argv[++i];
+		else if (arg == "--threads" && i + 1 < argc) settings.nThreads = (unsigned int)std::atoi(argv[++i]);
+		else if (arg == "--cull-object-space") settings.bObjectSpaceCulling = true;
+		else if (arg == "--no-frustum-cull") settings.bFrustumCulling = false;
+		else if (arg == "--no-cluster-cull") settings.bClusterCulling = false;
+		else if (arg == "--no-hiz") settings.bHiZCulling = false;
+		else if (arg == "--occlusion-cull") settings.bOcclusionCulling = true;
+		else if (arg == "--deferred") settings.bDeferredShading = true;
+		else if (arg == "--no-textures") settings.bTextureMapping = false;
+		else if (arg == "--no-mesh-cache") settings.bMeshCache = false;
+		else if (arg == "--weld-epsilon" && i + 1 < argc) settings.fWeldEpsilon = (float)std::atof(argv[++i]);
+		else if (arg == "--lod-threshold" && i + 1 < argc) settings.fLODThreshold = (float)std::atof(argv[++i]);
+		else if (arg == "--shading" && i + 1 < argc) {
+			std::string name = argv[++i];
+			if (name == "flat") settings.shadingMode = ShadingMode::Flat;
+			else if (name == "gouraud") settings.shadingMode = ShadingMode::Gouraud;
+			else if (name == "phong") settings.shadingMode = ShadingMode::Phong;
+			else {
+				printf("Unknown shading mode %s\n", name.c_str());
+				return 1;
+			}
+		}
+		else if (arg == "--simd" && i + 1 < argc) {
+			std::string name = argv[++i];
+			if (name == "scalar") settings.simdLevel = Math::SimdLevel::Scalar;
+			else if (name == "sse") settings.simdLevel = Math::SimdLevel::SSE;
+			else if (name == "avx2") settings.simdLevel = Math::SimdLevel::AVX2;
+			else {
+				printf("Unknown instruction set %s\n", name.c_str());
+				return 1;
+			}
+		}
+		else if (arg == "--rasterizer" && i + 1 < argc) {
+			std::string name = argv[++i];
+			if (name == "halfspace") settings.rasterizer = Rasterizer::HalfSpace;
+			else if (name == "scanline") settings.rasterizer = Rasterizer::Scanline;
+			else {
+				printf("Unknown rasterizer %s\n", name.c_str());
+				return 1;
+			}
+		}
+		else if (arg == "--cull" && i + 1 < argc) {
+			std::string name = argv[++i];
+			if (name == "back") settings.cullMode = CullMode::Back;
+			else if (name == "front") settings.cullMode = CullMode::Front;
+			else if (name == "none") settings.cullMode = CullMode::Disabled;
+			else {
+				printf("Unknown cull mode %s\n", name.c_str());
+				return 1;
+			}
+		}
+		else {
+			printf("Unknown option %s\n", arg.c_str());
+			return 1;
+		}
+	}
+
+	if (bBenchmark) {
+		std::vector<std::pair<int, int>> resolutions = { {320, 240}, {800, 600}, {1920, 1080} };
+		if (bCustomSize) resolutions = { {nScreenWidth, nScreenHeight} };
+		return RunBenchmark(nFrames, resolutions, settings, sOutputFile) ? 0 : 1;
+	}
+
+	ApplyRenderSettings(renderingEngine, settings);
+	if (renderingEngine.Construct(nScreenWidth, nScreenHeight, 1, 1) == olc::rcode::OK) {
+		if (bHeadless) {
+			//Orbit around the tree house
+			CameraPath cameraPath = CameraPath::MakeOrbit(Math::Vector3(3.4f, 15.6f, 18.6f), 40.0f);
+			RenderStats stats;
+			if (!renderingEngine.RunHeadless(nFrames, cameraPath, sFrameDumpDirectory, &stats)) return 1;
+			printf("Rendered %d frames at %dx%d in %.3f ms (%.3f ms per frame, %.2f fps)\n",
+				(int)stats.nFrames, nScreenWidth, nScreenHeight,
+				stats.dFrameTime * 1000.0,
+				stats.nFrames > 0 ? stats.dFrameTime * 1000.0 / stats.nFrames : 0.0,
+				stats.dFrameTime > 0.0 ? stats.nFrames / stats.dFrameTime : 0.0);
+			return 0;
+		}
 		renderingEngine.Start();
 	}
 